@@ -6,22 +6,25 @@
 
 // sensor libraries
 #include <FastLED.h>
-#include <DHT.h>
 #include <Wire.h>
 #include <Digital_Light_TSL2561.h>
-#include <SoftwareSerial.h>
 #include <EEPROM.h>
+#if defined(__AVR__)
+#include <avr/sleep.h>
+#endif
 
 // Choose one of the following
-// Either you get press and release 
+// Either you get press and release and the host recognizes the gestures, see SensorBoard::setGestures()
+// Or you get Single press, double press, long press etc., single presses only after DOUBLE_PRESS_DELAY
 // #define STATEFULL_PRESS
-// Or you get Single press, double press, long press etc.
 
 
 // SoftwareSerial softSerial(10,11);
+// Note: SoftwareSerial occupies all pin change interrupts on AVR, which the DHT readout needs
 
 #if defined(ESP8266)
 void ICACHE_RAM_ATTR buttonISR();
+void ICACHE_RAM_ATTR dhtISR();
 #endif
 enum class BUTTON_PRESS {NONE=0, SINGLE=1, DOUBLE=2, LONG_START=3, RELEASE=4};
 void buttonPressed(BUTTON_PRESS press);
@@ -37,31 +40,175 @@ void buttonPressed(BUTTON_PRESS press);
 #endif
 
 #define BRIGHTNESS_ADDRESS 0
+#define BAUD_ADDRESS 1
+#define CONFIG_ADDRESS 5
 
 // Serial stuff
+#ifndef SERIAL_SPEED
 #define SERIAL_SPEED 38400
+#endif
+// Baud rates the host may negotiate
+#define MIN_BAUD 9600
+#define MAX_BAUD (F_CPU/8)
+// Fall back to the old baud rate if the host does not commit the new one in time
+#define BAUD_TRIAL_TIMEOUT 500
+uint32_t baud = SERIAL_SPEED;
+uint32_t oldBaud = SERIAL_SPEED;
+bool baudTrial = false;
+long baudTimer = millis();
+// Max time between two bytes of a frame before it is dropped
+#define SERIAL_TIMEOUT 20
+// Bytes framed and commands handled per loop() run, so sensors and fades keep running under load
+#define RX_BUDGET 32
+#define CMD_BUDGET 2
+// Number of received commands waiting to be handled
+#define CMD_QUEUE_SIZE 4
 // #define DEBUG
 // #define USE_ASCI_INT
 #define USE_SENSORS
 
-#define debugSerial Serial
+// Can be defined externally, e.g. to route the link through another stream
+#ifndef com
 #define com Serial
+#endif
+#ifndef debugSerial
+#define debugSerial Serial
+#endif
+
+// Toggle a pin on button edges, handled commands and LED shows
+// to measure latencies with a logic analyzer
+// #define TIMING_PIN 8
+#ifdef TIMING_PIN
+#define TIMING_MARK() digitalWrite(TIMING_PIN, !digitalRead(TIMING_PIN))
+#else
+#define TIMING_MARK()
+#endif
 
 // LED
 // Define the array of leds
+#ifndef NUM_LEDS
 #define NUM_LEDS 3
+#endif
 CRGB leds[NUM_LEDS];
 CRGB fadeColor[NUM_LEDS];
 CRGB black = CRGB::Black;
 bool ledUpdate = false;
+// A show turns interrupts off for about 30us per LED and would swallow edges
+// of the DHT22's answer, so shows wait until the conversion is done
+bool showPending = false;
 
 //DHT
-#ifdef USE_SENSORS
-DHT dht(DHT_PIN, DHT22);
-#endif
+// The DHT22 is read in the background: loop() pulls the line low for the start signal,
+// a timer releases it and the pin change interrupt decodes the bits from the length of each high phase
+#define DHT_IDLE 0
+#define DHT_START 1
+#define DHT_READING 2
+// Min time between two conversions of the DHT22
+#define DHT_UPDATE_INTV 2000
+// Length of the start signal, at least 1ms
+#define DHT_START_SIGNAL 2
+// Timer2 ticks of the start signal at clk/256
+#define DHT_START_TICKS (F_CPU/256/1000*DHT_START_SIGNAL-1)
+// A conversion takes about 5ms
+#define DHT_READ_TIMEOUT 10
+// High phases longer than this in us are a one
+#define DHT_ONE_THRESHOLD 45
+// Failed conversions in a row until the cached values are invalid
+#define DHT_MAX_ERRORS 3
+// Changed by the timer interrupt that ends the start signal
+volatile uint8_t dhtState = DHT_IDLE;
+volatile long dhtTimer = millis();
+// Received bits, negative during the sensor's response
+volatile int8_t dhtBits = 0;
+volatile uint8_t dhtData[5];
+volatile unsigned long dhtRise = 0;
+// Last successful conversion
+float dhtTemp = NAN;
+float dhtHum = NAN;
+bool dhtValid = false;
+unsigned long dhtTime = 0;
+uint8_t dhtErrors = 0;
 // automaticall send data on change and with hysteresis
 bool autoSend = false;
 
+// Protocol version announced during the ??/!! handshake
+// 0: legacy line based frames '!' CMD PAYLOAD '\r\n'
+// 1: binary frames SOF LEN CMD PAYLOAD[LEN] CRC8
+// 2: bulk sensor query ?s
+// 3: queries may carry a sequence id that is echoed in the reply
+// 4: partial LED update !U
+// 5: blink, round and glow patterns run on the board !P
+// 6: baud rate negotiation !B, echo test ?e and commit !C
+// 7: deadband and send intervals per sensor for auto mode !F
+// 8: config blob stored on the board ?c/!c
+// 9: events end with the board time they were sampled at, clock ping ?T
+// 10: temperature and humidity as int16 in 1/100 units, light as varint
+#define PROTOCOL_VERSION 10
+#define PROTO_LEGACY 0
+#define PROTO_BINARY 1
+#define PROTO_BULK 2
+#define PROTO_SEQ 3
+#define PROTO_LED_DELTA 4
+#define PROTO_PATTERN 5
+#define PROTO_BAUD 6
+#define PROTO_FILTER 7
+#define PROTO_CONFIG 8
+#define PROTO_TIME 9
+#define PROTO_COMPACT 10
+// Event stamps are 16 bit ms, the host unwraps them within half of that
+#define MAX_STAMP_AGE 30000UL
+#define FRAME_SOF 0xA5
+// Set in the command byte if the payload starts with a sequence id
+#define SEQ_FLAG 0x80
+// Flag of the partial LED update to fade towards the new colors
+#define LED_FADE 0x01
+// Large enough for a full LED frame and the config blob
+#define MAX_PAYLOAD (3*NUM_LEDS+1 > 48 ? 3*NUM_LEDS+1 : 48)
+// Frame and command lengths are a single byte, including the sequence id of a tagged frame
+#if MAX_PAYLOAD+1 > 255
+#error "NUM_LEDS too large for a single LED frame"
+#endif
+// Negotiated with the host
+uint8_t protocol = PROTO_LEGACY;
+// Query currently answered and its sequence id echoed in the reply
+char replyCmd = 0;
+uint8_t replySeq = 0;
+
+// Complete commands framed from the received bytes
+struct Command {
+  // With SEQ_FLAG if the payload starts with a sequence id
+  uint8_t cmd;
+  uint8_t len;
+  uint8_t data[MAX_PAYLOAD];
+};
+Command cmdQueue[CMD_QUEUE_SIZE];
+uint8_t cmdHead = 0;
+uint8_t cmdCount = 0;
+
+// Resumable frame parser, fills the next free slot of the queue
+#define RX_START 0
+#define RX_CMD 1
+#define RX_ARGS 2
+#define RX_END 3
+#define RX_BIN_LEN 4
+#define RX_BIN_CMD 5
+#define RX_BIN_PAYLOAD 6
+#define RX_BIN_CRC 7
+uint8_t rxState = RX_START;
+uint8_t rxExpected = 0;
+uint8_t rxCrc = 0;
+long rxTimer = millis();
+#ifdef USE_ASCI_INT
+uint8_t rxValue = 0;
+bool rxDigits = false;
+#endif
+
+// Validity bits of the bulk sensor frame
+#define VALID_LIGHT 0x01
+#define VALID_TEMP 0x02
+#define VALID_HUM 0x04
+#define VALID_PIR 0x08
+
 // old values for sensors
 float temp = -1;
 float hum = -1;
@@ -70,15 +217,54 @@ uint8_t pir = 255;
 
 uint8_t brightness = 255;
 
+// Auto mode sends a value only if it moved by more than the deadband, not faster than
+// minInterval and at least every maxInterval (0 for none), set by the host with !F
+struct SensorFilter {
+  float deadband;
+  uint16_t minInterval;
+  uint32_t maxInterval;
+  long lastSent;
+  // Send the next value regardless, e.g. once auto mode starts
+  bool force;
+};
+// Filters in the order of their query commands
+#define FILTER_SENSORS "thlp"
+#define NUM_FILTERS 4
+SensorFilter filters[NUM_FILTERS];
+
+// Config blob: version, brightness, filters (deadband, min and max interval) and crc
+#define CONFIG_VERSION 1
+#define CONFIG_SIZE 43
+
 // Update timers
+long pirUpdate = millis();
 long lightUpdate = millis();
 long tempUpdate = millis();
 long humUpdate = millis();
 #define LIGHT_UPDATE_INTV 5000
 #define TEMP_UPDATE_INTV 5000
 #define HUM_UPDATE_INTV TEMP_UPDATE_INTV // as it is from the same sensor
+#define PIR_UPDATE_INTV 50
+// Returned by nextDeadline() if no timed work is pending
+#define NO_DEADLINE 0xFFFFFFFFUL
 
 uint8_t fadeDelay = 5;
+long fadeTimer = millis();
+
+// LED pattern animated on the board, same numbers as the host's LEDPattern
+#define PATTERN_NONE 0
+#define PATTERN_BLINK 1
+#define PATTERN_ROUND 2
+#define PATTERN_GLOW 3
+uint8_t pattern = PATTERN_NONE;
+CRGB patternFG;
+CRGB patternBG;
+uint16_t patternStep = 0;
+// -1 for infinite
+long patternDuration = -1;
+long patternStart = millis();
+long patternTimer = millis();
+uint8_t patternState = 0;
 
 #define DOUBLE_PRESS_DELAY 900
 #define LONG_PRESS_DELAY 5000
@@ -127,6 +313,8 @@ void handleButton() {
 }
 
 void buttonPressed(BUTTON_PRESS press) {
+  // Single, double and long presses started with the last press
+  unsigned long time = press == BUTTON_PRESS::RELEASE ? lastTime : lastPressed;
   switch (press) {
     case BUTTON_PRESS::NONE:
       break;
@@ -134,25 +322,25 @@ void buttonPressed(BUTTON_PRESS press) {
       #ifdef DEBUG
       debugSerial.println("Single press");
       #endif
-      com.println("!b1");
+      sendEvent('b', (const uint8_t *)"1", 1, time);
       break;
     case BUTTON_PRESS::DOUBLE:
       #ifdef DEBUG  
       debugSerial.println("Double press");
       #endif
-      com.println("!b2");
+      sendEvent('b', (const uint8_t *)"2", 1, time);
       break;
     case BUTTON_PRESS::LONG_START:
       #ifdef DEBUG
       debugSerial.println("Long press start");
       #endif
-      com.println("!b3");
+      sendEvent('b', (const uint8_t *)"3", 1, time);
       break;
     case BUTTON_PRESS::RELEASE:
       #ifdef DEBUG
       debugSerial.println("Long press end");
       #endif
-      com.println("!b4");
+      sendEvent('b', (const uint8_t *)"4", 1, time);
       break;
     default:
       break;
@@ -169,6 +357,7 @@ void buttonISR() {
   // Debounce delay
   if (millis()-lastTime < 10) return;
   lastTime = millis();
+  TIMING_MARK();
   if (state) {
     #ifdef DEBUG
     debugSerial.println("Pressed");
@@ -186,6 +375,34 @@ void buttonISR() {
 }
 
 #else 
+// Edges latched by the ISR and sent from loop(), so their frames never land within another one
+#define EDGE_QUEUE_SIZE 8
+volatile bool edgePressed[EDGE_QUEUE_SIZE];
+volatile unsigned long edgeTime[EDGE_QUEUE_SIZE];
+volatile uint8_t edgeHead = 0;
+volatile uint8_t edgeTail = 0;
+
+void handleButton() {
+  // The ISR fills a slot before it moves the head and only reuses it after we moved the tail
+  while (edgeTail != edgeHead) {
+    uint8_t i = edgeTail & (EDGE_QUEUE_SIZE-1);
+    bool state = edgePressed[i];
+    unsigned long time = edgeTime[i];
+    edgeTail++;
+    if (state) {
+      #ifdef DEBUG
+      debugSerial.println("Pressed");
+      #endif
+      sendEvent('b', NULL, 0, time);
+    } else {
+      #ifdef DEBUG
+      debugSerial.println("Released");
+      #endif
+      sendEvent('r', NULL, 0, time);
+    }
+  }
+}
+
 #if defined(ESP8266)
 void ICACHE_RAM_ATTR buttonISR() {
 #else
@@ -196,24 +413,26 @@ void buttonISR() {
   // Debounce delay
   if (millis()-lastTime < 10) return;
   lastTime = millis();
-  if (state) {
-    #ifdef DEBUG
-    debugSerial.println("Pressed");
-    #endif
-    com.println("!b");
-  } else {
-    #ifdef DEBUG
-    debugSerial.println("Released");
-    #endif
-    com.println("!r");
+  TIMING_MARK();
+  // Only if loop() stalls for several presses, the edge is lost then
+  if ((uint8_t)(edgeHead - edgeTail) < EDGE_QUEUE_SIZE) {
+    uint8_t i = edgeHead & (EDGE_QUEUE_SIZE-1);
+    edgePressed[i] = state;
+    edgeTime[i] = lastTime;
+    edgeHead++;
   }
   oldState = state;
 }
 #endif
 
 void setup() {
-  // Init serial
-  com.begin(SERIAL_SPEED);
+  #if defined(ESP8266)
+  EEPROM.begin(512);
+  #endif
+  // Init serial with the rate negotiated last time
+  EEPROM.get(BAUD_ADDRESS, baud);
+  if (baud < MIN_BAUD or baud > MAX_BAUD) baud = SERIAL_SPEED;
+  com.begin(baud);
   #ifdef DEBUG
   #if debugSerial != com
   debugSerial.begin(SERIAL_SPEED);
@@ -237,12 +456,16 @@ void setup() {
   // allLEDs(fadeColor, NUM_LEDS, black);
   // // Fade black
   // ledUpdate = true;
-  #if defined(ESP8266)
-  EEPROM.begin(512);
+  // Load the config, older versions only stored the brightness
+  uint8_t config[CONFIG_SIZE];
+  for (int i = 0; i < CONFIG_SIZE; i++) config[i] = EEPROM.read(CONFIG_ADDRESS+i);
+  if (!applyConfig(config)) {
+    EEPROM.get(BRIGHTNESS_ADDRESS, brightness);
+    FastLED.setBrightness(brightness);
+  }
+  #ifdef TIMING_PIN
+  pinMode(TIMING_PIN, OUTPUT);
   #endif
-  // Load and set brightness
-  EEPROM.get(BRIGHTNESS_ADDRESS, brightness);
-  FastLED.setBrightness(brightness);
   // Set button as input and configure pin interrupt
   pinMode(BUTTON_PIN, INPUT_PULLUP);
   attachInterrupt(digitalPinToInterrupt(BUTTON_PIN), buttonISR, CHANGE); 
@@ -258,9 +481,12 @@ void setup() {
   debugSerial.println("DHT init");
   #endif
   bool success = true;
-  dht.begin();
-  float te = dht.readTemperature();
-  if (te >= 0 && te < 100) success &= true;
+  // First conversion right away, later ones run in the background
+  dhtTimer = millis()-DHT_UPDATE_INTV;
+  do {
+    updateDHT();
+  } while (dhtState != DHT_IDLE);
+  if (dhtValid and dhtTemp >= 0 and dhtTemp < 100) success &= true;
   else success = false;
   #ifdef DEBUG
   debugSerial.println("TSL2561 init");
@@ -293,18 +519,24 @@ void setup() {
 
 
 void loop() {
-  #ifdef STATEFULL_PRESS
   handleButton();
+  #ifdef USE_SENSORS
+  updateDHT();
   #endif
-  // recieve command from powermeter
-  if (com.available()) {
-    // No sensor updates on flood requests
-    handleEvent();
-    return;
+  // New baud rate was not committed, the host cannot hear us
+  if (baudTrial and millis()-baudTimer > BAUD_TRIAL_TIMEOUT) {
+    baudTrial = false;
+    setBaud(oldBaud);
   }
+  // recieve command from powermeter
+  receiveCommands();
+  handleCommands();
   #ifdef USE_SENSORS
   if (autoSend) {
-    sendPIR(true);
+    if (millis()-pirUpdate > PIR_UPDATE_INTV) {
+      pirUpdate = millis();
+      sendPIR(true);
+    }
     if (millis()-lightUpdate > LIGHT_UPDATE_INTV) {
       lightUpdate = millis();
       sendLight(true);
@@ -319,43 +551,277 @@ void loop() {
     }
   }
   #endif
+  updatePattern();
   // As long as fade is not finished, continue fading
-  if (ledUpdate) {
+  if (ledUpdate and dhtState != DHT_READING and millis()-fadeTimer >= fadeDelay) {
+    fadeTimer = millis();
     ledUpdate = !fadeit();
-    FastLED.show();
-    // Becomes slightly irresponsive on LED updates
-    FastLED.delay(fadeDelay); 
+    showLEDs();
+  }
+  #if defined(__AVR__)
+  // Nothing due, idle until the next interrupt (timer tick, serial or button)
+  if (nextDeadline() > 0) {
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    sleep_mode();
+  }
+  #endif
+}
+
+// Time left until since+interval, 0 if already passed
+unsigned long remaining(long since, unsigned long interval) {
+  unsigned long passed = millis()-since;
+  return passed > interval ? 0 : interval - passed + 1;
+}
+
+// Time in ms until loop() has timed work to do
+unsigned long nextDeadline() {
+  if (cmdCount > 0 or com.available()) return 0;
+  #ifdef STATEFULL_PRESS
+  // Press detection runs on timeouts
+  if (pressed != 0) return 0;
+  #else
+  // Edges to send
+  if (edgeTail != edgeHead) return 0;
+  #endif
+  unsigned long next = NO_DEADLINE;
+  if (ledUpdate and dhtState != DHT_READING) next = remaining(fadeTimer, fadeDelay);
+  if (baudTrial) next = min(next, remaining(baudTimer, BAUD_TRIAL_TIMEOUT));
+  // Drop a partial frame once the rest does not arrive
+  if (rxState != RX_START) next = min(next, remaining(rxTimer, SERIAL_TIMEOUT));
+  #ifdef USE_SENSORS
+  switch (dhtState) {
+    case DHT_IDLE: next = min(next, remaining(dhtTimer, DHT_UPDATE_INTV)); break;
+    #if defined(__AVR__)
+    // The timer wakes us up
+    case DHT_START: break;
+    #else
+    case DHT_START: next = min(next, remaining(dhtTimer, DHT_START_SIGNAL)); break;
+    #endif
+    // The interrupt wakes us up for each bit
+    default: next = dhtBits >= 40 ? 0 : min(next, remaining(dhtTimer, DHT_READ_TIMEOUT)); break;
+  }
+  if (autoSend) {
+    next = min(next, remaining(pirUpdate, PIR_UPDATE_INTV));
+    next = min(next, remaining(lightUpdate, LIGHT_UPDATE_INTV));
+    next = min(next, remaining(humUpdate, HUM_UPDATE_INTV));
+    next = min(next, remaining(tempUpdate, TEMP_UPDATE_INTV));
   }
+  #endif
+  if (pattern != PATTERN_NONE) {
+    next = min(next, remaining(patternTimer, patternStep));
+    if (patternDuration >= 0) next = min(next, remaining(patternStart, patternDuration));
+  }
+  return next;
 }
 
 
-void handleEvent() {
-  if (!(com.available()>2)) return;
-  char c = com.read();
-  // If it is not a !, return
-  if (c != '?' and c != '!') return;
-  // Let all data be sent by the sink
-  delay(2);
-  char d = com.read();
-  switch (d) {
-    case '?':
-      com.println("!!");
+// Number of payload bytes of a legacy command
+uint8_t legacyArgs(char cmd) {
+  switch (cmd) {
+    case 'b': return 1;
+    case 'L': return 3*NUM_LEDS;
+    default: return 0;
+  }
+}
+
+// Frame the bytes received so far, stops once the queue is full
+void receiveCommands() {
+  if (rxState != RX_START and millis()-rxTimer > SERIAL_TIMEOUT) {
+    #ifdef DEBUG
+    debugSerial.println("Frame timeout");
+    #endif
+    rxState = RX_START;
+  }
+  for (int i = 0; i < RX_BUDGET and cmdCount < CMD_QUEUE_SIZE and com.available(); i++) {
+    rxTimer = millis();
+    parseByte(com.read());
+  }
+}
+
+void parseByte(uint8_t c) {
+  Command *command = &cmdQueue[(cmdHead+cmdCount) % CMD_QUEUE_SIZE];
+  switch (rxState) {
+    case RX_START:
+      command->len = 0;
+      if (c == FRAME_SOF) rxState = RX_BIN_LEN;
+      // If it is not a ! or ?, skip it
+      else if (c == '?' or c == '!') rxState = RX_CMD;
       break;
-    case 'b':
+    case RX_CMD:
+      command->cmd = c;
+      rxExpected = legacyArgs(c);
+      rxState = rxExpected ? RX_ARGS : RX_END;
+      break;
+    case RX_ARGS:
       #ifdef USE_ASCI_INT
-      brightness = com.parseInt();
+      if (c >= '0' and c <= '9') {
+        rxValue = rxValue*10 + c-'0';
+        rxDigits = true;
+        break;
+      }
+      // Separator between the values
+      if (!rxDigits) break;
+      command->data[command->len++] = rxValue;
+      rxValue = 0;
+      rxDigits = false;
+      // The char after the last value may already be the fade flag or line end
+      if (command->len >= rxExpected) {
+        rxState = RX_END;
+        parseByte(c);
+      }
       #else
-      brightness = com.read();
+      command->data[command->len++] = c;
+      if (command->len >= rxExpected) rxState = RX_END;
       #endif
-      EEPROM.put(BRIGHTNESS_ADDRESS, brightness);
+      break;
+    case RX_END:
+      if (c == '\n') {
+        pushCommand();
+      // Optional protocol version of the host
+      } else if (command->cmd == '?' and command->len == 0 and c != '\r') {
+        command->data[command->len++] = c;
+      // Optional fade flag of the LED frame
+      } else if (command->cmd == 'L' and command->len == 3*NUM_LEDS and c == 'f') {
+        command->data[command->len++] = c;
+      }
+      break;
+    case RX_BIN_LEN:
+      rxExpected = c;
+      rxCrc = crc8(0, c);
+      rxState = c <= MAX_PAYLOAD ? RX_BIN_CMD : RX_START;
+      break;
+    case RX_BIN_CMD:
+      command->cmd = c;
+      rxCrc = crc8(rxCrc, c);
+      rxState = rxExpected ? RX_BIN_PAYLOAD : RX_BIN_CRC;
+      break;
+    case RX_BIN_PAYLOAD:
+      command->data[command->len++] = c;
+      rxCrc = crc8(rxCrc, c);
+      if (command->len >= rxExpected) rxState = RX_BIN_CRC;
+      break;
+    case RX_BIN_CRC:
+      if (c == rxCrc) {
+        pushCommand();
+      } else {
+        rxState = RX_START;
+        #ifdef DEBUG
+        debugSerial.println("CRC error");
+        #endif
+      }
+      break;
+    default:
+      rxState = RX_START;
+      break;
+  }
+}
+
+// The command at the end of the queue is complete
+void pushCommand() {
+  cmdCount++;
+  rxState = RX_START;
+}
+
+// Handle a few of the queued commands
+void handleCommands() {
+  for (int i = 0; i < CMD_BUDGET and cmdCount > 0; i++) {
+    Command *command = &cmdQueue[cmdHead];
+    // Tagged query, the reply echoes the sequence id
+    if ((command->cmd & SEQ_FLAG) and command->len > 0) {
+      replyCmd = (char)(command->cmd & ~SEQ_FLAG);
+      replySeq = command->data[0];
+      handleCommand(replyCmd, command->data+1, command->len-1);
+      replyCmd = 0;
+    } else {
+      handleCommand((char)command->cmd, command->data, command->len);
+    }
+    cmdHead = (cmdHead+1) % CMD_QUEUE_SIZE;
+    cmdCount--;
+  }
+}
+
+void handleCommand(char cmd, const uint8_t *data, uint8_t len) {
+  TIMING_MARK();
+  switch (cmd) {
+    case '?': {
+      // Old hosts do not send their protocol version
+      uint8_t version = PROTO_LEGACY;
+      if (len > 0 and data[0] >= '0') version = data[0] - '0';
+      // Always answer in legacy framing, so the host can parse it
+      protocol = PROTO_LEGACY;
+      uint8_t own = '0' + PROTOCOL_VERSION;
+      sendFrame('!', &own, 1);
+      protocol = version < PROTOCOL_VERSION ? version : PROTOCOL_VERSION;
+      break;
+    }
+    case 'b':
+      if (len < 1) break;
+      // Only stored with the next config from the host
+      brightness = data[0];
       FastLED.setBrightness(brightness);
-      FastLED.show();
+      showLEDs();
       #ifdef DEBUG
       debugSerial.print("Set brightess to: ");
-      EEPROM.get(BRIGHTNESS_ADDRESS, brightness);
       debugSerial.println(brightness);
       #endif
       break;
+    // Config: a query without payload, otherwise the new blob to apply and store
+    case 'c': {
+      if (len >= CONFIG_SIZE and applyConfig(data)) storeEEPROM(CONFIG_ADDRESS, data, CONFIG_SIZE);
+      uint8_t config[CONFIG_SIZE];
+      uint8_t reply[2] = {CONFIG_VERSION, buildConfig(config)};
+      sendFrame('c', reply, 2);
+      #ifdef DEBUG
+      debugSerial.println("Config");
+      #endif
+      break;
+    }
+    // Switch the baud rate after the ack went out, on trial until committed
+    case 'B': {
+      if (len < 4) break;
+      uint32_t newBaud;
+      memcpy(&newBaud, data, 4);
+      if (newBaud < MIN_BAUD or newBaud > MAX_BAUD) newBaud = 0;
+      sendFrame('B', (const uint8_t *)&newBaud, 4);
+      if (newBaud == 0) break;
+      com.flush();
+      if (!baudTrial) oldBaud = baud;
+      setBaud(newBaud);
+      baudTrial = true;
+      baudTimer = millis();
+      break;
+    }
+    case 'e':
+      sendFrame('e', data, len);
+      break;
+    // Clock ping, the host maps the event times with it
+    case 'T': {
+      uint32_t now = millis();
+      sendFrame('T', (const uint8_t *)&now, 4);
+      break;
+    }
+    // Filter: sensor, deadband, min and max interval
+    case 'F': {
+      if (len < 11) break;
+      const char *sensor = strchr(FILTER_SENSORS, data[0]);
+      if (data[0] == 0 or sensor == NULL) break;
+      SensorFilter *filter = &filters[sensor - FILTER_SENSORS];
+      memcpy(&filter->deadband, &data[1], 4);
+      memcpy(&filter->minInterval, &data[5], 2);
+      memcpy(&filter->maxInterval, &data[7], 4);
+      #ifdef DEBUG
+      debugSerial.print("Filter: ");
+      debugSerial.println((char)data[0]);
+      #endif
+      break;
+    }
+    case 'C':
+      if (baudTrial) {
+        baudTrial = false;
+        storeEEPROM(BAUD_ADDRESS, (const uint8_t *)&baud, 4);
+      }
+      sendFrame('C', NULL, 0);
+      break;
     case 'a':
       autoSend = true;
       //  New values on next run
@@ -366,6 +832,7 @@ void handleEvent() {
       hum = -1;
       light = -1;
       pir = 255;
+      for (int i = 0; i < NUM_FILTERS; i++) filters[i].force = true;
       #ifdef DEBUG
       debugSerial.println("Autosend on");
       #endif
@@ -405,31 +872,25 @@ void handleEvent() {
       debugSerial.println(light);
       #endif
       break;
+    case 's':
+      sendSensors();
+      #ifdef DEBUG
+      debugSerial.println("Sensors send");
+      #endif
+      break;
     #endif
     case 'L':
-      delay(10);
-      if (com.available() < 3*NUM_LEDS) return;
-      #ifdef USE_ASCI_INT
+      if (len < 3*NUM_LEDS) break;
+      pattern = PATTERN_NONE;
       for (int i = 0; i < NUM_LEDS; i++) {
-        uint8_t r = com.parseInt();
-        uint8_t g = com.parseInt();
-        uint8_t b = com.parseInt();
-        fadeColor[i] = CRGB(r,g,b);
+        fadeColor[i] = CRGB(data[3*i], data[3*i+1], data[3*i+2]);
       }
-      #else
-      for (int i = 0; i < NUM_LEDS; i++) {
-        uint8_t r = com.read();
-        uint8_t g = com.read();
-        uint8_t b = com.read();
-        fadeColor[i] = CRGB(r,g,b);
-      }
-      #endif
-      // Will only get \n
-      if (com.available() and com.read() == 'f') {
+      if (len > 3*NUM_LEDS and data[3*NUM_LEDS] == 'f') {
         ledUpdate = true;
       } else {
         for (int i = 0; i < NUM_LEDS; i++) leds[i] = fadeColor[i];
-        FastLED.show();
+        showLEDs();
+        TIMING_MARK();
       }
       #ifdef DEBUG
       debugSerial.print("Set LED to: ");
@@ -445,76 +906,442 @@ void handleEvent() {
       debugSerial.println();
       #endif
       break;
+    // Partial update: flags followed by index and color of each changed LED
+    case 'U': {
+      if (len < 1) break;
+      pattern = PATTERN_NONE;
+      bool fade = data[0] & LED_FADE;
+      for (int i = 1; i+3 < len; i += 4) {
+        uint8_t l = data[i];
+        if (l >= NUM_LEDS) continue;
+        fadeColor[l] = CRGB(data[i+1], data[i+2], data[i+3]);
+        if (!fade) leds[l] = fadeColor[l];
+      }
+      if (fade) {
+        ledUpdate = true;
+      } else {
+        showLEDs();
+        TIMING_MARK();
+      }
+      #ifdef DEBUG
+      debugSerial.println("Update LEDs");
+      #endif
+      break;
+    }
+    // Pattern: type, fg color, bg color, step time and duration
+    case 'P': {
+      if (len < 13) break;
+      pattern = data[0];
+      patternFG = CRGB(data[1], data[2], data[3]);
+      patternBG = CRGB(data[4], data[5], data[6]);
+      memcpy(&patternStep, &data[7], 2);
+      int32_t duration;
+      memcpy(&duration, &data[9], 4);
+      patternDuration = duration;
+      startPattern();
+      #ifdef DEBUG
+      debugSerial.print("Pattern: ");
+      debugSerial.println(pattern);
+      #endif
+      break;
+    }
     default:
       #ifdef DEBUG
       debugSerial.println("Unknown command");
       #endif
       break;
   }
-  // Wait for remaining data
-  if (!com.available()) delay(1);
-  // Wait for \n
-  while (com.available() and com.read() != '\n') {};
+}
+
+// Serialize the config, returns its crc
+uint8_t buildConfig(uint8_t *blob) {
+  blob[0] = CONFIG_VERSION;
+  blob[1] = brightness;
+  for (int i = 0; i < NUM_FILTERS; i++) {
+    memcpy(&blob[2+10*i], &filters[i].deadband, 4);
+    memcpy(&blob[6+10*i], &filters[i].minInterval, 2);
+    memcpy(&blob[8+10*i], &filters[i].maxInterval, 4);
+  }
+  uint8_t crc = 0;
+  for (int i = 0; i < CONFIG_SIZE-1; i++) crc = crc8(crc, blob[i]);
+  blob[CONFIG_SIZE-1] = crc;
+  return crc;
+}
+
+// Apply a config blob, false if it is broken or of another version
+bool applyConfig(const uint8_t *blob) {
+  uint8_t crc = 0;
+  for (int i = 0; i < CONFIG_SIZE-1; i++) crc = crc8(crc, blob[i]);
+  if (blob[0] != CONFIG_VERSION or crc != blob[CONFIG_SIZE-1]) return false;
+  brightness = blob[1];
+  FastLED.setBrightness(brightness);
+  for (int i = 0; i < NUM_FILTERS; i++) {
+    memcpy(&filters[i].deadband, &blob[2+10*i], 4);
+    memcpy(&filters[i].minInterval, &blob[6+10*i], 2);
+    memcpy(&filters[i].maxInterval, &blob[8+10*i], 4);
+  }
+  return true;
+}
+
+// Only write the bytes that changed to spare the EEPROM
+void storeEEPROM(int address, const uint8_t *data, uint8_t len) {
+  for (int i = 0; i < len; i++) {
+    if (EEPROM.read(address+i) != data[i]) EEPROM.write(address+i, data[i]);
+  }
+  #if defined(ESP8266)
+  // Flushes only if a byte changed
+  EEPROM.commit();
+  #endif
+}
+
+void setBaud(uint32_t newBaud) {
+  baud = newBaud;
+  com.begin(baud);
+  // Bytes of a partial frame came at the other rate
+  rxState = RX_START;
+  #ifdef DEBUG
+  debugSerial.print("Baud rate: ");
+  debugSerial.println(baud);
+  #endif
+}
+
+// CRC-8 (polynomial 0x07) over length, command and payload of binary frames
+uint8_t crc8(uint8_t crc, uint8_t data) {
+  crc ^= data;
+  for (int i = 0; i < 8; i++) {
+    crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1);
+  }
+  return crc;
+}
+
+// Send a frame to the host in the negotiated framing
+void sendFrame(char cmd, const uint8_t *data, uint8_t len) {
+  if (protocol >= PROTO_BINARY) {
+    // Only the reply to the tagged query carries the sequence id,
+    // not e.g. a button press sent in between
+    bool tagged = replyCmd != 0 and cmd == replyCmd;
+    uint8_t header = tagged ? (uint8_t)cmd | SEQ_FLAG : (uint8_t)cmd;
+    uint8_t size = tagged ? len+1 : len;
+    uint8_t crc = crc8(crc8(0, size), header);
+    com.write(FRAME_SOF);
+    com.write(size);
+    com.write(header);
+    if (tagged) {
+      com.write(replySeq);
+      crc = crc8(crc, replySeq);
+      replyCmd = 0;
+    }
+    for (int i = 0; i < len; i++) {
+      com.write(data[i]);
+      crc = crc8(crc, data[i]);
+    }
+    com.write(crc);
+  } else {
+    com.write('!');
+    com.write(cmd);
+    if (len) com.write(data, len);
+    com.println();
+  }
+}
+
+// Send an event, from protocol 9 on with the time it was sampled at
+// as the lower 16 bit of millis(), the host unwraps them with its clock estimate
+void sendEvent(char cmd, const uint8_t *data, uint8_t len, unsigned long time) {
+  if (protocol < PROTO_TIME) {
+    sendFrame(cmd, data, len);
+    return;
+  }
+  // The host maps a stamp to the nearest time with it, older ones as sent now
+  if (millis()-time > MAX_STAMP_AGE) time = millis();
+  uint8_t payload[16+2];
+  if (len > 16) len = 16;
+  if (len) memcpy(payload, data, len);
+  uint16_t stamp = (uint16_t)time;
+  memcpy(&payload[len], &stamp, 2);
+  sendFrame(cmd, payload, len+2);
 }
 
 #ifdef USE_SENSORS
+// Temperature or humidity, from protocol 10 on as int16 in 1/100 units
+void sendValue(char cmd, float value, unsigned long time) {
+  if (protocol < PROTO_COMPACT) {
+    sendEvent(cmd, (const uint8_t *) &value, 4, time);
+    return;
+  }
+  int16_t centi = (int16_t)lroundf(value*100);
+  sendEvent(cmd, (const uint8_t *) &centi, 2, time);
+}
+
+// True if auto mode should send the new value, see SensorFilter
+bool filterPass(char sensor, float value, float last) {
+  SensorFilter *filter = &filters[strchr(FILTER_SENSORS, sensor) - FILTER_SENSORS];
+  unsigned long since = millis()-filter->lastSent;
+  bool due = filter->force or (filter->maxInterval > 0 and since >= filter->maxInterval);
+  if (!due and (since < filter->minInterval or fabs(value-last) <= filter->deadband)) return false;
+  filter->lastSent = millis();
+  filter->force = false;
+  return true;
+}
+
 void sendPIR(bool onNew) {
   uint8_t newPIR = (uint8_t)digitalRead(PIR_PIN);
-  if (onNew and newPIR == pir) return;
+  if (onNew and !filterPass('p', newPIR, pir)) return;
   pir = newPIR;
-  com.print("!p");
-  com.write(pir);
-  com.println();
+  sendEvent('p', &pir, 1, millis());
 }
 
 void sendTemp(bool onNew) {
-  float newTemp = (float)dht.readTemperature();
+  float newTemp = dhtTemp;
   //  Measurement error
-  if (newTemp == -1) {
+  if (!dhtValid) {
     if (!onNew) newTemp = temp;
     else return;
   }
-  if (onNew and newTemp == temp) return;
+  if (onNew and !filterPass('t', newTemp, temp)) return;
   temp = newTemp;
-  byte * b = (byte *) &temp;
-  com.print("!t");
-  com.write(b,4);
-  com.println();
+  // The cached value of a failing sensor was not sampled at dhtTime
+  sendValue('t', temp, dhtValid ? dhtTime : millis());
 }
 
 void sendHum(bool onNew) {
-  float newHum = (float)dht.readHumidity();
+  float newHum = dhtHum;
   //  Measurement error
-  if (newHum == -1) {
+  if (!dhtValid) {
     if (!onNew) newHum = hum;
     else return;
   }
-  if (onNew and newHum == hum) return;
+  if (onNew and !filterPass('h', newHum, hum)) return;
   hum = newHum;
-  byte * b = (byte *) &hum;
-  com.print("!h");
-  com.write(b,4);
-  com.println();
+  sendValue('h', hum, dhtValid ? dhtTime : millis());
+}
+
+// All sensors in one frame: light, temperature, humidity, PIR and validity bits
+void sendSensors() {
+  uint8_t valid = VALID_PIR;
+  pir = (uint8_t)digitalRead(PIR_PIN);
+  int32_t newLight = TSL2561.readVisibleLux();
+  if (newLight >= 0) {
+    light = newLight;
+    valid |= VALID_LIGHT;
+  }
+  if (dhtValid) {
+    temp = dhtTemp;
+    hum = dhtHum;
+    valid |= VALID_TEMP | VALID_HUM;
+  }
+  uint8_t payload[14];
+  memcpy(&payload[0], &light, 4);
+  memcpy(&payload[4], &temp, 4);
+  memcpy(&payload[8], &hum, 4);
+  payload[12] = pir;
+  payload[13] = valid;
+  sendEvent('s', payload, sizeof(payload), millis());
 }
 
 void sendLight(bool onNew) {
   uint32_t newLight = (uint32_t)TSL2561.readVisibleLux();
-  if (onNew and newLight == light) return;
+  if (onNew and !filterPass('l', newLight, light)) return;
   light = newLight;
-  byte * b = (byte *) &light;
-  com.print("!l");
-  com.write(b,4);
-  com.println();
+  if (protocol < PROTO_COMPACT) {
+    sendEvent('l', (const uint8_t *) &light, 4, millis());
+    return;
+  }
+  // Unsigned LEB128 varint, mostly 2 bytes
+  uint8_t varint[5];
+  uint8_t len = 0;
+  uint32_t value = (uint32_t)light;
+  do {
+    varint[len] = value & 0x7F;
+    value >>= 7;
+    if (value) varint[len] |= 0x80;
+    len++;
+  } while (value);
+  sendEvent('l', varint, len, millis());
 }
+
+#if defined(ESP8266)
+void ICACHE_RAM_ATTR dhtISR() {
+#else
+void dhtISR() {
 #endif
+  unsigned long t = micros();
+  if (digitalRead(DHT_PIN)) {
+    dhtRise = t;
+    return;
+  }
+  // Each falling edge ends a high phase, the first two belong to the response
+  int8_t bit = dhtBits;
+  if (bit >= 40) return;
+  dhtBits = bit+1;
+  if (bit < 0) return;
+  dhtData[bit/8] <<= 1;
+  if (t-dhtRise > DHT_ONE_THRESHOLD) dhtData[bit/8] |= 1;
+}
+
+#if defined(__AVR__)
+// Pin change interrupt of DHT_PIN, D8 to D13 share PCINT0 on the ATmega328
+#define DHT_PCINT_vect PCINT0_vect
+ISR(DHT_PCINT_vect) {
+  dhtISR();
+}
+
+void dhtInterrupt(bool on) {
+  if (on) {
+    PCIFR = _BV(digitalPinToPCICRbit(DHT_PIN));
+    *digitalPinToPCMSK(DHT_PIN) |= _BV(digitalPinToPCMSKbit(DHT_PIN));
+    *digitalPinToPCICR(DHT_PIN) |= _BV(digitalPinToPCICRbit(DHT_PIN));
+  } else {
+    *digitalPinToPCMSK(DHT_PIN) &= ~_BV(digitalPinToPCMSKbit(DHT_PIN));
+  }
+}
+#else
+void dhtInterrupt(bool on) {
+  if (on) attachInterrupt(digitalPinToInterrupt(DHT_PIN), dhtISR, CHANGE);
+  else detachInterrupt(digitalPinToInterrupt(DHT_PIN));
+}
+#endif
+
+// End the start signal, the sensor answers right away
+void dhtRelease() {
+  for (int i = 0; i < 5; i++) dhtData[i] = 0;
+  dhtBits = -2;
+  pinMode(DHT_PIN, INPUT_PULLUP);
+  dhtInterrupt(true);
+  dhtTimer = millis();
+  dhtState = DHT_READING;
+}
+
+#if defined(__AVR__)
+// One shot of Timer2, the start signal ends on time however long loop() takes meanwhile
+ISR(TIMER2_COMPA_vect) {
+  TIMSK2 = 0;
+  TCCR2B = 0;
+  dhtRelease();
+}
+
+void dhtStartTimer() {
+  TCCR2B = 0;
+  TCCR2A = _BV(WGM21);
+  TCNT2 = 0;
+  OCR2A = DHT_START_TICKS;
+  TIFR2 = _BV(OCF2A);
+  TIMSK2 = _BV(OCIE2A);
+  TCCR2B = _BV(CS22) | _BV(CS21);
+}
+#else
+// loop() ends the start signal
+void dhtStartTimer() {}
+#endif
+
+// Advance the DHT conversion, never waits for the sensor
+void updateDHT() {
+  switch (dhtState) {
+    case DHT_IDLE:
+      if (millis()-dhtTimer < DHT_UPDATE_INTV) return;
+      // Start signal
+      pinMode(DHT_PIN, OUTPUT);
+      digitalWrite(DHT_PIN, LOW);
+      dhtTimer = millis();
+      dhtState = DHT_START;
+      dhtStartTimer();
+      break;
+    case DHT_START:
+      #if !defined(__AVR__)
+      if (millis()-dhtTimer < DHT_START_SIGNAL) return;
+      dhtRelease();
+      #endif
+      break;
+    case DHT_READING: {
+      if (dhtBits < 40 and millis()-dhtTimer < DHT_READ_TIMEOUT) return;
+      dhtInterrupt(false);
+      dhtState = DHT_IDLE;
+      dhtTimer = millis();
+      if (showPending) showLEDs();
+      uint8_t sum = dhtData[0] + dhtData[1] + dhtData[2] + dhtData[3];
+      if (dhtBits < 40 or sum != dhtData[4]) {
+        #ifdef DEBUG
+        debugSerial.println("DHT error");
+        #endif
+        if (dhtErrors < DHT_MAX_ERRORS and ++dhtErrors == DHT_MAX_ERRORS) dhtValid = false;
+        return;
+      }
+      dhtHum = ((dhtData[0] << 8) | dhtData[1]) * 0.1;
+      dhtTemp = (((dhtData[2] & 0x7F) << 8) | dhtData[3]) * 0.1;
+      if (dhtData[2] & 0x80) dhtTemp = -dhtTemp;
+      dhtValid = true;
+      dhtTime = dhtTimer;
+      dhtErrors = 0;
+      break;
+    }
+  }
+}
+#endif
+
+void startPattern() {
+  patternStart = millis();
+  patternState = 0;
+  ledUpdate = false;
+  // Glow starts from black towards the fg color
+  if (pattern == PATTERN_GLOW) {
+    allLEDs(leds, NUM_LEDS, black);
+    allLEDs(fadeColor, NUM_LEDS, patternFG);
+    showLEDs();
+  }
+  // First step right away
+  patternTimer = millis()-patternStep;
+}
+
+void updatePattern() {
+  if (pattern == PATTERN_NONE) return;
+  if (patternDuration >= 0 and millis()-patternStart > patternDuration) {
+    // Let the host restore its previous pattern
+    uint8_t expired = pattern;
+    pattern = PATTERN_NONE;
+    sendEvent('P', &expired, 1, millis());
+    return;
+  }
+  if (millis()-patternTimer < patternStep) return;
+  patternTimer = millis();
+  switch (pattern) {
+    case PATTERN_BLINK:
+      allLEDs(leds, NUM_LEDS, patternState ? patternBG : patternFG);
+      patternState = !patternState;
+      break;
+    case PATTERN_ROUND:
+      allLEDs(leds, NUM_LEDS, patternBG);
+      leds[patternState] = patternFG;
+      if (++patternState >= NUM_LEDS) patternState = 0;
+      break;
+    case PATTERN_GLOW:
+      // Fade one step, on reaching the target glow back
+      if (fadeit()) {
+        patternState = !patternState;
+        allLEDs(fadeColor, NUM_LEDS, patternState ? patternBG : patternFG);
+      }
+      break;
+    default:
+      pattern = PATTERN_NONE;
+      return;
+  }
+  showLEDs();
+}
 
 void allLEDs(CRGB *colors, uint32_t N, CRGB color) {
   for (int i = 0; i < N; i++) colors[i] = color;
 }
 
+void showLEDs() {
+  if (dhtState == DHT_READING) {
+    showPending = true;
+    return;
+  }
+  showPending = false;
+  FastLED.show();
+}
+
 void setAllLEDs(CRGB color) {
   allLEDs(leds, NUM_LEDS, color);
-  FastLED.show();
+  showLEDs();
 }
 
 bool fadeit() {
@@ -0,0 +1,121 @@
+/***************************************************
+ Native POSIX serial transport for the SensorBoard
+
+ Feel free to use the code as it is.
+
+ Benjamin Voelker, voelkerb@me.com
+ Embedded Systems
+ University of Freiburg, Institute of Computer Science
+ ****************************************************/
+
+#include "posixSerial.h"
+
+#ifdef SB_POSIX_SERIAL
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+static bool baudToSpeed(unsigned long baud, speed_t &speed) {
+  switch (baud) {
+    case 9600: speed = B9600; return true;
+    case 19200: speed = B19200; return true;
+    case 38400: speed = B38400; return true;
+    case 57600: speed = B57600; return true;
+    case 115200: speed = B115200; return true;
+    case 230400: speed = B230400; return true;
+    #ifdef B250000
+    case 250000: speed = B250000; return true;
+    #endif
+    #ifdef B460800
+    case 460800: speed = B460800; return true;
+    #endif
+    #ifdef B500000
+    case 500000: speed = B500000; return true;
+    #endif
+    #ifdef B921600
+    case 921600: speed = B921600; return true;
+    #endif
+    #ifdef B1000000
+    case 1000000: speed = B1000000; return true;
+    #endif
+    default: return false;
+  }
+}
+
+PosixSerial::PosixSerial() {
+  _fd = -1;
+  _baud = 0;
+}
+
+PosixSerial::~PosixSerial() {
+  close();
+}
+
+bool PosixSerial::open(const char *device, unsigned long baud) {
+  close();
+  _fd = ::open(device, O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if (_fd < 0) return false;
+  struct termios tty;
+  if (tcgetattr(_fd, &tty) != 0) {
+    close();
+    return false;
+  }
+  // Raw 8N1, no flow control, reads return immediately
+  cfmakeraw(&tty);
+  tty.c_cflag |= CLOCAL | CREAD;
+  tty.c_cflag &= ~(CSTOPB | CRTSCTS);
+  tty.c_cc[VMIN] = 0;
+  tty.c_cc[VTIME] = 0;
+  if (tcsetattr(_fd, TCSANOW, &tty) != 0 || !setBaudRate(baud)) {
+    close();
+    return false;
+  }
+  tcflush(_fd, TCIOFLUSH);
+  return true;
+}
+
+void PosixSerial::close() {
+  if (_fd >= 0) ::close(_fd);
+  _fd = -1;
+}
+
+bool PosixSerial::setBaudRate(unsigned long baud) {
+  speed_t speed;
+  if (_fd < 0 || !baudToSpeed(baud, speed)) return false;
+  struct termios tty;
+  if (tcgetattr(_fd, &tty) != 0) return false;
+  cfsetispeed(&tty, speed);
+  cfsetospeed(&tty, speed);
+  // Let pending frames go out with the old rate
+  if (tcsetattr(_fd, TCSADRAIN, &tty) != 0) return false;
+  _baud = baud;
+  return true;
+}
+
+size_t PosixSerial::read(uint8_t *data, size_t n) {
+  if (_fd < 0) return 0;
+  ssize_t got = ::read(_fd, data, n);
+  return got > 0 ? (size_t)got : 0;
+}
+
+size_t PosixSerial::write(const uint8_t *data, size_t n) {
+  if (_fd < 0) return 0;
+  size_t sent = 0;
+  while (sent < n) {
+    ssize_t w = ::write(_fd, data + sent, n - sent);
+    if (w > 0) {
+      sent += w;
+      continue;
+    }
+    if (w < 0 && errno != EAGAIN && errno != EINTR) break;
+    // Output buffer full, wait until the port accepts more
+    struct pollfd pfd = {_fd, POLLOUT, 0};
+    if (poll(&pfd, 1, POSIX_SERIAL_WRITE_TIMEOUT) <= 0) break;
+  }
+  return sent;
+}
+
+#endif
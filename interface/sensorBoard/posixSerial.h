@@ -0,0 +1,50 @@
+/***************************************************
+ Native POSIX serial transport for the SensorBoard
+
+ Opens a tty in raw, non-blocking mode. Reads go in bulk
+ straight into the parser's ring buffer and each frame is
+ written with a single call. fd() can be registered with
+ epoll/poll, e.g. in a SensorBoardHub.
+
+ Feel free to use the code as it is.
+
+ Benjamin Voelker, voelkerb@me.com
+ Embedded Systems
+ University of Freiburg, Institute of Computer Science
+ ****************************************************/
+
+#ifndef POSIXSERIAL_h
+#define POSIXSERIAL_h
+
+#include "sensorBoard.h"
+
+#if !defined(ARDUINO) && (defined(__unix__) || defined(__APPLE__))
+#define SB_POSIX_SERIAL
+
+// Max time to wait for the port to accept a frame
+#define POSIX_SERIAL_WRITE_TIMEOUT 100
+
+class PosixSerial : public SensorBoardTransport {
+  public:
+    PosixSerial();
+    ~PosixSerial();
+
+    // Open e.g. /dev/ttyUSB0 with 8N1 at the given baud rate
+    bool open(const char *device, unsigned long baud);
+    void close();
+    unsigned long baudRate() { return _fd >= 0 ? _baud : 0; }
+    bool setBaudRate(unsigned long baud);
+    bool isOpen() const { return _fd >= 0; }
+    int fd() const { return _fd; }
+
+    size_t read(uint8_t *data, size_t n);
+    size_t write(const uint8_t *data, size_t n);
+
+  private:
+    int _fd;
+    unsigned long _baud;
+};
+
+#endif
+
+#endif
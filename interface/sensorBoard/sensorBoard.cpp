@@ -8,39 +8,166 @@
  University of Freiburg, Institute of Computer Science
  ****************************************************/
 
-#include "SensorBoard.h"
+#include "sensorBoard.h"
 
+#if !defined(ARDUINO)
+// Arduino core functions used by the library for native builds
+#include <time.h>
+#include <sched.h>
+
+static unsigned long millis() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long)(ts.tv_sec*1000UL + ts.tv_nsec/1000000UL);
+}
+
+#if defined(SB_STATS) || defined(SB_RECORDER)
+static unsigned long micros() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long)(ts.tv_sec*1000000UL + ts.tv_nsec/1000UL);
+}
+#endif
+
+static void yield() {
+  sched_yield();
+}
+#endif
+
+static const unsigned long defaultBaudRates[] = SB_BAUD_RATES;
+// Bytes the firmware has to echo, includes frame start and line end to catch framing errors
+static const uint8_t echoPattern[] = {0x00, 0xFF, 0x55, 0xAA, SB_FRAME_SOF, '\r', '\n', 0x0F, 0xF0, 0x81, 0x7E, 0x33, 0xCC, 0x01, 0x80, 0x5A};
+
+// CRC-8 (polynomial 0x07) over length, command and payload of binary frames
+static uint8_t crc8(uint8_t crc, uint8_t data) {
+  crc ^= data;
+  for (int i = 0; i < 8; i++) {
+    crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1);
+  }
+  return crc;
+}
+
+// Unsigned LEB128 varint, returns the bytes read or 0 if it is cut off
+static uint8_t parseVarint(const uint8_t *data, uint8_t len, uint32_t &value) {
+  value = 0;
+  for (uint8_t i = 0; i < len && i < 5; i++) {
+    value |= (uint32_t)(data[i] & 0x7F) << (7*i);
+    if (!(data[i] & 0x80)) return i+1;
+  }
+  return 0;
+}
+
+#ifdef SB_RECORDER
+// Counterpart of parseVarint, returns the bytes written (up to 5)
+static uint8_t putVarint(uint8_t *data, uint32_t value) {
+  uint8_t len = 0;
+  do {
+    data[len] = value & 0x7F;
+    value >>= 7;
+    if (value) data[len] |= 0x80;
+    len++;
+  } while (value);
+  return len;
+}
+#endif
+
+// Events sent by the board that carry a time stamp
+#define SB_STAMPED_COMMANDS "brthlpsP"
+
+// Same crc over the config blob and the host cache
+static uint8_t blobCrc(const uint8_t *data, size_t n) {
+  uint8_t crc = 0;
+  for (size_t i = 0; i < n; i++) crc = crc8(crc, data[i]);
+  return crc;
+}
+
+// Brightness in percent as sent to the board
+static uint8_t brightnessValue(float brightness) {
+  int bright = brightness/100.0*255;
+  if (bright > 255) bright = 255;
+  if (bright < 0) bright = 0;
+  return (uint8_t)bright;
+}
+
+#if defined(ARDUINO)
 SensorBoard::SensorBoard(Stream * getter, 
         float tempHysteresis, float humHysteresis, int lightHysteresis, float minLEDWatt, float maxLEDWatt,
         // void (*loadStoreFunc)(bool store, uint8_t *data, size_t size), 
         void (*logFunc)(const char * msg, ...)
       ):
-  updatePattern{NULL, &updateBlinkPattern, &updateRoundPattern, &updateGlowPattern, &updateActivePowerPattern},
-  patternUpdateTimes{0, BLINK_STEP, ROUND_STEP, GLOW_STEP, ACTIVE_POWER_UPDATE}
+  SensorBoard((SensorBoardTransport *)NULL, tempHysteresis, humHysteresis, lightHysteresis, minLEDWatt, maxLEDWatt, logFunc)
+{
+  _streamLink.setStream(getter);
+  _link = &_streamLink;
+}
+
+SensorBoard::SensorBoard(HardwareSerial * serial, unsigned long baud,
+        float tempHysteresis, float humHysteresis, int lightHysteresis, float minLEDWatt, float maxLEDWatt,
+        void (*logFunc)(const char * msg, ...)
+      ):
+  SensorBoard((SensorBoardTransport *)NULL, tempHysteresis, humHysteresis, lightHysteresis, minLEDWatt, maxLEDWatt, logFunc)
+{
+  _streamLink.setSerial(serial, baud);
+  _link = &_streamLink;
+}
+#endif
+
+SensorBoard::SensorBoard(SensorBoardTransport * link, 
+        float tempHysteresis, float humHysteresis, int lightHysteresis, float minLEDWatt, float maxLEDWatt,
+        // void (*loadStoreFunc)(bool store, uint8_t *data, size_t size), 
+        void (*logFunc)(const char * msg, ...)
+      )
 {
-  _getter = getter;
+  _link = link;
+  _clock = &millis;
   buttonCB = NULL;
   PIRCB = NULL;
   lightCB = NULL;
   humCB = NULL;
   tempCB = NULL;
+  requestCB = NULL;
+  readyCB = NULL;
+  eventCB = NULL;
+  eventArg = NULL;
+  button = BUTTON_PRESS::NONE;
+  humidity = 0;
+  temperature = 0;
+  PIR = false;
+  light = 0;
   fadeUpdate = false;
   preSet = false;
+  _ledsSynced = false;
+  _patternOnBoard = false;
+
+  // Green to red power colors
+  _colorStops[0] = COLOR_GREEN;
+  _colorStops[1] = COLOR_RED;
+  _numColorStops = 2;
+  _powerScale = POWER_SCALE::LINEAR;
+  _powerDisplay = POWER_DISPLAY::COLOR;
+  _lutValid = false;
+  active = false;
+  autoMode = false;
+  protocol = SB_PROTO_LEGACY;
 
   _tempHysteresis = tempHysteresis;
   _humHysteresis = humHysteresis;
   _lightHysteresis = lightHysteresis;
+  // The board only needs to send what passes our hysteresis
+  memset(_filters, 0, sizeof(_filters));
+  _filters[0].deadband = tempHysteresis;
+  _filters[1].deadband = humHysteresis;
+  _filters[2].deadband = lightHysteresis;
   config.minLEDWatt = minLEDWatt;
   config.maxLEDWatt = maxLEDWatt;
 
   _logFunc = logFunc;
-  // _loadStoreFunc = loadStoreFunc;
 
   // Current pattern
   mainColor = CRGB{255,0,0};
   bgColor = CRGB{0,0,0};
   currentPattern = LEDPattern::staticPattern;
-  patternTimer = millis();
+  patternTimer = now();
   patternState = INIT_PATTERN;
 
   // Old pattern that can be restored
@@ -49,7 +176,86 @@ SensorBoard::SensorBoard(Stream * getter,
   oldPattern = LEDPattern::numberOfPatterns;
 
   patternDuration = -1;
-  patternStartMillis = millis();
+  patternStartMillis = now();
+
+  // Receive state
+  _rxHead = 0;
+  _rxTail = 0;
+  _parseState = ParseState::START;
+  _frameBinary = false;
+  _frameCrc = 0;
+  _frameCmd = 0;
+  _frameExpected = 0;
+  _frameLen = 0;
+
+  // No requests in flight
+  for (int i = 0; i < SB_MAX_REQUESTS; i++) _requests[i].state = REQUEST_STATE::FREE;
+  _nextRequestId = 0;
+  _deadline = 0;
+  _deadlineValid = false;
+  _deadlineCB = NULL;
+  _deadlineArg = NULL;
+  _baudRates = defaultBaudRates;
+  _numBaudRates = sizeof(defaultBaudRates)/sizeof(defaultBaudRates[0]);
+  _initState = InitState::IDLE;
+  _initTimer = 0;
+  _initTries = 0;
+  _baudIndex = -1;
+  _baseBaud = 0;
+  _firstBaud = 0;
+  _linkBaud = 0;
+  _baudSwitched = 0;
+  _initReply = 0;
+  _baudAck = 0;
+  _boardConfigCrc = -1;
+  _configDirty = false;
+  _configChanged = 0;
+  _configSync = false;
+  _configTimer = 0;
+  _configTries = 0;
+  _loadStoreFunc = NULL;
+  #ifdef SB_RECORDER
+  _recordFunc = NULL;
+  _recordTime = 0;
+  #endif
+  _cacheCrc = -1;
+  resetClock();
+  resetLatency();
+  _pingSent = 0;
+  _pingPending = false;
+  _frameTime = 0;
+  _eventTime = 0;
+  _gestureState = GestureState::OFF;
+  _doublePress = SB_GESTURE_DOUBLE_PRESS;
+  _longPress = SB_GESTURE_LONG_PRESS;
+  _gestureTime = 0;
+  #ifdef SB_EVENT_QUEUE
+  _droppedEvents = 0;
+  #if defined(ESP32)
+  _eventTask = NULL;
+  #endif
+  #endif
+  SB_STAT(_resyncing = false);
+  SB_STAT(resetStats());
+}
+
+#ifdef SB_STATS
+void SensorBoard::resetStats() {
+  memset(&_stats, 0, sizeof(_stats));
+}
+#endif
+
+void SensorBoard::setBaudRates(const unsigned long *rates, size_t n) {
+  _baudRates = rates;
+  _numBaudRates = rates ? n : 0;
+}
+
+void SensorBoard::setClock(unsigned long (*clock)(void)) {
+  _clock = clock ? clock : &millis;
+  // The pattern timers were started on the old clock
+  patternTimer = now();
+  patternStartMillis = now();
+  invalidateDeadline();
 }
 
 static bool valueValid(float value, float min, float max) {
@@ -57,7 +263,8 @@ static bool valueValid(float value, float min, float max) {
   return true;
 }
 
-bool SensorBoard::init() {
+bool SensorBoard::init(bool wait) {
+  unsigned long cachedBaud = loadCache();
   // Note that config must be set prior to calling this function
   // check if values make sense
   if (!valueValid(this->config.brightness,    0,   100.0)) this->config.brightness = 50.0;
@@ -67,111 +274,1140 @@ bool SensorBoard::init() {
   if (!valueValid(this->config.minLEDWatt,    0, 10000.0)) this->config.minLEDWatt = 2.0;
   if (!valueValid(this->config.tempOffset,  -20,   200.0)) this->config.tempOffset = 0.0;
 
-  // Send ? and wait for answer
-  _getter->println("??");
-  // if (_loadStoreFunc) _loadStoreFunc(false, (uint8_t*)&config, sizeof(config));
-  handle(1000);
-  return this->active;
+  // Start at the rate the board ran at last time
+  _baseBaud = _link->baudRate();
+  _firstBaud = _baseBaud;
+  if (_baseBaud != 0 && cachedBaud != 0 && cachedBaud != _baseBaud && _link->setBaudRate(cachedBaud)) {
+    _firstBaud = cachedBaud;
+  }
+  _configSync = false;
+  _initTries = 0;
+  initStep(InitState::HANDSHAKE);
+  while (wait && _initState != InitState::READY && _initState != InitState::FAILED) {
+    update();
+    yield();
+  }
+  return ready();
+}
+
+#ifdef SB_RECORDER
+bool SensorBoard::setRecorder(void (*recordFunc)(const uint8_t *data, size_t size)) {
+  if (recordFunc == NULL) {
+    _recordFunc = NULL;
+    return true;
+  }
+  // A replay cannot pick up a link negotiated before the capture
+  if (_initState != InitState::IDLE) return false;
+  _recordFunc = recordFunc;
+  _recordTime = recordMicros();
+  // Magic, version, protocol and two varints of up to 5 bytes each
+  uint8_t header[sizeof(SB_CAPTURE_MAGIC)+11];
+  uint8_t len = sizeof(SB_CAPTURE_MAGIC)-1;
+  memcpy(header, SB_CAPTURE_MAGIC, len);
+  header[len++] = SB_CAPTURE_VERSION;
+  header[len++] = SB_PROTOCOL_VERSION;
+  len += putVarint(&header[len], (uint32_t)_link->baudRate());
+  len += putVarint(&header[len], (uint32_t)now());
+  _recordFunc(header, len);
+  return true;
+}
+
+unsigned long SensorBoard::recordMicros() {
+  // Another clock, e.g. a simulation's, sets the pace of the replay
+  return _clock == &millis ? micros() : now()*1000UL;
+}
+
+void SensorBoard::record(uint8_t type, const uint8_t *data, size_t n) {
+  if (_recordFunc == NULL || n == 0) return;
+  unsigned long t = recordMicros();
+  // Type and two varints of up to 5 bytes each
+  uint8_t header[11];
+  uint8_t len = 0;
+  header[len++] = type;
+  len += putVarint(&header[len], (uint32_t)(t - _recordTime));
+  len += putVarint(&header[len], (uint32_t)n);
+  _recordTime = t;
+  _recordFunc(header, len);
+  _recordFunc(data, n);
+}
+#endif
+
+void SensorBoard::setLoadStoreFunc(void (*loadStoreFunc)(bool store, uint8_t *data, size_t size)) {
+  _loadStoreFunc = loadStoreFunc;
+  _cacheCrc = -1;
+}
+
+void SensorBoard::initStep(InitState state) {
+  _initState = state;
+  _initTimer = now();
+  _initReply = 0;
+  invalidateDeadline();
+  switch (state) {
+    case InitState::HANDSHAKE:
+    case InitState::SCAN: {
+      // Send ? with our protocol version and wait for answer,
+      // the handshake itself always uses the legacy framing
+      protocol = SB_PROTO_LEGACY;
+      this->active = false;
+      uint8_t version = '0' + SB_PROTOCOL_VERSION;
+      sendCommand("??", &version, 1);
+      break;
+    }
+    case InitState::BAUD_REQUEST: {
+      uint32_t rate = _baudRates[_baudIndex];
+      sendCommand("!B", (const uint8_t *)&rate, 4);
+      // The board switches right after its ack
+      _baudSwitched = now();
+      break;
+    }
+    // Echo test in both directions
+    case InitState::BAUD_ECHO:
+      sendCommand("?e", echoPattern, sizeof(echoPattern));
+      break;
+    case InitState::BAUD_COMMIT:
+      sendCommand("!C");
+      break;
+    // Back to the old rate, the board does the same once its trial ends
+    case InitState::BAUD_FALLBACK:
+      _link->setBaudRate(_linkBaud);
+      break;
+    case InitState::CONFIG_QUERY:
+      sendCommand("?c");
+      break;
+    case InitState::CONFIG_PUSH: {
+      uint8_t blob[SB_BOARD_CONFIG_SIZE];
+      boardConfig(blob);
+      sendCommand("!c", blob, sizeof(blob));
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+unsigned int SensorBoard::initTimeout() {
+  switch (_initState) {
+    case InitState::SCAN:
+    case InitState::BAUD_REQUEST:
+    case InitState::BAUD_ECHO:
+    case InitState::BAUD_COMMIT:
+      return SB_BAUD_TIMEOUT;
+    default:
+      return SB_INIT_TIMEOUT;
+  }
+}
+
+void SensorBoard::updateInit() {
+  bool timeout = now() - _initTimer >= initTimeout();
+  switch (_initState) {
+    case InitState::HANDSHAKE:
+    case InitState::SCAN: {
+      if (this->active) {
+        _linkBaud = _link->baudRate();
+        if (_logFunc && _initState == InitState::SCAN) _logFunc("Sensor found at %lu baud", _linkBaud);
+        _baudIndex = -1;
+        // The rate cached from the last run was negotiated already
+        negotiateNext(_initState == InitState::HANDSHAKE && _firstBaud != _baseBaud);
+        break;
+      }
+      if (!timeout) break;
+      if (_initState == InitState::HANDSHAKE && ++_initTries < SB_INIT_RETRIES) {
+        SB_STAT(_stats.retries++);
+        initStep(InitState::HANDSHAKE);
+        break;
+      }
+      // The board may still run at a rate negotiated before
+      if (_initState == InitState::HANDSHAKE) _baudIndex = -1;
+      unsigned long rate;
+      while (_baseBaud != 0 && (rate = nextBaudRate(true)) != 0) {
+        if (!_link->setBaudRate(rate)) continue;
+        initStep(InitState::SCAN);
+        return;
+      }
+      if (_baseBaud != 0) _link->setBaudRate(_baseBaud);
+      initDone(false);
+      break;
+    }
+    case InitState::BAUD_REQUEST:
+      if (_initReply == 'B') {
+        // Board cannot run at this rate
+        if (_baudAck != _baudRates[_baudIndex]) negotiateNext(false);
+        else if (!_link->setBaudRate(_baudAck)) initStep(InitState::BAUD_FALLBACK);
+        else {
+          _initTries = 0;
+          initStep(InitState::BAUD_ECHO);
+        }
+      // The ack may have been lost after the board switched
+      } else if (timeout) {
+        initStep(InitState::BAUD_FALLBACK);
+      }
+      break;
+    case InitState::BAUD_ECHO:
+      if (_initReply == 'e') initStep(++_initTries < 2 ? InitState::BAUD_ECHO : InitState::BAUD_COMMIT);
+      else if (timeout) initStep(InitState::BAUD_FALLBACK);
+      break;
+    case InitState::BAUD_COMMIT:
+      if (_initReply == 'C') {
+        _linkBaud = _baudRates[_baudIndex];
+        if (_logFunc) _logFunc("Sensor baud rate: %lu", _linkBaud);
+        negotiateNext(true);
+      } else if (timeout) {
+        initStep(InitState::BAUD_FALLBACK);
+      }
+      break;
+    case InitState::BAUD_FALLBACK:
+      if (now() - _baudSwitched <= SB_BAUD_TRIAL_TIMEOUT + SB_BAUD_TRIAL_MARGIN) break;
+      if (_logFunc) _logFunc("Sensor failed at %lu baud", _baudRates[_baudIndex]);
+      // Drop whatever arrived at the wrong rate
+      parseIncoming();
+      _parseState = ParseState::START;
+      negotiateNext(false);
+      break;
+    case InitState::CONFIG_QUERY:
+    case InitState::CONFIG_PUSH: {
+      if (_initReply == 'c') {
+        uint8_t blob[SB_BOARD_CONFIG_SIZE];
+        if (_boardConfigCrc == boardConfig(blob)) {
+          configDone();
+          break;
+        }
+        // Board has another config, send ours
+        if (_initState == InitState::CONFIG_QUERY) {
+          _initTries = 0;
+          initStep(InitState::CONFIG_PUSH);
+          break;
+        }
+      } else if (!timeout) {
+        break;
+      }
+      if (++_initTries < SB_INIT_RETRIES) {
+        SB_STAT(_stats.retries++);
+        initStep(_initState);
+        break;
+      }
+      // Try again later, the board works with its own config meanwhile
+      if (_logFunc) _logFunc("Sensor config not synced");
+      configChanged();
+      initDone(true);
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+unsigned long SensorBoard::nextBaudRate(bool scan) {
+  // Scanning includes the rate before init()
+  int n = scan ? _numBaudRates+1 : _numBaudRates;
+  while (++_baudIndex < n) {
+    unsigned long rate = _baudIndex < (int)_numBaudRates ? _baudRates[_baudIndex] : _baseBaud;
+    if (scan ? rate != _firstBaud : rate > _linkBaud) return rate;
+  }
+  return 0;
+}
+
+void SensorBoard::negotiateNext(bool done) {
+  // Rates are tried fastest first
+  if (!done && protocol >= SB_PROTO_BAUD && _linkBaud != 0 && nextBaudRate(false) != 0) {
+    initStep(InitState::BAUD_REQUEST);
+  } else if (protocol >= SB_PROTO_CONFIG) {
+    _initTries = 0;
+    initStep(InitState::CONFIG_QUERY);
+  } else {
+    initDone(true);
+  }
+}
+
+void SensorBoard::configDone() {
+  _configDirty = false;
+  initDone(true);
+}
+
+void SensorBoard::pushConfig() {
+  _configSync = true;
+  _configTimer = now();
+  _initReply = 0;
+  invalidateDeadline();
+  uint8_t blob[SB_BOARD_CONFIG_SIZE];
+  boardConfig(blob);
+  sendCommand("!c", blob, sizeof(blob));
+}
+
+void SensorBoard::updateConfigSync() {
+  if (_initReply == 'c') {
+    uint8_t blob[SB_BOARD_CONFIG_SIZE];
+    if (_boardConfigCrc == boardConfig(blob)) {
+      _configSync = false;
+      _configDirty = false;
+      invalidateDeadline();
+      storeCache();
+      return;
+    }
+  } else if (now() - _configTimer < SB_INIT_TIMEOUT) {
+    return;
+  }
+  if (++_configTries < SB_INIT_RETRIES) {
+    SB_STAT(_stats.retries++);
+    pushConfig();
+    return;
+  }
+  // Try again later
+  if (_logFunc) _logFunc("Sensor config not synced");
+  _configSync = false;
+  configChanged();
+}
+
+void SensorBoard::initDone(bool success) {
+  _initState = success ? InitState::READY : InitState::FAILED;
+  invalidateDeadline();
+  if (_logFunc) _logFunc(success ? "Sensor ready, protocol: %u" : "Sensor not found", protocol);
+  if (success) storeCache();
+  if (readyCB) readyCB(success);
+}
+
+uint8_t SensorBoard::boardConfig(uint8_t *blob) {
+  blob[0] = SB_CONFIG_VERSION;
+  blob[1] = brightnessValue(config.brightness);
+  for (int i = 0; i < 4; i++) {
+    SensorBoardFilter filter = rawFilter(i);
+    memcpy(&blob[2+i*sizeof(filter)], &filter, sizeof(filter));
+  }
+  blob[SB_BOARD_CONFIG_SIZE-1] = blobCrc(blob, SB_BOARD_CONFIG_SIZE-1);
+  return blob[SB_BOARD_CONFIG_SIZE-1];
+}
+
+void SensorBoard::configChanged() {
+  _configDirty = true;
+  _configChanged = now();
+  invalidateDeadline();
+}
+
+unsigned long SensorBoard::loadCache() {
+  if (_loadStoreFunc == NULL) return 0;
+  SensorBoardCache cache;
+  _loadStoreFunc(false, (uint8_t *)&cache, sizeof(cache));
+  uint8_t crc = blobCrc((const uint8_t *)&cache, sizeof(cache)-1);
+  if (cache.version != SB_CONFIG_VERSION || cache.crc != crc) return 0;
+  config = cache.config;
+  memcpy(_filters, cache.filters, sizeof(_filters));
+  _cacheCrc = crc;
+  return cache.baud;
+}
+
+void SensorBoard::storeCache() {
+  if (_loadStoreFunc == NULL) return;
+  SensorBoardCache cache;
+  cache.version = SB_CONFIG_VERSION;
+  cache.config = config;
+  memcpy(cache.filters, _filters, sizeof(_filters));
+  cache.baud = _linkBaud;
+  cache.crc = blobCrc((const uint8_t *)&cache, sizeof(cache)-1);
+  // Unchanged settings are not written again
+  if (cache.crc == _cacheCrc) return;
+  _loadStoreFunc(true, (uint8_t *)&cache, sizeof(cache));
+  _cacheCrc = cache.crc;
 }
 
 enum NEW_SENSOR_VALUE SensorBoard::handle(int timeout) {
-  NEW_SENSOR_VALUE avail = NEW_SENSOR_VALUE::NONE;
+  #ifdef SB_STATS
+  unsigned long start = micros();
+  NEW_SENSOR_VALUE avail = parseIncoming();
+  static const unsigned long buckets[] = SB_STATS_TIME_BUCKETS;
+  unsigned long duration = micros() - start;
+  int bucket = 0;
+  while (bucket < SB_STATS_NUM_TIME_BUCKETS-1 && duration >= buckets[bucket]) bucket++;
+  _stats.handleTime[bucket]++;
+  #else
+  NEW_SENSOR_VALUE avail = parseIncoming();
+  #endif
+  // Only poll further if the caller wants to wait for a new value
   if (timeout > 0) {
-    long start = millis();
-    while (millis() - start < timeout) {
-      if (_getter->available()) break;
+    unsigned long start = now();
+    while (avail == NEW_SENSOR_VALUE::NONE && now() - start < (unsigned long)timeout) {
+      yield();
+      avail = parseIncoming();
+    }
+  }
+  return avail;
+}
+
+bool SensorBoard::readIncoming() {
+  uint16_t free = SB_RX_BUFFER_SIZE - (uint16_t)(_rxHead - _rxTail);
+  if (free == 0) return true;
+  // Read in one go up to the wrap around of the buffer
+  uint16_t head = _rxHead & (SB_RX_BUFFER_SIZE-1);
+  uint16_t chunk = SB_RX_BUFFER_SIZE - head;
+  if (chunk > free) chunk = free;
+  size_t got = _link->read(&_rxBuf[head], chunk);
+  SB_STAT(_stats.bytesRx += got);
+  #ifdef SB_RECORDER
+  record(SB_CAPTURE_RX, &_rxBuf[head], got);
+  #endif
+  _rxHead += got;
+  // A full chunk means there may be more waiting
+  return got == chunk;
+}
+
+enum NEW_SENSOR_VALUE SensorBoard::parseIncoming() {
+  NEW_SENSOR_VALUE avail = NEW_SENSOR_VALUE::NONE;
+  bool more;
+  do {
+    more = readIncoming();
+    // Drain all complete frames, partial ones stay in the parser
+    while (_rxTail != _rxHead) {
+      NEW_SENSOR_VALUE value = parseByte(_rxBuf[_rxTail & (SB_RX_BUFFER_SIZE-1)]);
+      _rxTail++;
+      if (value != NEW_SENSOR_VALUE::NONE) avail = value;
+    }
+  } while (more);
+  return avail;
+}
+
+void SensorBoard::sendCommand(const char *cmd, const uint8_t *data, uint8_t len, int id) {
+  // Whole frame goes out in a single write
+  uint8_t frame[SB_MAX_PAYLOAD+5];
+  size_t n = 0;
+  if (protocol >= SB_PROTO_BINARY) {
+    bool tagged = id >= 0 && protocol >= SB_PROTO_SEQ;
+    frame[n++] = SB_FRAME_SOF;
+    frame[n++] = tagged ? len+1 : len;
+    frame[n++] = tagged ? (uint8_t)cmd[1] | SB_SEQ_FLAG : (uint8_t)cmd[1];
+    if (tagged) frame[n++] = (uint8_t)id;
+    for (uint8_t i = 0; i < len; i++) frame[n++] = data[i];
+    uint8_t crc = 0;
+    for (size_t i = 1; i < n; i++) crc = crc8(crc, frame[i]);
+    frame[n++] = crc;
+  } else {
+    frame[n++] = (uint8_t)cmd[0];
+    frame[n++] = (uint8_t)cmd[1];
+    for (uint8_t i = 0; i < len; i++) frame[n++] = data[i];
+    frame[n++] = '\r';
+    frame[n++] = '\n';
+  }
+  _link->write(frame, n);
+  SB_STAT(_stats.bytesTx += n);
+  #ifdef SB_RECORDER
+  record(SB_CAPTURE_TX, frame, n);
+  #endif
+}
+
+// Payload size of a frame sent by the board, -1 if the command is unknown
+// Compact values have their minimum size, the light varint may be longer
+static int8_t payloadSize(char cmd, bool compact) {
+  switch (cmd) {
+    case 't':
+    case 'h':
+      return compact ? 2 : 4;
+    case 'l':
+      return compact ? 1 : 4;
+    case 'p':
+      return 1;
+    case 's':
+      return 14;
+    case 'P':
+      return 1;
+    case 'B':
+      return 4;
+    case 'c':
+      return 2;
+    case 'T':
+      return 4;
+    // Echo has the length of the test pattern
+    case 'e':
+    case 'C':
+    case 'b':
+    case 'r':
+    case '!':
+      return 0;
+    default:
+      return -1;
+  }
+}
+
+enum NEW_SENSOR_VALUE SensorBoard::parseByte(uint8_t c) {
+  switch (_parseState) {
+    // Skip everything until a frame starts
+    case ParseState::START:
+      if (c == '!') {
+        _frameBinary = false;
+        _parseState = ParseState::CMD;
+      } else if (c == SB_FRAME_SOF) {
+        _frameBinary = true;
+        _parseState = ParseState::BIN_LEN;
+      }
+      #ifdef SB_STATS
+      if (_resyncing && _parseState != ParseState::START) _stats.resyncs++;
+      #endif
+      break;
+    case ParseState::CMD:
+      _frameCmd = (char)c;
+      _frameLen = 0;
+      _frameExpected = payloadSize(_frameCmd, protocol >= SB_PROTO_COMPACT);
+      _parseState = _frameExpected > 0 ? ParseState::PAYLOAD : ParseState::END;
+      break;
+    // Binary payload may contain any byte, so it is read by length
+    case ParseState::PAYLOAD:
+      _frame[_frameLen++] = c;
+      if (_frameBinary) _frameCrc = crc8(_frameCrc, c);
+      if (_frameLen >= _frameExpected) {
+        _parseState = _frameBinary ? ParseState::BIN_CRC : ParseState::END;
+      }
+      break;
+    case ParseState::BIN_LEN:
+      // Too long to be valid, look for the next frame start
+      if (c > SB_MAX_PAYLOAD) {
+        SB_STAT(_stats.invalidFrames++);
+        _parseState = ParseState::START;
+        return parseByte(c);
+      }
+      _frameExpected = c;
+      _frameCrc = crc8(0, c);
+      _parseState = ParseState::BIN_CMD;
+      break;
+    case ParseState::BIN_CMD:
+      _frameCmd = (char)c;
+      _frameLen = 0;
+      _frameCrc = crc8(_frameCrc, c);
+      _parseState = _frameExpected > 0 ? ParseState::PAYLOAD : ParseState::BIN_CRC;
+      break;
+    case ParseState::BIN_CRC:
+      _parseState = ParseState::START;
+      if (c != _frameCrc) {
+        SB_STAT(_stats.invalidFrames++);
+        SB_STAT(_stats.crcErrors++);
+        if (_logFunc) _logFunc("Sensor frame %c crc error", _frameCmd);
+        return resyncFrame(c);
+      }
+      return dispatchFrame(_frameCmd, _frame, _frameLen);
+    case ParseState::END:
+      if (c == '\r') break;
+      if (c == '\n') {
+        _parseState = ParseState::START;
+        if (_frameExpected < 0) {
+          SB_STAT(_stats.unknownFrames++);
+          _frameTime = now();
+          SensorBoardEvent event;
+          event.type = NEW_SENSOR_VALUE::UNKNOWN;
+          emitEvent(event);
+          return NEW_SENSOR_VALUE::UNKNOWN;
+        }
+        return dispatchFrame(_frameCmd, _frame, _frameLen);
+      }
+      // Unknown commands are skipped until the newline
+      if (_frameExpected < 0) break;
+      // Optional single char argument (e.g. type of button press)
+      if (_frameExpected == 0 && _frameLen == 0) {
+        _frame[_frameLen++] = c;
+        break;
+      }
+      // Corrupted frame, resync on this byte
+      SB_STAT(_stats.invalidFrames++);
+      if (_logFunc) _logFunc("Sensor frame %c corrupted", _frameCmd);
+      _parseState = ParseState::START;
+      return parseByte(c);
+  }
+  return NEW_SENSOR_VALUE::NONE;
+}
+
+enum NEW_SENSOR_VALUE SensorBoard::dispatchFrame(char cmd, const uint8_t *data, uint8_t len) {
+  int id = -1;
+  // Reply to a request, strip the echoed sequence id
+  if (((uint8_t)cmd & SB_SEQ_FLAG) && len > 0) {
+    cmd = (char)((uint8_t)cmd & ~SB_SEQ_FLAG);
+    id = data[0];
+    data++;
+    len--;
+  }
+  _frameTime = now();
+  // Events end with the board time they were sampled at
+  if (protocol >= SB_PROTO_TIME && cmd != 0 && strchr(SB_STAMPED_COMMANDS, cmd) && len >= 2) {
+    uint16_t stamp = parse<uint16_t>(&data[len-2]);
+    len -= 2;
+    if (clockSynced()) {
+      _frameTime = stampToHost(stamp);
+      long latency = (long)(now() - _frameTime);
+      if (latency < 0) latency = 0;
+      if (latency > 0xFFFF) latency = 0xFFFF;
+      if (_latency.count == 0 || latency < _latency.min) _latency.min = latency;
+      if (latency > _latency.max) _latency.max = latency;
+      _latency.count++;
+      _latency.sum += latency;
     }
   }
-  // if not a valid message
-  if (!(_getter->available())) return avail;
-  // Allow all data to be sent
-  delay(10);
-  // read first char
-  char c = _getter->read();
-  // If it is not a !, return
-  if (c != '!') return avail;
-  // Parse data
-  c = _getter->read();
-  if (_logFunc) _logFunc("Sensor cmd %c", c);
-
-  switch (c) {
+  NEW_SENSOR_VALUE avail = handleFrame(cmd, data, len);
+  completeRequest(cmd, id);
+  // New values emitted their own event already, unknown frames still reach eventCB
+  if (avail == NEW_SENSOR_VALUE::ACTIVE || avail == NEW_SENSOR_VALUE::UNKNOWN || avail == NEW_SENSOR_VALUE::NEW_SENSORS) {
+    SensorBoardEvent event;
+    event.type = avail;
+    emitEvent(event);
+  }
+  return avail;
+}
+
+enum NEW_SENSOR_VALUE SensorBoard::resyncFrame(uint8_t crc) {
+  // Copy as reparsing overwrites the frame buffer
+  uint8_t bytes[SB_MAX_PAYLOAD+3];
+  uint16_t n = 0;
+  bytes[n++] = (uint8_t)_frameExpected;
+  bytes[n++] = (uint8_t)_frameCmd;
+  for (uint8_t i = 0; i < _frameLen; i++) bytes[n++] = _frame[i];
+  // The crc byte may be the start of the next frame
+  bytes[n++] = crc;
+  NEW_SENSOR_VALUE avail = NEW_SENSOR_VALUE::NONE;
+  // Frames within may fail their crc as well
+  SB_STAT(bool resyncing = _resyncing);
+  SB_STAT(_resyncing = true);
+  for (uint16_t i = 0; i < n; i++) {
+    NEW_SENSOR_VALUE value = parseByte(bytes[i]);
+    if (value != NEW_SENSOR_VALUE::NONE) avail = value;
+  }
+  SB_STAT(_resyncing = resyncing);
+  return avail;
+}
+
+enum NEW_SENSOR_VALUE SensorBoard::handleFrame(char cmd, const uint8_t *data, uint8_t len) {
+  NEW_SENSOR_VALUE avail = NEW_SENSOR_VALUE::NONE;
+  if (_logFunc) _logFunc("Sensor cmd %c", cmd);
+  // Binary frames may be shorter than what the command requires
+  bool compact = protocol >= SB_PROTO_COMPACT;
+  if (len < payloadSize(cmd, compact)) {
+    SB_STAT(_stats.shortReads++);
+    return NEW_SENSOR_VALUE::UNKNOWN;
+  }
+  #ifdef SB_STATS
+  const char * known = strchr(SB_STATS_COMMANDS, cmd);
+  if (cmd != 0 && known) _stats.frames[known - SB_STATS_COMMANDS]++;
+  #endif
+
+  switch (cmd) {
     case 'b': {
       avail = NEW_SENSOR_VALUE::NEW_BTN;
       BUTTON_PRESS presses = BUTTON_PRESS::PRESS;
       // Optional single press, double press, long press etc.
-      if (_getter->available()) {
-        char e = _getter->read();
-        if (e > '0' && e > '9') {
-          presses = (BUTTON_PRESS)(e - '0');
-        }
+      if (len > 0 && data[0] > '0' && data[0] <= '9') {
+        presses = (BUTTON_PRESS)(data[0] - '0');
+      } else if (_gestureState != GestureState::OFF) {
+        buttonEdge(true, _frameTime);
+        break;
       }
-      if (buttonCB) buttonCB(presses);
+      button = presses;
+      SensorBoardEvent event;
+      event.type = avail;
+      event.button = presses;
+      emitEvent(event);
       break;
     }
     case 'r': {
-      if (buttonCB) buttonCB(BUTTON_PRESS::RELEASE);
-      break;
-    }
-    case 't': {
-      float temp = parse<float>()+config.tempOffset;
-      if (abs(temp-this->temperature) > _tempHysteresis) {
-        avail = NEW_SENSOR_VALUE::NEW_TEMP;
-        this->temperature = temp;
-        if (tempCB) tempCB(this->temperature);
+      avail = NEW_SENSOR_VALUE::NEW_BTN;
+      if (_gestureState != GestureState::OFF) {
+        buttonEdge(false, _frameTime);
+        break;
       }
+      button = BUTTON_PRESS::RELEASE;
+      SensorBoardEvent event;
+      event.type = avail;
+      event.button = BUTTON_PRESS::RELEASE;
+      emitEvent(event);
       break;
     }
-    case 'h': {
-      float hum = parse<float>()+config.humOffset;
-      if (this->humidity > 100) this->humidity = 100;
-      else if (this->humidity < 0) this->humidity = 0;
-      if (abs(hum-this->humidity) > _humHysteresis) {
-        avail = NEW_SENSOR_VALUE::NEW_HUM;
-        this->humidity = hum;
-        if (humCB) humCB(this->humidity);
-      }
+    case 't':
+      avail = newTemperature(compact ? parse<int16_t>(data)/100.0f : parse<float>(data));
+      break;
+    case 'h':
+      avail = newHumidity(compact ? parse<int16_t>(data)/100.0f : parse<float>(data));
       break;
-    }
     case 'l': {
-      int lig = (int)((float)(parse<int32_t>())*config.lightCal);
-      if (abs(lig-this->light) > _lightHysteresis) {
-        avail = NEW_SENSOR_VALUE::NEW_LIGHT;
-        this->light = lig;
-        if (lightCB) lightCB(this->light);
+      if (!compact) {
+        avail = newLight(parse<int32_t>(data));
+        break;
+      }
+      uint32_t lux;
+      if (!parseVarint(data, len, lux)) {
+        SB_STAT(_stats.shortReads++);
+        return NEW_SENSOR_VALUE::UNKNOWN;
       }
+      avail = newLight((int32_t)lux);
       break;
     }
-    case 'p': {
-      bool pir = (uint8_t)_getter->read();
-      if (pir != this->PIR) {
-        avail = NEW_SENSOR_VALUE::NEW_PIR;
-        this->PIR = pir;
-        if (PIRCB) PIRCB(this->PIR);
-      }
+    case 'p':
+      avail = newPIR(data[0]);
+      break;
+    // All sensors at once: light, temperature, humidity, PIR and validity bits
+    case 's': {
+      uint8_t valid = data[13];
+      if (valid & SB_VALID_LIGHT) newLight(parse<int32_t>(&data[0]));
+      if (valid & SB_VALID_TEMP) newTemperature(parse<float>(&data[4]));
+      if (valid & SB_VALID_HUM) newHumidity(parse<float>(&data[8]));
+      if (valid & SB_VALID_PIR) newPIR(data[12]);
+      avail = NEW_SENSOR_VALUE::NEW_SENSORS;
       break;
     }
+    // Pattern run by the board expired
+    // Only the running pattern expires, not one it replaced whose expiry was still on the way.
+    // The host started its timer before the board did, so it cannot be much earlier
+    case 'P': {
+      if (!_patternOnBoard || patternDuration == -1 || data[0] != (uint8_t)currentPattern) break;
+      if ((long)(now() - patternStartMillis) + PATTERN_EXPIRE_EARLY < patternDuration) break;
+      expirePattern();
+      break;
+    }
+    // Baud rate negotiation replies
+    case 'B':
+      _baudAck = parse<uint32_t>(data);
+      _initReply = cmd;
+      break;
+    case 'e':
+      if (len == sizeof(echoPattern) && memcmp(data, echoPattern, len) == 0) _initReply = cmd;
+      break;
+    case 'C':
+      _initReply = cmd;
+      break;
+    // Board time of a clock ping
+    case 'T':
+      if (_pingPending) clockSample(parse<uint32_t>(data), _pingSent, now());
+      _pingPending = false;
+      invalidateDeadline();
+      break;
+    // Version and crc of the board's config
+    case 'c':
+      _boardConfigCrc = data[0] == SB_CONFIG_VERSION ? data[1] : -1;
+      _initReply = cmd;
+      break;
     case '!': {
       avail = NEW_SENSOR_VALUE::ACTIVE;
       this->active = true;
+      // Old firmware does not send its protocol version
+      uint8_t version = SB_PROTO_LEGACY;
+      if (len > 0 && data[0] >= '0') version = data[0] - '0';
+      protocol = version < SB_PROTOCOL_VERSION ? version : SB_PROTOCOL_VERSION;
+      // The board may have been reset, send the next LED frame in full
+      _ledsSynced = false;
+      resetClock();
+      if (_logFunc) _logFunc("Sensor protocol: %u", protocol);
       break;
     }
     // Invalid data
     default:
+      SB_STAT(_stats.unknownFrames++);
       avail = NEW_SENSOR_VALUE::UNKNOWN;
       break;
   }
-  // Flush until newline
-  if (_getter->available()) _getter->readStringUntil('\n');
   return avail;
 }
 
+enum NEW_SENSOR_VALUE SensorBoard::newTemperature(float temp) {
+  temp += config.tempOffset;
+  #ifdef SB_HISTORY
+  tempHistory.add(_frameTime, temp);
+  #endif
+  if (fabs(temp-this->temperature) <= _tempHysteresis) return NEW_SENSOR_VALUE::NONE;
+  this->temperature = temp;
+  SensorBoardEvent event;
+  event.type = NEW_SENSOR_VALUE::NEW_TEMP;
+  event.value = this->temperature;
+  emitEvent(event);
+  return NEW_SENSOR_VALUE::NEW_TEMP;
+}
+
+enum NEW_SENSOR_VALUE SensorBoard::newHumidity(float hum) {
+  hum += config.humOffset;
+  #ifdef SB_HISTORY
+  humHistory.add(_frameTime, hum);
+  #endif
+  if (this->humidity > 100) this->humidity = 100;
+  else if (this->humidity < 0) this->humidity = 0;
+  if (fabs(hum-this->humidity) <= _humHysteresis) return NEW_SENSOR_VALUE::NONE;
+  this->humidity = hum;
+  SensorBoardEvent event;
+  event.type = NEW_SENSOR_VALUE::NEW_HUM;
+  event.value = this->humidity;
+  emitEvent(event);
+  return NEW_SENSOR_VALUE::NEW_HUM;
+}
+
+enum NEW_SENSOR_VALUE SensorBoard::newLight(int32_t lux) {
+  int lig = (int)((float)lux*config.lightCal);
+  #ifdef SB_HISTORY
+  lightHistory.add(_frameTime, lig);
+  #endif
+  if (abs(lig-this->light) <= _lightHysteresis) return NEW_SENSOR_VALUE::NONE;
+  this->light = lig;
+  SensorBoardEvent event;
+  event.type = NEW_SENSOR_VALUE::NEW_LIGHT;
+  event.light = this->light;
+  emitEvent(event);
+  return NEW_SENSOR_VALUE::NEW_LIGHT;
+}
+
+enum NEW_SENSOR_VALUE SensorBoard::newPIR(bool pir) {
+  #ifdef SB_HISTORY
+  PIRHistory.add(_frameTime, pir ? 1.0 : 0.0);
+  #endif
+  if (pir == this->PIR) return NEW_SENSOR_VALUE::NONE;
+  this->PIR = pir;
+  SensorBoardEvent event;
+  event.type = NEW_SENSOR_VALUE::NEW_PIR;
+  event.PIR = this->PIR;
+  emitEvent(event);
+  return NEW_SENSOR_VALUE::NEW_PIR;
+}
+
+void SensorBoard::emitEvent(SensorBoardEvent &event) {
+  emitEvent(event, _frameTime);
+}
+
+void SensorBoard::emitEvent(SensorBoardEvent &event, unsigned long time) {
+  event.time = time;
+  #ifdef SB_EVENT_QUEUE
+  if (!_eventQueue.push(event)) {
+    _droppedEvents++;
+    return;
+  }
+  #if defined(ESP32)
+  if (_eventTask) xTaskNotifyGive(_eventTask);
+  #endif
+  #else
+  deliverEvent(event);
+  #endif
+}
+
+void SensorBoard::deliverEvent(const SensorBoardEvent &event) {
+  _eventTime = event.time;
+  switch (event.type) {
+    case NEW_SENSOR_VALUE::NEW_BTN:
+      if (buttonCB) buttonCB(event.button);
+      break;
+    case NEW_SENSOR_VALUE::NEW_TEMP:
+      if (tempCB) tempCB(event.value);
+      break;
+    case NEW_SENSOR_VALUE::NEW_HUM:
+      if (humCB) humCB(event.value);
+      break;
+    case NEW_SENSOR_VALUE::NEW_LIGHT:
+      if (lightCB) lightCB(event.light);
+      break;
+    case NEW_SENSOR_VALUE::NEW_PIR:
+      if (PIRCB) PIRCB(event.PIR);
+      break;
+    default:
+      break;
+  }
+  if (eventCB) eventCB(eventArg, event.type);
+}
+
+#ifdef SB_EVENT_QUEUE
+void SensorBoard::dispatchEvents() {
+  SensorBoardEvent event;
+  while (_eventQueue.pop(event)) deliverEvent(event);
+}
+
+#if defined(ESP32)
+void SensorBoard::eventTask(void *arg) {
+  SensorBoard *obj = (SensorBoard *)arg;
+  while (true) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    obj->dispatchEvents();
+  }
+}
+
+bool SensorBoard::startEventTask(uint32_t stackSize, UBaseType_t priority, BaseType_t core) {
+  if (_eventTask) return true;
+  if (xTaskCreatePinnedToCore(eventTask, "sensorBoardCB", stackSize, this, priority, &_eventTask, core) != pdPASS) {
+    _eventTask = NULL;
+    return false;
+  }
+  // Events queued before the task existed
+  xTaskNotifyGive(_eventTask);
+  return true;
+}
+#endif
+#endif
+
+void SensorBoard::setGestures(bool on, uint16_t doublePress, uint16_t longPress) {
+  _gestureState = on ? GestureState::IDLE : GestureState::OFF;
+  _doublePress = doublePress;
+  _longPress = longPress;
+  invalidateDeadline();
+}
+
+void SensorBoard::emitButton(BUTTON_PRESS press, unsigned long time) {
+  button = press;
+  SensorBoardEvent event;
+  event.type = NEW_SENSOR_VALUE::NEW_BTN;
+  event.button = press;
+  emitEvent(event, time);
+}
+
+void SensorBoard::buttonEdge(bool pressed, unsigned long time) {
+  // Windows that passed before this edge come first, even if update() was late
+  updateGestures(time);
+  switch (_gestureState) {
+    case GestureState::IDLE:
+      // Act on the press right away, it is most likely a single one
+      if (!pressed) break;
+      emitButton(BUTTON_PRESS::PROVISIONAL, time);
+      _gestureState = GestureState::PRESSED;
+      break;
+    case GestureState::PRESSED:
+      if (pressed) break;
+      _gestureState = GestureState::RELEASED;
+      break;
+    case GestureState::RELEASED:
+      if (!pressed) break;
+      emitButton(BUTTON_PRESS::CANCEL, time);
+      emitButton(BUTTON_PRESS::DOUBLE, time);
+      _gestureState = GestureState::DOUBLE;
+      break;
+    case GestureState::DOUBLE:
+      if (!pressed) _gestureState = GestureState::IDLE;
+      break;
+    case GestureState::LONG:
+      if (pressed) break;
+      emitButton(BUTTON_PRESS::RELEASE, time);
+      _gestureState = GestureState::IDLE;
+      break;
+    default:
+      return;
+  }
+  _gestureTime = time;
+  invalidateDeadline();
+}
+
+void SensorBoard::updateGestures(unsigned long time, unsigned long margin) {
+  // Edge times may lie before the last one if the clock estimate moved
+  long passed = (long)(time - _gestureTime) - (long)margin;
+  if (_gestureState == GestureState::PRESSED && passed >= _longPress) {
+    emitButton(BUTTON_PRESS::CANCEL, _gestureTime + _longPress);
+    emitButton(BUTTON_PRESS::LONG_START, _gestureTime + _longPress);
+    _gestureState = GestureState::LONG;
+  } else if (_gestureState == GestureState::RELEASED && passed >= _doublePress) {
+    emitButton(BUTTON_PRESS::SINGLE, _gestureTime + _doublePress);
+    _gestureState = GestureState::IDLE;
+  }
+}
+
+unsigned long SensorBoard::gestureMargin() const {
+  // Before the clock is synced edges are timed by their arrival
+  if (_clockError == SB_NO_DEADLINE) return SB_GESTURE_MARGIN;
+  return SB_GESTURE_MARGIN + _clockError;
+}
+
+void SensorBoard::resetClock() {
+  _numClockSamples = 0;
+  _nextClockSample = 0;
+  _clockOffset = 0;
+  _clockDrift = 0;
+  _clockRef = 0;
+  _clockError = SB_NO_DEADLINE;
+}
+
+void SensorBoard::resetLatency() {
+  memset(&_latency, 0, sizeof(_latency));
+}
+
+unsigned long SensorBoard::nextPing() {
+  return _numClockSamples < SB_CLOCK_SAMPLES ? SB_PING_INTERVAL_FAST : SB_PING_INTERVAL;
+}
+
+void SensorBoard::clockSample(unsigned long board, unsigned long sent, unsigned long received) {
+  // The board read its clock about halfway through the round trip
+  unsigned long rtt = received - sent;
+  ClockSample & sample = _clockSamples[_nextClockSample];
+  sample.board = board;
+  sample.offset = (long)(sent + rtt/2 - board);
+  sample.rtt = rtt;
+  _nextClockSample = (_nextClockSample+1) % SB_CLOCK_SAMPLES;
+  if (_numClockSamples < SB_CLOCK_SAMPLES) _numClockSamples++;
+
+  // Samples delayed on the way are off by up to half their round trip, only fit the fast ones
+  unsigned long minRtt = SB_NO_DEADLINE;
+  for (int i = 0; i < _numClockSamples; i++) if (_clockSamples[i].rtt < minRtt) minRtt = _clockSamples[i].rtt;
+  float sumX = 0, sumY = 0;
+  int n = 0;
+  for (int i = 0; i < _numClockSamples; i++) {
+    if (_clockSamples[i].rtt > 2*minRtt+1) continue;
+    sumX += (long)(_clockSamples[i].board - board);
+    sumY += _clockSamples[i].offset - sample.offset;
+    n++;
+  }
+  float meanX = sumX/n;
+  float meanY = sumY/n;
+  float sxx = 0, sxy = 0, minX = 0;
+  for (int i = 0; i < _numClockSamples; i++) {
+    if (_clockSamples[i].rtt > 2*minRtt+1) continue;
+    float dx = (long)(_clockSamples[i].board - board) - meanX;
+    sxx += dx*dx;
+    sxy += dx*((_clockSamples[i].offset - sample.offset) - meanY);
+    if (dx + meanX < minX) minX = dx + meanX;
+  }
+  // Drift only shows over a longer time
+  _clockDrift = -minX >= SB_CLOCK_DRIFT_SPAN && sxx > 0 ? sxy/sxx : 0;
+  // Anything beyond a few percent is no crystal but a bad fit
+  if (_clockDrift > SB_CLOCK_MAX_DRIFT) _clockDrift = SB_CLOCK_MAX_DRIFT;
+  if (_clockDrift < -SB_CLOCK_MAX_DRIFT) _clockDrift = -SB_CLOCK_MAX_DRIFT;
+  _clockRef = board;
+  _clockOffset = sample.offset + lroundf(meanY - _clockDrift*meanX);
+  _clockError = minRtt/2 + 1;
+}
+
+unsigned long SensorBoard::stampToHost(uint16_t stamp) {
+  // Board time now, events were sampled before but allow for some error of the estimate
+  long sinceRef = (long)(now() - _clockOffset - _clockRef);
+  unsigned long board = _clockRef + lroundf(sinceRef / (1 + _clockDrift)) + _clockError;
+  // Nearest time with that stamp, within half the 65.5s the stamp covers. The board stamps
+  // older values with the time they are sent, see MAX_STAMP_AGE of the firmware
+  board += (int16_t)(stamp - (uint16_t)board);
+  return board + _clockOffset + lroundf(_clockDrift*(long)(board - _clockRef));
+}
+
 void SensorBoard::setAutoSensorMode(bool on) {
-  if (on) _getter->println("!a");
-  else _getter->println("!o");
+  if (on && protocol >= SB_PROTO_FILTER) {
+    sendSensorFilter(NEW_SENSOR_VALUE::NEW_TEMP);
+    sendSensorFilter(NEW_SENSOR_VALUE::NEW_HUM);
+    sendSensorFilter(NEW_SENSOR_VALUE::NEW_LIGHT);
+    sendSensorFilter(NEW_SENSOR_VALUE::NEW_PIR);
+  }
+  if (on) sendCommand("!a");
+  else sendCommand("!o");
   this->autoMode = on;
 }
 
+// Filter of each sensor, -1 if it has none
+static int filterIndex(NEW_SENSOR_VALUE sensor) {
+  switch (sensor) {
+    case NEW_SENSOR_VALUE::NEW_TEMP: return 0;
+    case NEW_SENSOR_VALUE::NEW_HUM: return 1;
+    case NEW_SENSOR_VALUE::NEW_LIGHT: return 2;
+    case NEW_SENSOR_VALUE::NEW_PIR: return 3;
+    default: return -1;
+  }
+}
+
+bool SensorBoard::setSensorFilter(NEW_SENSOR_VALUE sensor, float deadband, uint16_t minInterval, uint32_t maxInterval) {
+  int i = filterIndex(sensor);
+  if (i < 0) return false;
+  _filters[i].deadband = deadband;
+  _filters[i].minInterval = minInterval;
+  _filters[i].maxInterval = maxInterval;
+  if (protocol >= SB_PROTO_FILTER) sendSensorFilter(sensor);
+  configChanged();
+  return true;
+}
+
+// Query command of each sensor
+static const char * queryCommand(NEW_SENSOR_VALUE sensor) {
+  switch (sensor) {
+    case NEW_SENSOR_VALUE::NEW_TEMP: return "?t";
+    case NEW_SENSOR_VALUE::NEW_HUM: return "?h";
+    case NEW_SENSOR_VALUE::NEW_LIGHT: return "?l";
+    case NEW_SENSOR_VALUE::NEW_PIR: return "?p";
+    case NEW_SENSOR_VALUE::NEW_SENSORS: return "?s";
+    default: return NULL;
+  }
+}
+
+SensorBoardFilter SensorBoard::rawFilter(int i) {
+  SensorBoardFilter filter = _filters[i];
+  // The board filters its raw light values, before calibration
+  if (i == filterIndex(NEW_SENSOR_VALUE::NEW_LIGHT) && config.lightCal > 0) filter.deadband /= config.lightCal;
+  return filter;
+}
+
+void SensorBoard::sendSensorFilter(NEW_SENSOR_VALUE sensor) {
+  int i = filterIndex(sensor);
+  if (i < 0) return;
+  SensorBoardFilter filter = rawFilter(i);
+  // Sensor, deadband, min and max interval
+  uint8_t payload[1+sizeof(filter)];
+  payload[0] = (uint8_t)queryCommand(sensor)[1];
+  memcpy(&payload[1], &filter, sizeof(filter));
+  sendCommand("!F", payload, sizeof(payload));
+}
+
+int SensorBoard::requestSensor(NEW_SENSOR_VALUE sensor, unsigned int timeout) {
+  const char * cmd = queryCommand(sensor);
+  if (cmd == NULL) return -1;
+  if (sensor == NEW_SENSOR_VALUE::NEW_SENSORS && protocol < SB_PROTO_BULK) return -1;
+  // Take a free slot or reuse the oldest finished one
+  Request * slot = NULL;
+  for (int i = 0; i < SB_MAX_REQUESTS; i++) {
+    Request * r = &_requests[i];
+    if (r->state == REQUEST_STATE::PENDING) continue;
+    if (r->state == REQUEST_STATE::FREE) {
+      slot = r;
+      break;
+    }
+    if (slot == NULL || (long)(r->sent - slot->sent) < 0) slot = r;
+  }
+  if (slot == NULL) return -1;
+  slot->id = _nextRequestId++;
+  slot->cmd = cmd[1];
+  slot->state = REQUEST_STATE::PENDING;
+  slot->sent = now();
+  slot->timeout = timeout;
+  invalidateDeadline();
+  sendCommand(cmd, NULL, 0, slot->id);
+  return slot->id;
+}
+
+REQUEST_STATE SensorBoard::requestState(int id) {
+  for (int i = 0; i < SB_MAX_REQUESTS; i++) {
+    if (_requests[i].state != REQUEST_STATE::FREE && _requests[i].id == id) return _requests[i].state;
+  }
+  return REQUEST_STATE::FREE;
+}
+
+void SensorBoard::completeRequest(char cmd, int id) {
+  // Untagged replies (older firmware or auto mode) answer the oldest request of that type
+  Request * match = NULL;
+  for (int i = 0; i < SB_MAX_REQUESTS; i++) {
+    Request * r = &_requests[i];
+    if (r->state != REQUEST_STATE::PENDING || r->cmd != cmd) continue;
+    if (id >= 0) {
+      if (r->id == id) {
+        match = r;
+        break;
+      }
+    } else if (match == NULL || (long)(r->sent - match->sent) < 0) {
+      match = r;
+    }
+  }
+  if (match == NULL) return;
+  match->state = REQUEST_STATE::DONE;
+  if (requestCB) requestCB(match->id, true);
+}
+
+void SensorBoard::checkRequests() {
+  for (int i = 0; i < SB_MAX_REQUESTS; i++) {
+    Request * r = &_requests[i];
+    if (r->state != REQUEST_STATE::PENDING) continue;
+    if (now() - r->sent <= r->timeout) continue;
+    r->state = REQUEST_STATE::FAILED;
+    SB_STAT(_stats.requestTimeouts++);
+    if (_logFunc) _logFunc("Sensor request %u timed out", r->id);
+    if (requestCB) requestCB(r->id, false);
+  }
+}
+
+bool SensorBoard::query(NEW_SENSOR_VALUE sensor, bool wait) {
+  if (!wait) {
+    sendCommand(queryCommand(sensor));
+    return true;
+  }
+  int id = requestSensor(sensor);
+  if (id < 0) return false;
+  while (requestState(id) == REQUEST_STATE::PENDING) {
+    handle();
+    checkRequests();
+    yield();
+  }
+  return requestState(id) == REQUEST_STATE::DONE;
+}
+
 bool SensorBoard::updateSensors(bool wait) {
+  // Newer firmware answers all sensors in a single frame
+  if (protocol >= SB_PROTO_BULK) return query(NEW_SENSOR_VALUE::NEW_SENSORS, wait);
   bool success = true;
   success &= updateLight(wait);
   success &= updateTemp(wait);
@@ -181,71 +1417,230 @@ bool SensorBoard::updateSensors(bool wait) {
 }
 
 bool SensorBoard::updateLight(bool wait) {
-  _getter->println("?l");
-  if (wait) return handle(SENSOR_WAIT_TIME) == NEW_SENSOR_VALUE::NEW_LIGHT;
-  else return true;
+  return query(NEW_SENSOR_VALUE::NEW_LIGHT, wait);
 }
 
 bool SensorBoard::updateTemp(bool wait) {
-  _getter->println("?t");
-  if (wait) return handle(SENSOR_WAIT_TIME) == NEW_SENSOR_VALUE::NEW_TEMP;
-  else return true;
+  return query(NEW_SENSOR_VALUE::NEW_TEMP, wait);
 }
 
 bool SensorBoard::updateHum(bool wait) {
-  _getter->println("?h");
-  if (wait) return handle(SENSOR_WAIT_TIME) == NEW_SENSOR_VALUE::NEW_HUM;
-  else return true;
+  return query(NEW_SENSOR_VALUE::NEW_HUM, wait);
 }
 
 bool SensorBoard::updatePIR(bool wait) {
-  _getter->println("?p");
-  if (wait) return handle(SENSOR_WAIT_TIME) == NEW_SENSOR_VALUE::NEW_PIR;
-  else return true;
+  return query(NEW_SENSOR_VALUE::NEW_PIR, wait);
 }
 
 void SensorBoard::update() {
   // Handle incoming data
-  if (_getter->available()) handle();
+  handle();
+  if (_initState != InitState::IDLE && _initState != InitState::READY && _initState != InitState::FAILED) {
+    updateInit();
+  } else if (_initState == InitState::READY && _configSync) {
+    updateConfigSync();
+  // Store settings changed at runtime once they settled
+  } else if (_initState == InitState::READY && _configDirty && now() - _configChanged >= SB_CONFIG_SYNC_DELAY) {
+    if (protocol >= SB_PROTO_CONFIG) {
+      _configTries = 0;
+      pushConfig();
+    } else {
+      _configDirty = false;
+      storeCache();
+    }
+  }
+  // Nothing timed is due yet
+  if (_deadlineValid && (long)(now() - _deadline) < 0) return;
+  // Keep the clocks in sync
+  if (_initState == InitState::READY && protocol >= SB_PROTO_TIME) {
+    if (_pingPending && now() - _pingSent > SB_PING_TIMEOUT) _pingPending = false;
+    if (!_pingPending && now() - _pingSent >= nextPing()) {
+      _pingSent = now();
+      _pingPending = true;
+      sendCommand("?T");
+    }
+  }
+  updateGestures(now(), gestureMargin());
+  // Fail requests without an answer
+  checkRequests();
   // Update leds
   updateLEDPattern();
+  computeDeadline();
+}
+
+static inline unsigned long earliest(unsigned long a, unsigned long b) {
+  return a < b ? a : b;
+}
+
+// Time left until since+interval, 0 if already passed
+static unsigned long remaining(unsigned long time, unsigned long since, unsigned long interval) {
+  unsigned long passed = time - since;
+  return passed >= interval ? 0 : interval - passed;
+}
+
+void SensorBoard::computeDeadline() {
+  unsigned long t = now();
+  unsigned long next = SB_NO_DEADLINE;
+  // Pattern expiry
+  if (patternDuration != -1) {
+    long expire = _patternOnBoard ? patternDuration + PATTERN_EXPIRE_GRACE : patternDuration;
+    next = earliest(next, remaining(t, patternStartMillis, expire+1));
+  }
+  // Next step of a pattern computed here
+  if (!_patternOnBoard && currentPattern < LEDPattern::numberOfPatterns && currentPattern != LEDPattern::staticPattern) {
+    unsigned int step = patternUpdateTime(currentPattern);
+    if (patternState == INIT_PATTERN) next = 0;
+    else if (step != 0) next = earliest(next, remaining(t, patternTimer, step));
+  }
+  // Request timeouts
+  for (int i = 0; i < SB_MAX_REQUESTS; i++) {
+    if (_requests[i].state != REQUEST_STATE::PENDING) continue;
+    next = earliest(next, remaining(t, _requests[i].sent, _requests[i].timeout+1));
+  }
+  // Clock ping or its timeout
+  if (_initState == InitState::READY && protocol >= SB_PROTO_TIME) {
+    next = earliest(next, remaining(t, _pingSent, _pingPending ? SB_PING_TIMEOUT+1 : nextPing()));
+  }
+  // Double or long press window
+  if (_gestureState == GestureState::PRESSED) next = earliest(next, remaining(t, _gestureTime, _longPress + gestureMargin()));
+  else if (_gestureState == GestureState::RELEASED) next = earliest(next, remaining(t, _gestureTime, _doublePress + gestureMargin()));
+  // Init steps and syncing the settings
+  switch (_initState) {
+    case InitState::IDLE:
+    case InitState::FAILED:
+      break;
+    case InitState::READY:
+      if (_configSync) next = earliest(next, remaining(t, _configTimer, SB_INIT_TIMEOUT));
+      else if (_configDirty) next = earliest(next, remaining(t, _configChanged, SB_CONFIG_SYNC_DELAY));
+      break;
+    case InitState::BAUD_FALLBACK:
+      next = earliest(next, remaining(t, _baudSwitched, SB_BAUD_TRIAL_TIMEOUT+SB_BAUD_TRIAL_MARGIN+1));
+      break;
+    default:
+      next = earliest(next, remaining(t, _initTimer, initTimeout()));
+      break;
+  }
+  _deadline = t + (next == SB_NO_DEADLINE ? SB_NO_DEADLINE/2 : next);
+  _deadlineValid = true;
+}
+
+unsigned long SensorBoard::deadline() {
+  if (!_deadlineValid) computeDeadline();
+  return _deadline;
+}
+
+unsigned long SensorBoard::nextDeadline() {
+  if (!_deadlineValid) computeDeadline();
+  // Far in the future if nothing is scheduled
+  long left = (long)(_deadline - now());
+  if (left <= 0) return 0;
+  if ((unsigned long)left >= SB_NO_DEADLINE/2) return SB_NO_DEADLINE;
+  return left;
 }
 
 // _____________________________________LED Stuff__________________________________________________
 void SensorBoard::setBrightness(float brightness) {
-  int bright = brightness/100.0*255;
-  if (bright > 255) bright = 255;
-  if (bright < 0) bright = 0;
-  _getter->print("!b");
-  _getter->write((uint8_t)bright);
-  _getter->println();
+  uint8_t value = brightnessValue(brightness);
+  sendCommand("!b", &value, 1);
   config.brightness = brightness;
+  configChanged();
+}
+
+void SensorBoard::setPowerColorMap(const CRGB *stops, size_t n, POWER_SCALE scale, POWER_DISPLAY display) {
+  if (stops == NULL || n == 0) return;
+  if (n > SB_MAX_COLOR_STOPS) n = SB_MAX_COLOR_STOPS;
+  for (size_t i = 0; i < n; i++) _colorStops[i] = stops[i];
+  _numColorStops = n;
+  _powerScale = scale;
+  _powerDisplay = display;
+  _lutValid = false;
+}
+
+CRGB SensorBoard::gradient(float position) {
+  if (_numColorStops == 1 || position <= 0) return _colorStops[0];
+  if (position >= 1) return _colorStops[_numColorStops-1];
+  float segment = position*(_numColorStops-1);
+  size_t k = (size_t)segment;
+  float frac = segment - k;
+  CRGB c;
+  for (int i = 0; i < 3; i++) {
+    c.raw[i] = (uint8_t)(_colorStops[k].raw[i] + frac*((int)_colorStops[k+1].raw[i] - (int)_colorStops[k].raw[i]) + 0.5f);
+  }
+  return c;
+}
+
+void SensorBoard::buildPowerLUT() {
+  float minW = config.minLEDWatt;
+  float maxW = config.maxLEDWatt > 0 ? config.maxLEDWatt : 1;
+  // Power goes from 0 - 3600 max but we say that even 200 Watt is bad,
+  // anything above maxLEDWatt gets the last entry
+  _lutScale = (SB_POWER_LUT_SIZE-1)/maxW;
+  // Entries below minLEDWatt only serve the interpolation, powerToLEDs() checks the threshold itself
+  for (int i = 0; i < SB_POWER_LUT_SIZE; i++) {
+    float power = i/_lutScale;
+    PowerColor &entry = _powerLUT[i];
+    float position;
+    if (_powerScale == POWER_SCALE::LOG) {
+      float lower = minW > 0 ? minW : 1;
+      position = maxW > lower ? log(power/lower)/log(maxW/lower) : 1;
+      if (position < 0) position = 0;
+    } else {
+      position = power/maxW;
+    }
+    entry.color = gradient(position);
+    int level = (int)(position*255 + 0.5f);
+    entry.level = level < 1 ? 1 : (level > 255 ? 255 : level);
+  }
+  // Each bar LED shows the color of its position
+  for (int i = 0; i < NUM_LEDS; i++) _barColor[i] = gradient((float)(i+1)/NUM_LEDS);
+  _lutMinWatt = config.minLEDWatt;
+  _lutMaxWatt = config.maxLEDWatt;
+  _lutValid = true;
 }
 
 void SensorBoard::powerToLEDs(float power) {
-  int normalizes = (int)power;
-  if (normalizes < 0) normalizes = 0;
-  // Power goes from 0 - 3600 max but we say that even 200 Watt is bad and 
-  // keep a linear mapping
-  else if (normalizes > config.maxLEDWatt) normalizes = config.maxLEDWatt;
-  
-  uint8_t red = map(normalizes, 0, config.maxLEDWatt, 0, 255);
-  uint8_t green = 255 - red;
-  if (normalizes < config.minLEDWatt) {
-    red = 0; 
-    green = 0;
-  }
-  CRGB c = CRGB{red, green, 0};
+  if (!_lutValid || _lutMinWatt != config.minLEDWatt || _lutMaxWatt != config.maxLEDWatt) buildPowerLUT();
+  PowerColor entry;
+  if (power < config.minLEDWatt) {
+    entry.color = COLOR_BLACK;
+    entry.level = 0;
+  } else {
+    float x = power*_lutScale;
+    int index = (int)x;
+    if (index >= SB_POWER_LUT_SIZE-1) {
+      entry = _powerLUT[SB_POWER_LUT_SIZE-1];
+    } else {
+      // Between two entries
+      const PowerColor &lower = _powerLUT[index];
+      const PowerColor &upper = _powerLUT[index+1];
+      float frac = x - index;
+      for (int k = 0; k < 3; k++) {
+        entry.color.raw[k] = (uint8_t)(lower.color.raw[k] + frac*((int)upper.color.raw[k] - (int)lower.color.raw[k]) + 0.5f);
+      }
+      entry.level = (uint8_t)(lower.level + frac*((int)upper.level - (int)lower.level) + 0.5f);
+    }
+  }
+  if (_powerDisplay == POWER_DISPLAY::COLOR) {
+    allLEDs(entry.color);
+    return;
+  }
+  // Bar graph from left to right, the last LED dimmed by the remainder
+  int filled = (int)entry.level*NUM_LEDS;
   for (int i = 0; i < NUM_LEDS; i++) {
-    LED[i] = c;
+    int fill = filled - i*255;
+    if (fill > 255) fill = 255;
+    if (fill < 0) fill = 0;
+    CRGB c;
+    for (int k = 0; k < 3; k++) c.raw[k] = (uint8_t)(((int)_barColor[i].raw[k]*fill)/255);
+    // Same layout as setDots
+    LED[(i+2)%NUM_LEDS] = c;
   }
-  // updateLEDs();
 }
 
 void SensorBoard::setRainbow(long duration) {
-  LED[2] = COLOR_RED;
-  LED[0] = COLOR_GREEN;
-  LED[1] = COLOR_BLUE;
+  // Green, blue and red as on the board, repeated along longer strips
+  const CRGB rainbow[3] = {COLOR_GREEN, COLOR_BLUE, COLOR_RED};
+  for (int i = 0; i < NUM_LEDS; i++) LED[i] = rainbow[i % 3];
   // Make sure timing and saving is done
   newLEDPattern(LEDPattern::staticPattern, duration, COLOR_BLACK, COLOR_BLACK);
   updateLEDs();
@@ -358,10 +1753,12 @@ void SensorBoard::newLEDPattern(LEDPattern pattern, long duration, CRGB theFGCol
   bgColor = theBGColor;
   // Patern should init
   patternState = INIT_PATTERN;
-  patternStartMillis = millis();
+  patternStartMillis = now();
   // Update pattern once
-  patternTimer = millis();
-  updateLEDPattern();
+  patternTimer = now();
+  invalidateDeadline();
+  _patternOnBoard = startBoardPattern(duration);
+  if (!_patternOnBoard) updateLEDPattern();
 }
 
 void SensorBoard::saveOldPattern() {
@@ -380,19 +1777,75 @@ void SensorBoard::restoreOldPattern() {
   if (oldPattern == LEDPattern::staticPattern) {
     setAllLEDs(mainColor);
   }
-  patternTimer = millis();
+  patternTimer = now();
+  // Restored patterns run forever
+  _patternOnBoard = startBoardPattern(-1);
+}
+
+bool SensorBoard::startBoardPattern(long duration) {
+  if (protocol < SB_PROTO_PATTERN) return false;
+  if (currentPattern != LEDPattern::blinkPattern && currentPattern != LEDPattern::roundPattern
+      && currentPattern != LEDPattern::glowPattern) return false;
+  // Type, colors, step time and duration, the board animates it on its own
+  uint8_t data[13];
+  data[0] = (uint8_t)currentPattern;
+  for (int c = 0; c < 3; c++) data[1+c] = mainColor.raw[c];
+  for (int c = 0; c < 3; c++) data[4+c] = bgColor.raw[c];
+  uint16_t step = patternUpdateTime(currentPattern);
+  int32_t dur = duration;
+  memcpy(&data[7], &step, 2);
+  memcpy(&data[9], &dur, 4);
+  sendCommand("!P", data, sizeof(data));
+  // LEDs on the board now differ from the last frame
+  _ledsSynced = false;
+  return true;
+}
+
+void SensorBoard::expirePattern() {
+  invalidateDeadline();
+  SB_STAT(_stats.patternRestores++);
+  restoreOldPattern();
+  patternStartMillis = now();
+  patternDuration = -1;
+  if (_logFunc) {
+    _logFunc("Reset old pattern: %i, state: %i", (int)currentPattern, patternState);
+  }
 }
 
 void SensorBoard::updateLEDs() {
-  _getter->print("!L");
+  bool fade = fadeUpdate;
+  fadeUpdate = false;
+  // Nothing to send if the board already shows these colors
+  int changed = 0;
   for (int l = 0; l < NUM_LEDS; l++) {
-    for (int c = 0; c < 3; c++) _getter->write(LED[l].raw[c]);
+    if (!_ledsSynced || LED[l] != _sentLED[l]) changed++;
   }
-  if (fadeUpdate) {
-    fadeUpdate = false;
-    _getter->print("f");
+  if (changed == 0) {
+    SB_STAT(_stats.ledFramesSuppressed++);
+    return;
+  }
+  SB_STAT(_stats.ledFramesSent++);
+
+  uint8_t data[4*NUM_LEDS+1];
+  uint8_t len = 0;
+  // Only send the changed LEDs as index and color if that is shorter
+  if (_ledsSynced && protocol >= SB_PROTO_LED_DELTA && 1+4*changed < 3*NUM_LEDS) {
+    data[len++] = fade ? SB_LED_FADE : 0;
+    for (int l = 0; l < NUM_LEDS; l++) {
+      if (LED[l] == _sentLED[l]) continue;
+      data[len++] = l;
+      for (int c = 0; c < 3; c++) data[len++] = LED[l].raw[c];
+    }
+    sendCommand("!U", data, len);
+  } else {
+    for (int l = 0; l < NUM_LEDS; l++) {
+      for (int c = 0; c < 3; c++) data[len++] = LED[l].raw[c];
+    }
+    if (fade) data[len++] = 'f';
+    sendCommand("!L", data, len);
   }
-  _getter->println();
+  for (int l = 0; l < NUM_LEDS; l++) _sentLED[l] = LED[l];
+  _ledsSynced = true;
 }
 
 
@@ -455,32 +1908,45 @@ void SensorBoard::updateRoundPattern(SensorBoard* obj) {
   if (obj->patternState == NUM_LEDS) obj->patternState = 0;
 }
 
+unsigned int SensorBoard::patternUpdateTime(LEDPattern pattern) {
+  switch (pattern) {
+    case LEDPattern::blinkPattern: return BLINK_STEP;
+    case LEDPattern::roundPattern: return ROUND_STEP;
+    case LEDPattern::glowPattern: return GLOW_STEP;
+    case LEDPattern::activePowerPattern: return ACTIVE_POWER_UPDATE;
+    default: return 0;
+  }
+}
+
 void SensorBoard::updateLEDPattern() {
-  // Check if old pattern needs to be restored
+  // Check if old pattern needs to be restored, the board reports
+  // expiry of its own patterns, the timeout only covers a lost report
   if (patternDuration != -1) {
-    if (millis()-patternStartMillis > patternDuration) {
-      restoreOldPattern();
-      patternStartMillis = millis();
-      patternDuration = -1;
-      if (_logFunc) {
-        _logFunc("Reset old pattern: %i, state: %i", (int)currentPattern, patternState);
-      }
-    
-    }
+    long expire = _patternOnBoard ? patternDuration + PATTERN_EXPIRE_GRACE : patternDuration;
+    if (now()-patternStartMillis > expire) expirePattern();
   }
+  // Animated by the board
+  if (_patternOnBoard) return;
   // precent overflow
   if (currentPattern >= LEDPattern::numberOfPatterns) return;
   // Static pattern already updated
   if (currentPattern == LEDPattern::staticPattern) return;
   // if pattern with no update time are specified only inititalize
-  if (patternUpdateTimes[(int)currentPattern] == 0 && patternState != INIT_PATTERN) return;
+  unsigned int step = patternUpdateTime(currentPattern);
+  if (step == 0 && patternState != INIT_PATTERN) return;
   // Return if update time not reached or not inited yet
-  if (patternState != INIT_PATTERN && millis() - patternTimer < patternUpdateTimes[(int)currentPattern]) return;
+  if (patternState != INIT_PATTERN && now() - patternTimer < step) return;
   // Handle the current pattern
-  updatePattern[(int)currentPattern](this);
+  switch (currentPattern) {
+    case LEDPattern::blinkPattern: updateBlinkPattern(this); break;
+    case LEDPattern::roundPattern: updateRoundPattern(this); break;
+    case LEDPattern::glowPattern: updateGlowPattern(this); break;
+    case LEDPattern::activePowerPattern: updateActivePowerPattern(this); break;
+    default: return;
+  }
   // Update the timer and the leds
   if (_logFunc) _logFunc("Pattern updated");
-  patternTimer = millis();
+  patternTimer = now();
   updateLEDs();
 }
 
@@ -508,15 +1974,8 @@ void SensorBoard::fadeTowardColor(const CRGB& bgColor, uint8_t fadeAmount) {
 }
 
 template < typename TOut >
-// TODO Test this!
-TOut SensorBoard::parse() {
+TOut SensorBoard::parse(const uint8_t *data) {
   TOut value;
-  if (_getter->available() > sizeof(TOut)-1) {
-    uint8_t bytes[sizeof(TOut)] = {};
-    for (int i = 0; i < sizeof(TOut); i++) {
-      bytes[i] = _getter->read();
-    }
-    memcpy(&value, &bytes[0], sizeof(value));
-  }
+  memcpy(&value, data, sizeof(value));
   return value; 
 }
@@ -12,17 +12,170 @@
 #define SENSORBOARD_h
 
 
+#if defined(ARDUINO)
 #if (ARDUINO >= 100)
 #include "Arduino.h"
 #else
 #include "WProgram.h"
 #endif
+#else
+// Native build, e.g. on a Linux gateway with PosixSerial as transport
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#endif
 
 
+// Number of LEDs on the board, may be set for longer strips
+#ifndef NUM_LEDS
 #define NUM_LEDS 3
+#endif
+// Size of the receive ring buffer (must be a power of two)
+#define SB_RX_BUFFER_SIZE 128
+// Maximum payload size of a single frame, large enough for a full LED frame
+#define SB_MAX_PAYLOAD (3*NUM_LEDS+1 > 48 ? 3*NUM_LEDS+1 : 48)
+
+// Protocol version announced during the ??/!! handshake
+// 0: legacy line based frames '!' CMD PAYLOAD '\r\n'
+// 1: binary frames SOF LEN CMD PAYLOAD[LEN] CRC8
+// 2: bulk sensor query ?s
+// 3: queries may carry a sequence id that is echoed in the reply
+// 4: partial LED update !U
+// 5: blink, round and glow patterns run on the board !P
+// 6: baud rate negotiation !B, echo test ?e and commit !C
+// 7: deadband and send intervals per sensor for auto mode !F
+// 8: config blob stored on the board ?c/!c
+// 9: events end with the board time they were sampled at, clock ping ?T
+// 10: temperature and humidity as int16 in 1/100 units, light as varint
+#define SB_PROTOCOL_VERSION 10
+#define SB_PROTO_LEGACY 0
+#define SB_PROTO_BINARY 1
+#define SB_PROTO_BULK 2
+#define SB_PROTO_SEQ 3
+#define SB_PROTO_LED_DELTA 4
+#define SB_PROTO_PATTERN 5
+#define SB_PROTO_BAUD 6
+#define SB_PROTO_FILTER 7
+#define SB_PROTO_CONFIG 8
+#define SB_PROTO_TIME 9
+#define SB_PROTO_COMPACT 10
+// Start of a binary frame
+#define SB_FRAME_SOF 0xA5
+// Set in the command byte if the payload starts with a sequence id
+#define SB_SEQ_FLAG 0x80
+// Number of requests that can be in flight at once
+#define SB_MAX_REQUESTS 8
+// Flag of the partial LED update to fade towards the new colors
+#define SB_LED_FADE 0x01
+// Entries of the power to color lookup table, colors in between are interpolated
+#ifndef SB_POWER_LUT_SIZE
+#define SB_POWER_LUT_SIZE 32
+#endif
+// Max number of colors of a power color map
+#define SB_MAX_COLOR_STOPS 8
+
+// Baud rates tried after the handshake, fastest first
+#ifndef SB_BAUD_RATES
+#define SB_BAUD_RATES {500000, 250000, 115200, 57600}
+#endif
+// Max time to wait for each reply during baud rate negotiation
+#define SB_BAUD_TIMEOUT 200
+// The board falls back to the old rate if a new one is not committed within this time
+#define SB_BAUD_TRIAL_TIMEOUT 500
+// Extra wait before trying the next rate, the board's trial starts only once the request
+// arrived and its timer fires on its next loop() pass
+#ifndef SB_BAUD_TRIAL_MARGIN
+#define SB_BAUD_TRIAL_MARGIN 100
+#endif
+
+// Max time to wait for each reply during init() and how often to retry
+#define SB_INIT_TIMEOUT 300
+#define SB_INIT_RETRIES 3
+// Version of the config blob on the board and of the host cache
+#define SB_CONFIG_VERSION 1
+// Config blob: version, brightness, filters of temperature, humidity, light and PIR, crc
+#define SB_BOARD_CONFIG_SIZE 43
+// Settings changed at runtime are stored on the board once they stayed the same this long
+#define SB_CONFIG_SYNC_DELAY 5000
+
+// Clock sync pings, more often until all samples of the clock estimate are taken
+#define SB_PING_INTERVAL 10000
+#define SB_PING_INTERVAL_FAST 1000
+#define SB_PING_TIMEOUT 500
+#define SB_CLOCK_SAMPLES 8
+// Time span of the samples needed to estimate the drift of the board's clock
+#define SB_CLOCK_DRIFT_SPAN 10000
+#define SB_CLOCK_MAX_DRIFT 0.02
+
+// Default gesture timing in ms, see setGestures()
+#define SB_GESTURE_DOUBLE_PRESS 300
+#define SB_GESTURE_LONG_PRESS 800
+// Time in ms a window stays open beyond clockError() for edges still on the way
+#ifndef SB_GESTURE_MARGIN
+#define SB_GESTURE_MARGIN 20
+#endif
+
+// Returned by nextDeadline() if no timed work is pending
+#define SB_NO_DEADLINE 0xFFFFFFFFUL
+
+// Validity bits of the bulk sensor frame
+#define SB_VALID_LIGHT 0x01
+#define SB_VALID_TEMP 0x02
+#define SB_VALID_HUM 0x04
+#define SB_VALID_PIR 0x08
+
+// Uncomment to keep link statistics, see stats()
+// #define SB_STATS
+#ifdef SB_STATS
+#define SB_STAT(x) x
+#else
+#define SB_STAT(x)
+#endif
+
+// Uncomment to keep a history of all sensor values, see sensorHistory.h
+// #define SB_HISTORY
+#ifdef SB_HISTORY
+#include "sensorHistory.h"
+#endif
+
+// Uncomment to record the link traffic through setRecorder(), see sensorBoardReplay.h
+// #define SB_RECORDER
+
+// Capture of the link traffic: magic and version, the host's protocol version, varints of the
+// baud rate of the link and the host's time in ms, then one record per read or write of a type
+// byte, varints of the time since the previous record in us and the length, and the bytes
+#define SB_CAPTURE_MAGIC "SBC"
+#define SB_CAPTURE_VERSION 2
+#define SB_CAPTURE_RX 0
+#define SB_CAPTURE_TX 1
+
+// Uncomment to run the callbacks from dispatchEvents() instead of within handle(),
+// e.g. on their own task so slow callbacks do not stall the serial link
+// #define SB_EVENT_QUEUE
+#ifdef SB_EVENT_QUEUE
+#include <atomic>
+#if defined(ESP32)
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#endif
+// Number of events the queue holds (must be a power of two)
+#ifndef SB_EVENT_QUEUE_SIZE
+#define SB_EVENT_QUEUE_SIZE 32
+#endif
+#endif
+
 enum class LED_MODE {MANUAL = 0, POWER = 1};
-enum class NEW_SENSOR_VALUE {NONE = 0, NEW_BTN = 1, NEW_TEMP = 2, NEW_HUM = 3, NEW_LIGHT = 4, NEW_PIR = 5, ACTIVE = 6, UNKNOWN = 6};
-enum class BUTTON_PRESS {NONE=0, SINGLE=1, DOUBLE=2, LONG_START=3, RELEASE=4, PRESS=5};
+// Scale of the power to color mapping
+enum class POWER_SCALE {LINEAR = 0, LOG = 1};
+// All LEDs in the power color or a bar graph over the LEDs
+enum class POWER_DISPLAY {COLOR = 0, BAR = 1};
+enum class NEW_SENSOR_VALUE {NONE = 0, NEW_BTN = 1, NEW_TEMP = 2, NEW_HUM = 3, NEW_LIGHT = 4, NEW_PIR = 5, ACTIVE = 6, UNKNOWN = 6, NEW_SENSORS = 7};
+enum class REQUEST_STATE {FREE = 0, PENDING = 1, DONE = 2, FAILED = 3};
+// With gestures on the host, PROVISIONAL comes right with the first press and
+// is either confirmed by SINGLE or followed by CANCEL and DOUBLE or LONG_START
+enum class BUTTON_PRESS {NONE=0, SINGLE=1, DOUBLE=2, LONG_START=3, RELEASE=4, PRESS=5, PROVISIONAL=6, CANCEL=7};
 
 enum class LEDPattern {
   staticPattern = 0,
@@ -42,6 +195,112 @@ struct __attribute__((__packed__)) SensorBoardConfiguration {
   float maxLEDWatt = 200.0;
 };
 
+// A new value received from the board
+struct SensorBoardEvent {
+  NEW_SENSOR_VALUE type;
+  // Receive time in ms
+  unsigned long time;
+  union {
+    BUTTON_PRESS button;
+    // Temperature or humidity
+    float value;
+    int32_t light;
+    bool PIR;
+  };
+};
+
+#ifdef SB_EVENT_QUEUE
+static_assert((SB_EVENT_QUEUE_SIZE & (SB_EVENT_QUEUE_SIZE-1)) == 0, "SB_EVENT_QUEUE_SIZE must be a power of two");
+
+// Lock-free queue between a single producer and a single consumer
+class SensorBoardEventQueue {
+  public:
+    SensorBoardEventQueue() : _head(0), _tail(0) {}
+    // Producer side, false if the queue is full
+    bool push(const SensorBoardEvent &event) {
+      uint16_t head = _head.load(std::memory_order_relaxed);
+      if ((uint16_t)(head - _tail.load(std::memory_order_acquire)) >= SB_EVENT_QUEUE_SIZE) return false;
+      _events[head & (SB_EVENT_QUEUE_SIZE-1)] = event;
+      _head.store(head+1, std::memory_order_release);
+      return true;
+    }
+    // Consumer side, false if the queue is empty
+    bool pop(SensorBoardEvent &event) {
+      uint16_t tail = _tail.load(std::memory_order_relaxed);
+      if (tail == _head.load(std::memory_order_acquire)) return false;
+      event = _events[tail & (SB_EVENT_QUEUE_SIZE-1)];
+      _tail.store(tail+1, std::memory_order_release);
+      return true;
+    }
+  private:
+    SensorBoardEvent _events[SB_EVENT_QUEUE_SIZE];
+    // Free running indices, written by one side only
+    std::atomic<uint16_t> _head;
+    std::atomic<uint16_t> _tail;
+};
+#endif
+
+// Auto mode filter of a sensor, see setSensorFilter()
+struct __attribute__((__packed__)) SensorBoardFilter {
+  float deadband;
+  uint16_t minInterval;
+  uint32_t maxInterval;
+};
+
+// Settings kept by the host through the load/store function
+struct __attribute__((__packed__)) SensorBoardCache {
+  uint8_t version;
+  SensorBoardConfiguration config;
+  // Filters of temperature, humidity, light and PIR
+  SensorBoardFilter filters[4];
+  // Baud rate the board runs at
+  uint32_t baud;
+  uint8_t crc;
+};
+
+// One-way latency in ms from sampling on the board to parsing a frame on the host
+struct SensorBoardLatency {
+  uint32_t count;
+  uint32_t sum;
+  uint16_t min;
+  uint16_t max;
+};
+
+#ifdef SB_STATS
+// Commands counted in SensorBoardStats::frames, in this order
+#define SB_STATS_COMMANDS "brthlpsP!BeCcT"
+#define SB_STATS_NUM_COMMANDS (sizeof(SB_STATS_COMMANDS)-1)
+// Upper bounds in us of the decode time histogram buckets, the last bucket takes the rest
+#define SB_STATS_TIME_BUCKETS {10, 100, 1000, 10000}
+#define SB_STATS_NUM_TIME_BUCKETS 5
+
+struct SensorBoardStats {
+  uint32_t bytesRx;
+  uint32_t bytesTx;
+  // Frames received per command of SB_STATS_COMMANDS
+  uint32_t frames[SB_STATS_NUM_COMMANDS];
+  // Frames with a command we do not know
+  uint32_t unknownFrames;
+  // Frames dropped by crc or broken framing
+  uint32_t invalidFrames;
+  // Of those, binary frames with a wrong crc
+  uint32_t crcErrors;
+  // Frame starts found again in the bytes of one dropped by its crc
+  uint32_t resyncs;
+  // Frames with less payload than their command requires
+  uint32_t shortReads;
+  // Time spent decoding per handle() call
+  uint32_t handleTime[SB_STATS_NUM_TIME_BUCKETS];
+  // Handshake and config commands sent again for want of a valid reply
+  uint32_t retries;
+  // Requests that got no reply in time
+  uint32_t requestTimeouts;
+  uint32_t ledFramesSent;
+  uint32_t ledFramesSuppressed;
+  uint32_t patternRestores;
+};
+#endif
+
 // CRGB Struct
 struct CRGB {
   union {
@@ -76,20 +335,112 @@ struct CRGB {
 inline __attribute__((always_inline)) bool operator== (const CRGB& lhs, const CRGB& rhs) { return (lhs.r == rhs.r) && (lhs.g == rhs.g) && (lhs.b == rhs.b); }
 inline __attribute__((always_inline)) bool operator!= (const CRGB& lhs, const CRGB& rhs) { return !(lhs == rhs); }
 
+// Byte transport of the link to the board
+class SensorBoardTransport {
+  public:
+    virtual ~SensorBoardTransport() {}
+    // Read up to n bytes without blocking, returns the number of bytes read
+    virtual size_t read(uint8_t *data, size_t n) = 0;
+    // Write a complete frame at once
+    virtual size_t write(const uint8_t *data, size_t n) = 0;
+    // Current baud rate, 0 if the link cannot change it
+    virtual unsigned long baudRate() { return 0; }
+    // Switch to another baud rate once all pending bytes went out
+    virtual bool setBaudRate(unsigned long) { return false; }
+};
+
+#if defined(ARDUINO)
+// Transport over an Arduino Stream such as HardwareSerial
+class StreamTransport : public SensorBoardTransport {
+  public:
+    StreamTransport(Stream *stream=NULL) : _stream(stream), _serial(NULL), _baud(0) {}
+    // A hardware serial opened with the given baud rate can change it at runtime
+    StreamTransport(HardwareSerial *serial, unsigned long baud) : _stream(serial), _serial(serial), _baud(baud) {}
+    void setStream(Stream *stream) { _stream = stream; _serial = NULL; _baud = 0; }
+    void setSerial(HardwareSerial *serial, unsigned long baud) { _stream = serial; _serial = serial; _baud = baud; }
+    size_t read(uint8_t *data, size_t n) {
+      int avail = _stream->available();
+      if (avail <= 0) return 0;
+      if ((size_t)avail < n) n = avail;
+      return _stream->readBytes(data, n);
+    }
+    size_t write(const uint8_t *data, size_t n) { return _stream->write(data, n); }
+    unsigned long baudRate() { return _baud; }
+    bool setBaudRate(unsigned long baud) {
+      if (_serial == NULL) return false;
+      _serial->flush();
+      #if defined(ESP32)
+      _serial->updateBaudRate(baud);
+      #else
+      _serial->begin(baud);
+      #endif
+      _baud = baud;
+      return true;
+    }
+  private:
+    Stream *_stream;
+    HardwareSerial *_serial;
+    unsigned long _baud;
+};
+#endif
+
+// Binary frames carry their length in one byte, including the sequence id of a tagged frame
+static_assert(SB_MAX_PAYLOAD+1 <= 255, "NUM_LEDS too large for a single LED frame");
+static_assert(NUM_LEDS >= 1, "NUM_LEDS must be at least 1");
+
 class SensorBoard {
   #define SENSOR_WAIT_TIME 1000
   
   public:
+    SensorBoard(
+        SensorBoardTransport * link, 
+        float tempHysteresis, float humHysteresis, int lightHysteresis, float minLEDWatt, float maxLEDWatt,
+        // void (*loadStoreFunc)(bool store, uint8_t *data, size_t size)=NULL,
+        void (*logFunc)(const char * msg, ...)=NULL
+      );
+    #if defined(ARDUINO)
+    // A plain stream keeps its baud rate, init() skips the negotiation
     SensorBoard(
         Stream * getter, 
         float tempHysteresis, float humHysteresis, int lightHysteresis, float minLEDWatt, float maxLEDWatt,
         // void (*loadStoreFunc)(bool store, uint8_t *data, size_t size)=NULL,
         void (*logFunc)(const char * msg, ...)=NULL
       );
-    bool init();
+    // A hardware serial already opened with baud, init() negotiates a faster rate
+    SensorBoard(
+        HardwareSerial * serial, unsigned long baud,
+        float tempHysteresis, float humHysteresis, int lightHysteresis, float minLEDWatt, float maxLEDWatt,
+        void (*logFunc)(const char * msg, ...)=NULL
+      );
+    #endif
+    // Start the handshake, baud rate negotiation and config sync in the background,
+    // update() runs them and readyCB tells the result. Optionally waits until done,
+    // returns true if the board is ready
+    bool init(bool wait=false);
+    bool ready() const { return _initState == InitState::READY; }
+    // Load (store=false) or store the settings of the host between runs
+    void setLoadStoreFunc(void (*loadStoreFunc)(bool store, uint8_t *data, size_t size));
+    #ifdef SB_RECORDER
+    // Append a capture of all received and sent bytes to the sink, e.g. a file,
+    // starting with the capture header. NULL stops recording.
+    // Must be set before init(), so the capture starts with the handshake, false afterwards
+    bool setRecorder(void (*recordFunc)(const uint8_t *data, size_t size));
+    #endif
+    #ifdef SB_STATS
+    // Snapshot of the link statistics
+    SensorBoardStats stats() const { return _stats; }
+    void resetStats();
+    #endif
+    // Baud rates init() tries if the link supports it, fastest first, see SB_BAUD_RATES
+    void setBaudRates(const unsigned long *rates, size_t n);
+    // Use another time source than millis(), e.g. a virtual clock in a simulation
+    void setClock(unsigned long (*clock)(void));
 
     // Update LEDs and Serial communication
     void update();
+    // Time in ms until update() has timed work to do (patterns, request timeouts),
+    // callers may sleep until then or until new data arrives
+    unsigned long nextDeadline();
     // Update sensors
     bool updateSensors(bool wait=false);
     bool updateLight(bool wait=false);
@@ -97,10 +448,50 @@ class SensorBoard {
     bool updateHum(bool wait=false);
     bool updatePIR(bool wait=false);
     void setAutoSensorMode(bool on);
-    // Handle serial connection
+    // Let the board itself only send values of NEW_TEMP, NEW_HUM, NEW_LIGHT or NEW_PIR in auto mode
+    // that moved by more than deadband, not faster than minInterval and at least every maxInterval
+    // (in ms, 0 for none). The deadband defaults to the hysteresis, false if the sensor is unknown
+    bool setSensorFilter(NEW_SENSOR_VALUE sensor, float deadband, uint16_t minInterval=0, uint32_t maxInterval=0);
+    // Recognize single, double and long presses on the host from the raw press and release
+    // of the board, timed by when the board saw them. A second press within doublePress ms
+    // after a release is a double press, holding for longPress ms a long press. Without a further
+    // edge a window resolves clockError() + SB_GESTURE_MARGIN ms after its end, stamped with its end.
+    // Has no effect if the firmware reports gestures itself (STATEFULL_PRESS)
+    void setGestures(bool on, uint16_t doublePress=SB_GESTURE_DOUBLE_PRESS, uint16_t longPress=SB_GESTURE_LONG_PRESS);
+    // Async sensor request for NEW_TEMP, NEW_HUM, NEW_LIGHT, NEW_PIR or NEW_SENSORS,
+    // returns the request id or -1 if it cannot be sent
+    int requestSensor(NEW_SENSOR_VALUE sensor, unsigned int timeout=SENSOR_WAIT_TIME);
+    // Poll the state of a request, FREE if the id is unknown
+    REQUEST_STATE requestState(int id);
+    // Handle serial connection. Returns only the last new value parsed in this call,
+    // if several arrived at once each one still runs its callback and eventCB
     enum NEW_SENSOR_VALUE handle(int timeout=-1);
+    #ifdef SB_EVENT_QUEUE
+    // Run the callbacks of all queued events, call from a single task or thread only
+    void dispatchEvents();
+    #if defined(ESP32)
+    // Run the callbacks on their own task which wakes up for each new event
+    bool startEventTask(uint32_t stackSize=4096, UBaseType_t priority=1, BaseType_t core=0);
+    #endif
+    // Events lost because the callbacks did not keep up
+    uint32_t droppedEvents() const { return _droppedEvents; }
+    #endif
+    // Host time of the event whose callback is running, when the board sampled it
+    // if the clocks are synced, otherwise when it was received
+    unsigned long eventTime() const { return _eventTime; }
+    // Board clock is mapped to host time with an error of at most clockError() ms
+    bool clockSynced() const { return _numClockSamples > 0; }
+    unsigned long clockError() const { return _clockError; }
+    // Drift of the board's clock relative to ours, e.g. 0.001 if it runs 0.1% fast
+    float clockDrift() const { return -_clockDrift; }
+    SensorBoardLatency latency() const { return _latency; }
+    void resetLatency();
 
     void setBrightness(float brightness);
+    // Colors of the power display as a gradient from minLEDWatt to maxLEDWatt,
+    // default is green to red on a linear scale with all LEDs in the same color
+    void setPowerColorMap(const CRGB *stops, size_t n, POWER_SCALE scale=POWER_SCALE::LINEAR,
+                          POWER_DISPLAY display=POWER_DISPLAY::COLOR);
     // Set new LED pattern
     void newLEDPattern(LEDPattern pattern, long duration, CRGB theFGColor, CRGB theBGColor);
     // Easy wrappers
@@ -122,25 +513,49 @@ class SensorBoard {
     float temperature;
     bool PIR;
     int light;
+    // Last button event
+    BUTTON_PRESS button;
     bool active;
     bool autoMode;
 
+    #ifdef SB_HISTORY
+    // All values received from the board, PIR as 0/1
+    SensorHistory tempHistory;
+    SensorHistory humHistory;
+    SensorHistory lightHistory;
+    SensorHistory PIRHistory;
+    #endif
+    // Negotiated protocol version
+    uint8_t protocol;
+
+    // With SB_EVENT_QUEUE the value callbacks and eventCB run from dispatchEvents()
     void (*buttonCB)(BUTTON_PRESS);
     void (*tempCB)(float);
     void (*humCB)(float);
     void (*lightCB)(uint32_t);
     void (*PIRCB)(bool);
+    // Called once init() finished or failed
+    void (*readyCB)(bool success);
+    // Called once a request is answered (success) or timed out
+    void (*requestCB)(uint8_t id, bool success);
+    // Called for every new value and handshake with eventArg, e.g. to tell boards apart
+    void (*eventCB)(void *arg, NEW_SENSOR_VALUE value);
+    void *eventArg;
     float (*activePowerGetter)(void);
 
     SensorBoardConfiguration config;
 
   private:
+    friend class SensorBoardHub;
 
     float _tempHysteresis;
     float _humHysteresis;
     int _lightHysteresis;
     // LED array
     CRGB LED[NUM_LEDS];
+    // LEDs as last sent to the board, only valid if synced
+    CRGB _sentLED[NUM_LEDS];
+    bool _ledsSynced;
     // Setting all LEDs to same color
     void allLEDs(CRGB c);
     void setAllLEDs(CRGB c);
@@ -161,12 +576,13 @@ class SensorBoard {
     #define BLINK_STEP 500
     #define ROUND_STEP 200
     #define ACTIVE_POWER_UPDATE 5000
+    // Extra time the board gets to report an expired pattern
+    #define PATTERN_EXPIRE_GRACE 1000
+    // How much earlier than its duration an expiry may arrive, older ones belong to a previous pattern
+    #define PATTERN_EXPIRE_EARLY 20
 
-    // Array holding helper functions
-    typedef void (* PatternFunction)(SensorBoard *obj);
-    PatternFunction updatePattern[(int)LEDPattern::numberOfPatterns];
-    // Array holding update times
-    unsigned int patternUpdateTimes[(int)LEDPattern::numberOfPatterns];
+    // Update time of each pattern, 0 if it is only initialized
+    static unsigned int patternUpdateTime(LEDPattern pattern);
 
     // Static LED update helper functions one for each pattern
     static void updateStaticPattern(SensorBoard *obj);
@@ -180,9 +596,35 @@ class SensorBoard {
     void fadeTowardColor(const CRGB& bgColor, uint8_t fadeAmount);
     // Updates the curretn led pattern
     void updateLEDPattern();
+    // Restore the old pattern once the current one expired
+    void expirePattern();
+    // Let the board run the current pattern, false if it cannot
+    bool startBoardPattern(long duration);
     // Converts given power to LED color
     void powerToLEDs(float power);
 
+    // Power color map and its lookup table, rebuilt if the map or config changes
+    struct PowerColor {
+      CRGB color;
+      // Position on the scale
+      uint8_t level;
+    };
+    PowerColor _powerLUT[SB_POWER_LUT_SIZE];
+    CRGB _colorStops[SB_MAX_COLOR_STOPS];
+    size_t _numColorStops;
+    POWER_SCALE _powerScale;
+    POWER_DISPLAY _powerDisplay;
+    // Color of each LED of the bar graph
+    CRGB _barColor[NUM_LEDS];
+    // Config the table was built for
+    float _lutMinWatt;
+    float _lutMaxWatt;
+    float _lutScale;
+    bool _lutValid;
+    void buildPowerLUT();
+    // Color at a position between 0 and 1 of the color map
+    CRGB gradient(float position);
+
     // Saves old pattern
     void saveOldPattern();
     // Restores old pattern
@@ -204,11 +646,213 @@ class SensorBoard {
 
     bool fadeUpdate;
     bool preSet;
+    // Current pattern is animated by the board itself
+    bool _patternOnBoard;
     long patternTimer;
 
+    // Receive ring buffer, filled in bulk from the stream
+    uint8_t _rxBuf[SB_RX_BUFFER_SIZE];
+    uint16_t _rxHead;
+    uint16_t _rxTail;
+    // Resumable frame parser state
+    enum class ParseState {START, CMD, PAYLOAD, END, BIN_LEN, BIN_CMD, BIN_CRC};
+    ParseState _parseState;
+    bool _frameBinary;
+    uint8_t _frameCrc;
+    char _frameCmd;
+    // Payload length of the frame, up to SB_MAX_PAYLOAD, -1 for unknown commands
+    int16_t _frameExpected;
+    uint8_t _frameLen;
+    uint8_t _frame[SB_MAX_PAYLOAD];
+
+    // Read available bytes into the ring buffer, true if there may be more
+    bool readIncoming();
+    // Parse everything received so far, returns the last new value (see handle())
+    enum NEW_SENSOR_VALUE parseIncoming();
+    // Feed a single byte into the frame parser
+    enum NEW_SENSOR_VALUE parseByte(uint8_t c);
+    // Strip the sequence id of a complete frame and act on it
+    enum NEW_SENSOR_VALUE dispatchFrame(char cmd, const uint8_t *data, uint8_t len);
+    // Act on a complete frame
+    enum NEW_SENSOR_VALUE handleFrame(char cmd, const uint8_t *data, uint8_t len);
+    // Requests in flight
+    struct Request {
+      uint8_t id;
+      char cmd;
+      REQUEST_STATE state;
+      unsigned long sent;
+      unsigned int timeout;
+    };
+    Request _requests[SB_MAX_REQUESTS];
+    uint8_t _nextRequestId;
+    // Mark the request answered by a frame, id is -1 for untagged frames
+    void completeRequest(char cmd, int id);
+    // Fail requests that timed out
+    void checkRequests();
+
+    // Absolute time of the next timed work, update() skips the timers before that
+    unsigned long _deadline;
+    bool _deadlineValid;
+    // Told when the timers changed, e.g. a SensorBoardHub that orders its boards by deadline
+    void (*_deadlineCB)(void *arg);
+    void *_deadlineArg;
+    // Timers changed, check them on the next update()
+    inline void invalidateDeadline() {
+      _deadlineValid = false;
+      if (_deadlineCB) _deadlineCB(_deadlineArg);
+    }
+    // Earliest time of all pattern and request timers
+    void computeDeadline();
+    // Absolute time of the next timed work
+    unsigned long deadline();
+    // Send a query and optionally block until it is answered
+    bool query(NEW_SENSOR_VALUE sensor, bool wait);
+
+    // Filters of temperature, humidity, light and PIR in the host's units
+    SensorBoardFilter _filters[4];
+    // Filter in the board's units
+    SensorBoardFilter rawFilter(int i);
+    void sendSensorFilter(NEW_SENSOR_VALUE sensor);
+
+    // Clock sync: host time = board time + offset + drift * (board time - ref)
+    struct ClockSample {
+      unsigned long board;
+      long offset;
+      unsigned long rtt;
+    };
+    ClockSample _clockSamples[SB_CLOCK_SAMPLES];
+    uint8_t _numClockSamples;
+    uint8_t _nextClockSample;
+    long _clockOffset;
+    float _clockDrift;
+    unsigned long _clockRef;
+    unsigned long _clockError;
+    unsigned long _pingSent;
+    bool _pingPending;
+    // Host time of the frame being handled
+    unsigned long _frameTime;
+    SensorBoardLatency _latency;
+    void resetClock();
+    // Add the board time of a ping reply and refit offset and drift
+    void clockSample(unsigned long board, unsigned long sent, unsigned long received);
+    // Full board time of a 16 bit stamp, in host time
+    unsigned long stampToHost(uint16_t stamp);
+    unsigned long nextPing();
+
+    // Background init: handshake, finding and negotiating the baud rate, config sync
+    enum class InitState {IDLE, HANDSHAKE, SCAN, BAUD_REQUEST, BAUD_ECHO, BAUD_COMMIT, BAUD_FALLBACK,
+                          CONFIG_QUERY, CONFIG_PUSH, READY, FAILED};
+    InitState _initState;
+    unsigned long _initTimer;
+    uint8_t _initTries;
+    // Index of the baud rate tried, the last one stands for the rate before init()
+    int _baudIndex;
+    // Rate before init(), of the first handshake and the one the link works with
+    unsigned long _baseBaud;
+    unsigned long _firstBaud;
+    unsigned long _linkBaud;
+    // Time the board switched to the rate on trial
+    unsigned long _baudSwitched;
+    const unsigned long *_baudRates;
+    size_t _numBaudRates;
+    // Last reply during init ('!', 'B', 'e', 'C' or 'c'), 0 while waiting
+    char _initReply;
+    unsigned long _baudAck;
+    // Crc of the board's config, -1 if it has another version
+    int16_t _boardConfigCrc;
+    // Settings changed since the last sync with the board
+    bool _configDirty;
+    unsigned long _configChanged;
+    // Config pushed at runtime, ready() stays true meanwhile
+    bool _configSync;
+    unsigned long _configTimer;
+    uint8_t _configTries;
+    // Advance the background init
+    void updateInit();
+    // Enter a step of the init and send what it needs
+    void initStep(InitState state);
+    unsigned int initTimeout();
+    // Advance to the next baud rate to scan or negotiate, 0 if none is left
+    unsigned long nextBaudRate(bool scan);
+    // Try the next faster baud rate or go on with the config once done
+    void negotiateNext(bool done);
+    void configDone();
+    void initDone(bool success);
+    // Send the config to the board at runtime and wait for its crc
+    void pushConfig();
+    void updateConfigSync();
+    // Config blob for the board, returns its crc
+    uint8_t boardConfig(uint8_t *blob);
+    void configChanged();
+    // Settings of the host kept between runs
+    void (*_loadStoreFunc)(bool store, uint8_t *data, size_t size);
+    #ifdef SB_RECORDER
+    void (*_recordFunc)(const uint8_t *data, size_t size);
+    unsigned long _recordTime;
+    void record(uint8_t type, const uint8_t *data, size_t n);
+    // Time of the records in us, on the clock of setClock()
+    unsigned long recordMicros();
+    #endif
+    // Crc of the cache as last loaded or stored, -1 if none
+    int16_t _cacheCrc;
+    // Returns the cached baud rate, 0 if there is none
+    unsigned long loadCache();
+    void storeCache();
+
+    // Apply new sensor values with hysteresis and call the callbacks
+    enum NEW_SENSOR_VALUE newTemperature(float temp);
+    enum NEW_SENSOR_VALUE newHumidity(float hum);
+    enum NEW_SENSOR_VALUE newLight(int32_t lux);
+    enum NEW_SENSOR_VALUE newPIR(bool pir);
+    // Run the callbacks of an event now or queue it
+    void emitEvent(SensorBoardEvent &event);
+    void deliverEvent(const SensorBoardEvent &event);
+    // Same for an event that happened at another time than the current frame
+    void emitEvent(SensorBoardEvent &event, unsigned long time);
+
+    // Gesture engine fed by the raw button edges
+    enum class GestureState {OFF, IDLE, PRESSED, RELEASED, DOUBLE, LONG};
+    GestureState _gestureState;
+    uint16_t _doublePress;
+    uint16_t _longPress;
+    // Time of the last edge
+    unsigned long _gestureTime;
+    void buttonEdge(bool pressed, unsigned long time);
+    // Resolve the double and long press windows that passed until time by more than margin
+    void updateGestures(unsigned long time, unsigned long margin=0);
+    // Margin for windows resolved by the host's clock, an edge before their end may still be on the way
+    unsigned long gestureMargin() const;
+    void emitButton(BUTTON_PRESS press, unsigned long time);
+    unsigned long _eventTime;
+    #ifdef SB_EVENT_QUEUE
+    SensorBoardEventQueue _eventQueue;
+    volatile uint32_t _droppedEvents;
+    #if defined(ESP32)
+    TaskHandle_t _eventTask;
+    static void eventTask(void *arg);
+    #endif
+    #endif
+    // A binary frame failed its crc, rescan its bytes including the crc for a frame start
+    enum NEW_SENSOR_VALUE resyncFrame(uint8_t crc);
+    // Send a command like "?l" or "!L" in the negotiated framing
+    void sendCommand(const char *cmd, const uint8_t *data=NULL, uint8_t len=0, int id=-1);
+
     template < typename TOut >
-    TOut parse();
-    Stream * _getter;
+    TOut parse(const uint8_t *data);
+    SensorBoardTransport * _link;
+    #if defined(ARDUINO)
+    StreamTransport _streamLink;
+    #endif
+
+    #ifdef SB_STATS
+    SensorBoardStats _stats;
+    // Parsing the bytes of a frame dropped by its crc, see resyncs
+    bool _resyncing;
+    #endif
+
+    // Time source in ms
+    unsigned long (*_clock)(void);
+    inline unsigned long now() { return _clock(); }
 
     void (*_logFunc)(const char * msg, ...);
 };
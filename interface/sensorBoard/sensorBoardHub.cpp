@@ -0,0 +1,211 @@
+/***************************************************
+ Hub driving many SensorBoards from one event loop
+
+ Feel free to use the code as it is.
+
+ Benjamin Voelker, voelkerb@me.com
+ Embedded Systems
+ University of Freiburg, Institute of Computer Science
+ ****************************************************/
+
+#include "sensorBoardHub.h"
+
+#ifdef SB_HUB_EPOLL
+#include <sys/epoll.h>
+#include <unistd.h>
+#endif
+
+SensorBoardHub::SensorBoardHub() {
+  _numBoards = 0;
+  _numDirty = 0;
+  _numPolled = 0;
+  eventCB = NULL;
+  #ifdef SB_HUB_EPOLL
+  _epoll = epoll_create1(0);
+  #endif
+}
+
+SensorBoardHub::~SensorBoardHub() {
+  // Hand the boards back as they were
+  for (size_t i = 0; i < _numBoards; i++) {
+    _boards[i].board->eventCB = _boards[i].eventCB;
+    _boards[i].board->eventArg = _boards[i].eventArg;
+    _boards[i].board->_deadlineCB = NULL;
+    _boards[i].board->_deadlineArg = NULL;
+  }
+  #ifdef SB_HUB_EPOLL
+  if (_epoll >= 0) close(_epoll);
+  #endif
+}
+
+int SensorBoardHub::addBoard(SensorBoard *board, int fd) {
+  if (board == NULL || _numBoards >= SB_HUB_MAX_BOARDS) return -1;
+  // Already part of a hub
+  if (board->_deadlineCB != NULL) return -1;
+  Slot *slot = &_boards[_numBoards];
+  slot->board = board;
+  slot->fd = -1;
+  slot->index = _numBoards;
+  slot->hub = this;
+  slot->dirty = false;
+  #ifdef SB_HUB_EPOLL
+  if (fd >= 0 && _epoll >= 0) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u32 = slot->index;
+    if (epoll_ctl(_epoll, EPOLL_CTL_ADD, fd, &ev) == 0) slot->fd = fd;
+  }
+  #endif
+  if (slot->fd < 0) _numPolled++;
+  slot->eventCB = board->eventCB;
+  slot->eventArg = board->eventArg;
+  board->eventArg = slot;
+  board->eventCB = &onEvent;
+  board->_deadlineArg = slot;
+  board->_deadlineCB = &onDeadline;
+  slot->deadline = board->deadline();
+  slot->heapPos = _numBoards;
+  _heap[_numBoards] = slot->index;
+  siftUp(_numBoards);
+  return _numBoards++;
+}
+
+void SensorBoardHub::onEvent(void *arg, NEW_SENSOR_VALUE value) {
+  Slot *slot = (Slot *)arg;
+  if (slot->eventCB) slot->eventCB(slot->eventArg, value);
+  if (slot->hub->eventCB) slot->hub->eventCB(slot->index, value);
+}
+
+void SensorBoardHub::onDeadline(void *arg) {
+  Slot *slot = (Slot *)arg;
+  if (slot->dirty) return;
+  slot->dirty = true;
+  slot->hub->_dirty[slot->hub->_numDirty++] = slot->index;
+}
+
+bool SensorBoardHub::earlier(size_t a, size_t b) const {
+  return (long)(_boards[_heap[a]].deadline - _boards[_heap[b]].deadline) < 0;
+}
+
+void SensorBoardHub::swap(size_t a, size_t b) {
+  size_t index = _heap[a];
+  _heap[a] = _heap[b];
+  _heap[b] = index;
+  _boards[_heap[a]].heapPos = a;
+  _boards[_heap[b]].heapPos = b;
+}
+
+void SensorBoardHub::siftUp(size_t pos) {
+  while (pos > 0 && earlier(pos, (pos-1)/2)) {
+    swap(pos, (pos-1)/2);
+    pos = (pos-1)/2;
+  }
+}
+
+void SensorBoardHub::siftDown(size_t pos) {
+  while (true) {
+    size_t first = pos;
+    size_t left = 2*pos+1;
+    if (left < _numBoards && earlier(left, first)) first = left;
+    if (left+1 < _numBoards && earlier(left+1, first)) first = left+1;
+    if (first == pos) return;
+    swap(pos, first);
+    pos = first;
+  }
+}
+
+void SensorBoardHub::reorder() {
+  for (size_t i = 0; i < _numDirty; i++) {
+    Slot *slot = &_boards[_dirty[i]];
+    if (!slot->dirty) continue;
+    slot->dirty = false;
+    slot->deadline = slot->board->deadline();
+    siftUp(slot->heapPos);
+    siftDown(slot->heapPos);
+  }
+  _numDirty = 0;
+}
+
+void SensorBoardHub::updateBoard(size_t index) {
+  Slot *slot = &_boards[index];
+  slot->board->update();
+  // update() recomputes the timers without always telling us
+  onDeadline(slot);
+}
+
+unsigned long SensorBoardHub::nextDeadline() {
+  reorder();
+  if (_numBoards == 0) return SB_NO_DEADLINE;
+  return _boards[_heap[0]].board->nextDeadline();
+}
+
+void SensorBoardHub::update(int timeout) {
+  #ifdef SB_HUB_EPOLL
+  if (_epoll >= 0) {
+    // Sleep until data arrives or the first timer is due
+    unsigned long deadline = nextDeadline();
+    int wait = timeout;
+    if (_numPolled > 0 && (wait < 0 || wait > SB_HUB_POLL_INTERVAL)) wait = SB_HUB_POLL_INTERVAL;
+    if (deadline != SB_NO_DEADLINE && (wait < 0 || deadline < (unsigned long)wait)) wait = (int)deadline;
+    struct epoll_event events[SB_HUB_MAX_BOARDS];
+    int n = epoll_wait(_epoll, events, SB_HUB_MAX_BOARDS, wait);
+    for (int i = 0; i < n; i++) {
+      uint32_t index = events[i].data.u32;
+      if (index < _numBoards) updateBoard(index);
+    }
+    // Boards without a descriptor
+    if (_numPolled > 0) {
+      for (size_t i = 0; i < _numBoards; i++) {
+        if (_boards[i].fd < 0) updateBoard(i);
+      }
+    }
+    // Due timers, only the top of the heap is visited
+    reorder();
+    if (_numBoards == 0) return;
+    unsigned long t = _boards[_heap[0]].board->now();
+    size_t due[SB_HUB_MAX_BOARDS];
+    size_t numDue = 0;
+    size_t stack[SB_HUB_MAX_BOARDS+1];
+    size_t top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+      size_t pos = stack[--top];
+      if (pos >= _numBoards || (long)(_boards[_heap[pos]].deadline - t) > 0) continue;
+      due[numDue++] = _heap[pos];
+      stack[top++] = 2*pos+1;
+      stack[top++] = 2*pos+2;
+    }
+    for (size_t i = 0; i < numDue; i++) updateBoard(due[i]);
+    return;
+  }
+  #endif
+  for (size_t i = 0; i < _numBoards; i++) updateBoard(i);
+}
+
+void SensorBoardHub::setAutoSensorMode(bool on) {
+  for (size_t i = 0; i < _numBoards; i++) _boards[i].board->setAutoSensorMode(on);
+}
+
+void SensorBoardHub::setBrightness(float brightness) {
+  for (size_t i = 0; i < _numBoards; i++) _boards[i].board->setBrightness(brightness);
+}
+
+void SensorBoardHub::newLEDPattern(LEDPattern pattern, long duration, CRGB theFGColor, CRGB theBGColor) {
+  for (size_t i = 0; i < _numBoards; i++) _boards[i].board->newLEDPattern(pattern, duration, theFGColor, theBGColor);
+}
+
+void SensorBoardHub::setColor(CRGB color, long duration, bool fade) {
+  for (size_t i = 0; i < _numBoards; i++) _boards[i].board->setColor(color, duration, fade);
+}
+
+void SensorBoardHub::glow(CRGB color, CRGB bgColor, long duration) {
+  for (size_t i = 0; i < _numBoards; i++) _boards[i].board->glow(color, bgColor, duration);
+}
+
+void SensorBoardHub::blink(CRGB color, CRGB bgColor, long duration) {
+  for (size_t i = 0; i < _numBoards; i++) _boards[i].board->blink(color, bgColor, duration);
+}
+
+void SensorBoardHub::displayPowerColor(long duration) {
+  for (size_t i = 0; i < _numBoards; i++) _boards[i].board->displayPowerColor(duration);
+}
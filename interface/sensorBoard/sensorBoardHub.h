@@ -0,0 +1,104 @@
+/***************************************************
+ Hub driving many SensorBoards from one event loop
+
+ On Linux, boards with a file descriptor are multiplexed
+ with epoll, so only boards with new data or due timers
+ are touched per loop. The boards are kept in a min-heap by
+ their next deadline, the boards of a hub share a clock.
+ Elsewhere all boards are polled.
+
+ Feel free to use the code as it is.
+
+ Benjamin Voelker, voelkerb@me.com
+ Embedded Systems
+ University of Freiburg, Institute of Computer Science
+ ****************************************************/
+
+#ifndef SENSORBOARDHUB_h
+#define SENSORBOARDHUB_h
+
+#include "sensorBoard.h"
+
+#if defined(__linux__)
+#define SB_HUB_EPOLL
+#endif
+
+#ifndef SB_HUB_MAX_BOARDS
+#define SB_HUB_MAX_BOARDS 64
+#endif
+
+// Max time in ms update() waits if boards without a file descriptor need polling
+#ifndef SB_HUB_POLL_INTERVAL
+#define SB_HUB_POLL_INTERVAL 5
+#endif
+
+class SensorBoardHub {
+  public:
+    SensorBoardHub();
+    ~SensorBoardHub();
+
+    // Add a board, fd is the file descriptor of its transport or -1 to poll it,
+    // returns the index of the board or -1 if the hub is full. The board's own
+    // eventCB keeps being called before the hub's. Only the hub may update() it
+    int addBoard(SensorBoard *board, int fd=-1);
+    size_t size() const { return _numBoards; }
+    SensorBoard * board(size_t index) { return index < _numBoards ? _boards[index].board : NULL; }
+
+    // Wait up to timeout ms for new data or timers and update the boards concerned,
+    // a negative timeout waits as long as no timer is due
+    void update(int timeout=-1);
+    // Time in ms until any board has timed work to do
+    unsigned long nextDeadline();
+
+    // Broadcasts to all boards
+    void setAutoSensorMode(bool on);
+    void setBrightness(float brightness);
+    void newLEDPattern(LEDPattern pattern, long duration, CRGB theFGColor, CRGB theBGColor);
+    void setColor(CRGB color, long duration=-1, bool fade=false);
+    void glow(CRGB color, CRGB bgColor=COLOR_BLACK, long duration=-1);
+    void blink(CRGB color, CRGB bgColor=COLOR_BLACK, long duration=-1);
+    void displayPowerColor(long duration=-1);
+
+    // Called for every new value of any board with the board's index
+    void (*eventCB)(size_t index, NEW_SENSOR_VALUE value);
+
+  private:
+    struct Slot {
+      SensorBoard *board;
+      int fd;
+      size_t index;
+      SensorBoardHub *hub;
+      // The board's eventCB before it was added
+      void (*eventCB)(void *arg, NEW_SENSOR_VALUE value);
+      void *eventArg;
+      // Deadline the slot is ordered by in the heap and its position there
+      unsigned long deadline;
+      size_t heapPos;
+      // Timers changed since the slot was ordered
+      bool dirty;
+    };
+    Slot _boards[SB_HUB_MAX_BOARDS];
+    size_t _numBoards;
+    // Min-heap of board indices by deadline
+    size_t _heap[SB_HUB_MAX_BOARDS];
+    // Boards whose timers changed
+    size_t _dirty[SB_HUB_MAX_BOARDS];
+    size_t _numDirty;
+    size_t _numPolled;
+
+    #ifdef SB_HUB_EPOLL
+    int _epoll;
+    #endif
+
+    static void onEvent(void *arg, NEW_SENSOR_VALUE value);
+    static void onDeadline(void *arg);
+    // Order the boards whose timers changed again
+    void reorder();
+    void updateBoard(size_t index);
+    bool earlier(size_t a, size_t b) const;
+    void swap(size_t a, size_t b);
+    void siftUp(size_t pos);
+    void siftDown(size_t pos);
+};
+
+#endif
@@ -0,0 +1,169 @@
+/***************************************************
+ Replay of recorded SensorBoard traffic
+
+ Feel free to use the code as it is.
+
+ Benjamin Voelker, voelkerb@me.com
+ Embedded Systems
+ University of Freiburg, Institute of Computer Science
+ ****************************************************/
+
+#include "sensorBoardReplay.h"
+
+#ifdef SB_REPLAY
+
+#include <stdio.h>
+#include <unistd.h>
+
+SensorBoardReplay *SensorBoardReplay::_active = NULL;
+
+// Unsigned LEB128 varint as written by the recorder, false if it is cut off
+static bool readVarint(const uint8_t *data, size_t size, size_t &pos, uint64_t &value) {
+  value = 0;
+  for (int i = 0; i < 10 && pos < size; i++) {
+    uint8_t byte = data[pos++];
+    value |= (uint64_t)(byte & 0x7F) << (7*i);
+    if (!(byte & 0x80)) return true;
+  }
+  return false;
+}
+
+SensorBoardReplay::SensorBoardReplay() {
+  _data = NULL;
+  _size = 0;
+  _speed = 0;
+  close();
+}
+
+SensorBoardReplay::~SensorBoardReplay() {
+  close();
+}
+
+bool SensorBoardReplay::open(const char *path) {
+  close();
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) return false;
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  if (size > 0) _data = (uint8_t *)malloc(size);
+  if (_data == NULL || fread(_data, 1, size, file) != (size_t)size) {
+    fclose(file);
+    close();
+    return false;
+  }
+  fclose(file);
+  _size = size;
+  // Magic, version, protocol, baud rate and start time
+  size_t header = sizeof(SB_CAPTURE_MAGIC)+1;
+  uint64_t baud, start;
+  if (_size < header || memcmp(_data, SB_CAPTURE_MAGIC, header-2) != 0 || _data[header-2] != SB_CAPTURE_VERSION
+      || !readVarint(_data, _size, header, baud) || !readVarint(_data, _size, header, start)) {
+    close();
+    return false;
+  }
+  _protocol = _data[sizeof(SB_CAPTURE_MAGIC)];
+  _baud = (unsigned long)baud;
+  _start = (unsigned long)start;
+  startCursor(_rx, SB_CAPTURE_RX, header);
+  startCursor(_tx, SB_CAPTURE_TX, header);
+  _active = this;
+  return true;
+}
+
+void SensorBoardReplay::close() {
+  if (_active == this) _active = NULL;
+  free(_data);
+  _data = NULL;
+  _size = 0;
+  _rx.valid = false;
+  _tx.valid = false;
+  _now = 0;
+  _protocol = 0;
+  _baud = 0;
+  _start = 0;
+  _txMismatches = 0;
+  _rxBytes = 0;
+}
+
+unsigned long SensorBoardReplay::clock() {
+  return _active ? _active->_start + (unsigned long)(_active->_now/1000) : 0;
+}
+
+void SensorBoardReplay::startCursor(Cursor &cursor, uint8_t type, size_t start) {
+  cursor.type = type;
+  cursor.next = start;
+  cursor.time = 0;
+  cursor.valid = nextRecord(cursor);
+}
+
+bool SensorBoardReplay::nextRecord(Cursor &cursor) {
+  while (cursor.next < _size) {
+    uint8_t type = _data[cursor.next++];
+    uint64_t delta, len;
+    if (!readVarint(_data, _size, cursor.next, delta) || !readVarint(_data, _size, cursor.next, len)) break;
+    // A record cut off at the end of a capture still counts up to there
+    if (len > _size - cursor.next) len = _size - cursor.next;
+    cursor.time += delta;
+    cursor.pos = cursor.next;
+    cursor.len = len;
+    cursor.read = 0;
+    cursor.next += len;
+    if (type == cursor.type && len > 0) return true;
+  }
+  cursor.next = _size;
+  return false;
+}
+
+bool SensorBoardReplay::step(unsigned long maxStep) {
+  if (!_rx.valid) return false;
+  // Always make progress, work that was due ran in the last update()
+  if (maxStep == 0) maxStep = 1;
+  uint64_t target = _rx.time;
+  if (target <= _now) {
+    if (!rxHeldBack()) return true;
+    // The host did not write what the board answered, go on after a while
+    target = _now + 1000;
+  }
+  if (maxStep != SB_NO_DEADLINE && _now + maxStep*1000ULL < target) target = _now + maxStep*1000ULL;
+  if (_speed > 0) usleep((useconds_t)((target - _now)/_speed));
+  _now = target;
+  return true;
+}
+
+bool SensorBoardReplay::rxHeldBack() {
+  if (!_tx.valid || _rx.time < _now) return false;
+  // The next recorded byte the host has not written yet comes first
+  return _tx.pos + _tx.read < _rx.pos;
+}
+
+size_t SensorBoardReplay::read(uint8_t *data, size_t n) {
+  size_t got = 0;
+  while (got < n && _rx.valid && _rx.time <= _now && !rxHeldBack()) {
+    size_t chunk = _rx.len - _rx.read;
+    if (chunk > n - got) chunk = n - got;
+    memcpy(&data[got], &_data[_rx.pos + _rx.read], chunk);
+    got += chunk;
+    _rx.read += chunk;
+    if (_rx.read == _rx.len) _rx.valid = nextRecord(_rx);
+  }
+  _rxBytes += got;
+  return got;
+}
+
+bool SensorBoardReplay::nextTx(uint8_t &byte) {
+  if (!_tx.valid) return false;
+  byte = _data[_tx.pos + _tx.read++];
+  if (_tx.read == _tx.len) _tx.valid = nextRecord(_tx);
+  return true;
+}
+
+size_t SensorBoardReplay::write(const uint8_t *data, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    uint8_t recorded;
+    if (!nextTx(recorded) || recorded != data[i]) _txMismatches++;
+  }
+  return n;
+}
+
+#endif
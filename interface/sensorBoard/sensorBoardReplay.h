@@ -0,0 +1,106 @@
+/***************************************************
+ Replay of recorded SensorBoard traffic
+
+ Feeds a capture written through SensorBoard::setRecorder()
+ (SB_RECORDER) back into a SensorBoard as its transport and
+ drives a virtual clock, so field captures run offline as
+ fast as possible or at a chosen speed:
+
+   SensorBoardReplay replay;
+   replay.open("board.sbc");
+   SensorBoard board(&replay, ...);
+   board.setClock(&SensorBoardReplay::clock);
+   board.init();
+   while (replay.step(board.nextDeadline())) board.update();
+
+ init() must not wait, the clock only moves with step().
+ Clock and link start where the capture did. Bytes the
+ host writes are compared with the recorded ones, a host with
+ another protocol() than the recording one writes others.
+ test/replaySensorBoard.cpp runs captures as a benchmark.
+
+ Feel free to use the code as it is.
+
+ Benjamin Voelker, voelkerb@me.com
+ Embedded Systems
+ University of Freiburg, Institute of Computer Science
+ ****************************************************/
+
+#ifndef SENSORBOARDREPLAY_h
+#define SENSORBOARDREPLAY_h
+
+#include "sensorBoard.h"
+
+#if !defined(ARDUINO)
+#define SB_REPLAY
+
+class SensorBoardReplay : public SensorBoardTransport {
+  public:
+    SensorBoardReplay();
+    ~SensorBoardReplay();
+
+    // Load a capture, false if it cannot be read or has another version
+    bool open(const char *path);
+    // Protocol version of the host that recorded the capture, SB_PROTOCOL_VERSION
+    uint8_t protocol() const { return _protocol; }
+    void close();
+    // Virtual time in ms, from the host's time at the start of the capture, pass to SensorBoard::setClock()
+    static unsigned long clock();
+    // Advance the virtual clock to the next received bytes, but at most by maxStep ms,
+    // e.g. nextDeadline() of the board. False once the capture is done
+    bool step(unsigned long maxStep=SB_NO_DEADLINE);
+    // Real time factor of step(), 0 replays as fast as possible
+    void setSpeed(float speed) { _speed = speed; }
+    bool done() const { return !_rx.valid; }
+
+    // Bytes written by the host that differ from or go beyond the recorded ones
+    size_t txMismatches() const { return _txMismatches; }
+    size_t rxBytes() const { return _rxBytes; }
+
+    size_t read(uint8_t *data, size_t n);
+    size_t write(const uint8_t *data, size_t n);
+    // Rate of the capture's link, bytes are replayed as recorded whatever the host negotiates
+    unsigned long baudRate() { return _baud; }
+    bool setBaudRate(unsigned long baud) { _baud = baud; return true; }
+
+  private:
+    // Walks the records of one type, the bytes of the current one may be partly consumed
+    struct Cursor {
+      uint8_t type;
+      bool valid;
+      // Offset of the next record header
+      size_t next;
+      // Capture time in us, offset and length of the current record's bytes
+      uint64_t time;
+      size_t pos;
+      size_t len;
+      size_t read;
+    };
+    uint8_t *_data;
+    size_t _size;
+    Cursor _rx;
+    // Recorded bytes to compare the writes of the host with
+    Cursor _tx;
+    // Virtual time in us since the start and the host's time then in ms
+    uint64_t _now;
+    unsigned long _start;
+    float _speed;
+    uint8_t _protocol;
+    unsigned long _baud;
+    size_t _txMismatches;
+    size_t _rxBytes;
+    // Only one replay drives the static clock
+    static SensorBoardReplay *_active;
+    void startCursor(Cursor &cursor, uint8_t type, size_t start);
+    // Move on to the next record of the cursor's type, false at the end of the capture
+    bool nextRecord(Cursor &cursor);
+    // Next recorded byte to compare with, false after the last one
+    bool nextTx(uint8_t &byte);
+    // Received bytes recorded after a write of the host come after that write,
+    // unless the clock moved on without it
+    bool rxHeldBack();
+};
+
+#endif
+
+#endif
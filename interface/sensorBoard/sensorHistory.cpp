@@ -0,0 +1,121 @@
+/***************************************************
+ Fixed memory sensor history for the SensorBoard
+
+ Feel free to use the code as it is.
+
+ Benjamin Voelker, voelkerb@me.com
+ Embedded Systems
+ University of Freiburg, Institute of Computer Science
+ ****************************************************/
+
+#include "sensorHistory.h"
+
+SensorHistory::SensorHistory() {
+  clear();
+}
+
+void SensorHistory::clear() {
+  _rawCount = 0;
+  _rawHead = 0;
+  _minuteCount = 0;
+  _minuteHead = 0;
+  _minute.count = 0;
+  _hourCount = 0;
+  _hourHead = 0;
+  _hour.count = 0;
+}
+
+void SensorHistory::add(unsigned long time, float value) {
+  if (isnan(value)) return;
+  _raw[_rawHead] = HistorySample{time, value};
+  _rawHead = (_rawHead + 1) % SB_HISTORY_RAW;
+  if (_rawCount < SB_HISTORY_RAW) _rawCount++;
+  accumulate(_minute, _minutes, SB_HISTORY_MINUTES, _minuteHead, _minuteCount, SB_HISTORY_MINUTE_MS, time, value);
+  accumulate(_hour, _hours, SB_HISTORY_HOURS, _hourHead, _hourCount, SB_HISTORY_HOUR_MS, time, value);
+}
+
+void SensorHistory::accumulate(HistoryRollup &current, HistoryRollup *ring, size_t size, size_t &head, size_t &count,
+                               unsigned long period, unsigned long time, float value) {
+  unsigned long start = time - time % period;
+  if (current.count > 0) {
+    // Step from the current period, the grid stays the same across a wrap of the clock
+    unsigned long passed = time - current.start;
+    // Samples stamped slightly before the current period stay in it
+    if ((long)passed < 0 || passed < period) {
+      start = current.start;
+    } else {
+      start = current.start + (passed - passed % period);
+      // Period is over, store it and start a new one
+      ring[head] = current;
+      head = (head + 1) % size;
+      if (count < size) count++;
+      current.count = 0;
+    }
+  }
+  if (current.count == 0) {
+    current.start = start;
+    current.min = value;
+    current.max = value;
+    current.sum = 0;
+  }
+  if (value < current.min) current.min = value;
+  if (value > current.max) current.max = value;
+  current.sum += value;
+  current.count++;
+}
+
+void SensorHistory::merge(HistoryRollup &result, const HistoryRollup &bucket) {
+  if (bucket.count == 0) return;
+  if (result.count == 0) {
+    result = bucket;
+    return;
+  }
+  if ((long)(bucket.start - result.start) < 0) result.start = bucket.start;
+  if (bucket.min < result.min) result.min = bucket.min;
+  if (bucket.max > result.max) result.max = bucket.max;
+  result.sum += bucket.sum;
+  result.count += bucket.count;
+}
+
+bool SensorHistory::overlaps(const HistoryRollup &bucket, unsigned long period, unsigned long from, unsigned long to) {
+  // Differences of the times, millis() may have wrapped in between
+  return bucket.count > 0 && (long)(to - bucket.start) >= 0 && (long)(bucket.start + period - from) > 0;
+}
+
+bool SensorHistory::range(unsigned long from, unsigned long to, HistoryRollup &result) const {
+  result.count = 0;
+  // Minute rollups cover the recent past, hours only what is older
+  unsigned long minuteStart = _minute.start;
+  if (_minuteCount > 0) {
+    minuteStart = _minutes[(_minuteHead + SB_HISTORY_MINUTES - _minuteCount) % SB_HISTORY_MINUTES].start;
+  }
+  bool anyMinute = _minuteCount > 0 || _minute.count > 0;
+  // End of the hour rollups taken, the minutes before it are part of them
+  bool anyHour = false;
+  unsigned long hourEnd = 0;
+  for (size_t i = 0; i <= _hourCount; i++) {
+    const HistoryRollup &bucket = i < _hourCount ? _hours[(_hourHead + SB_HISTORY_HOURS - 1 - i) % SB_HISTORY_HOURS] : _hour;
+    // Only for the part of the range before the minutes
+    if (anyMinute && ((long)(bucket.start - minuteStart) >= 0 || (long)(from - minuteStart) >= 0)) continue;
+    if (!overlaps(bucket, SB_HISTORY_HOUR_MS, from, to)) continue;
+    merge(result, bucket);
+    if (!anyHour || (long)(bucket.start + SB_HISTORY_HOUR_MS - hourEnd) > 0) hourEnd = bucket.start + SB_HISTORY_HOUR_MS;
+    anyHour = true;
+  }
+  for (size_t i = 0; i <= _minuteCount; i++) {
+    const HistoryRollup &bucket = i < _minuteCount ? _minutes[(_minuteHead + SB_HISTORY_MINUTES - 1 - i) % SB_HISTORY_MINUTES] : _minute;
+    // Already part of an hour rollup
+    if (anyHour && (long)(bucket.start - hourEnd) < 0) continue;
+    if (!overlaps(bucket, SB_HISTORY_MINUTE_MS, from, to)) continue;
+    merge(result, bucket);
+  }
+  return result.count > 0;
+}
+
+size_t SensorHistory::latest(HistorySample *samples, size_t n) const {
+  if (n > _rawCount) n = _rawCount;
+  for (size_t i = 0; i < n; i++) {
+    samples[i] = _raw[(_rawHead + SB_HISTORY_RAW - n + i) % SB_HISTORY_RAW];
+  }
+  return n;
+}
@@ -0,0 +1,95 @@
+/***************************************************
+ Fixed memory sensor history for the SensorBoard
+
+ Keeps the latest raw samples in a ring and min/max/mean
+ rollups per minute and per hour. Memory is fixed at
+ compile time by the SB_HISTORY_* defines.
+
+ Feel free to use the code as it is.
+
+ Benjamin Voelker, voelkerb@me.com
+ Embedded Systems
+ University of Freiburg, Institute of Computer Science
+ ****************************************************/
+
+#ifndef SENSORHISTORY_h
+#define SENSORHISTORY_h
+
+#if defined(ARDUINO)
+#if (ARDUINO >= 100)
+#include "Arduino.h"
+#else
+#include "WProgram.h"
+#endif
+#else
+#include <stdint.h>
+#include <stddef.h>
+#include <math.h>
+#endif
+
+// Number of raw samples, minute and hour rollups kept per sensor
+#ifndef SB_HISTORY_RAW
+#define SB_HISTORY_RAW 32
+#endif
+#ifndef SB_HISTORY_MINUTES
+#define SB_HISTORY_MINUTES 60
+#endif
+#ifndef SB_HISTORY_HOURS
+#define SB_HISTORY_HOURS 24
+#endif
+
+#define SB_HISTORY_MINUTE_MS 60000UL
+#define SB_HISTORY_HOUR_MS 3600000UL
+
+struct HistorySample {
+  unsigned long time;
+  float value;
+};
+
+struct HistoryRollup {
+  // Start of the covered time
+  unsigned long start;
+  float min;
+  float max;
+  float sum;
+  uint32_t count;
+  float mean() const { return count ? sum/count : NAN; }
+};
+
+class SensorHistory {
+  public:
+    SensorHistory();
+    // Add a new sample, rollups are updated on the fly
+    void add(unsigned long time, float value);
+    // Min, max and mean of all samples in [from, to] at rollup resolution,
+    // returns false if there is no data in that range. Times are compared by their
+    // difference, so a range may span a wrap of millis() but no more than 24 days
+    bool range(unsigned long from, unsigned long to, HistoryRollup &result) const;
+    // Copy the latest raw samples (oldest first), returns the number copied
+    size_t latest(HistorySample *samples, size_t n) const;
+    void clear();
+
+  private:
+    HistorySample _raw[SB_HISTORY_RAW];
+    size_t _rawCount;
+    size_t _rawHead;
+
+    // Finished rollups and the one currently filled
+    HistoryRollup _minutes[SB_HISTORY_MINUTES];
+    size_t _minuteCount;
+    size_t _minuteHead;
+    HistoryRollup _minute;
+
+    HistoryRollup _hours[SB_HISTORY_HOURS];
+    size_t _hourCount;
+    size_t _hourHead;
+    HistoryRollup _hour;
+
+    // Accumulate a sample in a rollup, push it into the ring if its period is over
+    static void accumulate(HistoryRollup &current, HistoryRollup *ring, size_t size, size_t &head, size_t &count,
+                           unsigned long period, unsigned long time, float value);
+    static void merge(HistoryRollup &result, const HistoryRollup &bucket);
+    static bool overlaps(const HistoryRollup &bucket, unsigned long period, unsigned long from, unsigned long to);
+};
+
+#endif
@@ -0,0 +1,196 @@
+/***************************************************
+ Benchmarks of the SensorBoard library against the simulated board
+
+   benchSensorBoard [--quick] [--check]
+
+ --quick runs fewer iterations, --check fails if a result
+ misses its budget by far, e.g. after a regression.
+
+ Feel free to use the code as it is.
+
+ Benjamin Voelker, voelkerb@me.com
+ Embedded Systems
+ University of Freiburg, Institute of Computer Science
+ ****************************************************/
+
+#include "simulation.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <vector>
+
+// Budgets of --check, far from what a desktop reaches
+#define BUDGET_HANDLE_P99_US 200.0
+#define BUDGET_FRAMES_PER_S 100000.0
+#define BUDGET_UPDATE_US 50.0
+
+static bool quick = false;
+static int misses = 0;
+
+static double cpuSeconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+static double wallSeconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+static void budget(const char *name, bool met) {
+  if (met) return;
+  printf("  %s misses its budget\n", name);
+  misses++;
+}
+
+static float activePower() {
+  // Sweeps through the whole LED range
+  return (VirtualClock::millis()/10) % 250;
+}
+
+static void connect(Simulation &sim, SensorBoard &host) {
+  sim.attach(&host);
+  host.activePowerGetter = &activePower;
+  host.init();
+  sim.runUntilReady();
+}
+
+// Time handle() takes from one frame in the link to its callback
+static void benchHandleLatency() {
+  Simulation sim;
+  SensorBoard host(&sim.link, 0.1, 0.1, 1, 2, 200);
+  connect(sim, host);
+  int n = quick ? 20000 : 200000;
+  std::vector<double> times;
+  times.reserve(n);
+  sim.board.autoSend = true;
+  for (int i = 0; i < n; i++) {
+    // A new temperature each time, always beyond the hysteresis
+    sim.board.setSensors(20 + (i % 2), sim.board.hum, sim.board.light, sim.board.pir);
+    double start = wallSeconds();
+    host.handle();
+    times.push_back(wallSeconds() - start);
+  }
+  std::sort(times.begin(), times.end());
+  double p50 = times[n/2]*1e6;
+  double p99 = times[n*99/100]*1e6;
+  printf("handle() latency of one frame: p50 %.2f us, p99 %.2f us, max %.2f us\n", p50, p99, times[n-1]*1e6);
+  budget("handle() latency", p99 < BUDGET_HANDLE_P99_US);
+}
+
+// Decoding throughput of a stream of sensor frames per protocol
+static void benchFramesPerSecond() {
+  const uint8_t versions[] = {SB_PROTO_LEGACY, SB_PROTO_BINARY, SB_PROTO_TIME, SB_PROTO_COMPACT};
+  int n = quick ? 20000 : 200000;
+  for (size_t v = 0; v < sizeof(versions); v++) {
+    Simulation sim(versions[v]);
+    SensorBoard host(&sim.link, 0.1, 0.1, 1, 2, 200);
+    connect(sim, host);
+    sim.board.autoSend = true;
+    size_t before = sim.link.bytesToHost;
+    for (int i = 0; i < n; i++) {
+      sim.board.setSensors(20 + (i % 2), 40 + (i % 2), 100 + 10*(i % 2), i % 2);
+    }
+    size_t bytes = sim.link.bytesToHost - before;
+    host.resetStats();
+    size_t received = host.stats().bytesRx + bytes;
+    double start = cpuSeconds();
+    // Everything is in the link, drain it
+    while (host.stats().bytesRx < received) host.handle();
+    double seconds = cpuSeconds() - start;
+    SensorBoardStats stats = host.stats();
+    unsigned long frames = 0;
+    for (size_t i = 0; i < SB_STATS_NUM_COMMANDS; i++) frames += stats.frames[i];
+    printf("protocol %2u: %.0f frames/s decoded, %.1f bytes/frame\n", versions[v],
+           frames/seconds, (double)bytes/frames);
+    budget("frames/s", frames/seconds > BUDGET_FRAMES_PER_S);
+    // All but the few unchanged values of the first round were sent
+    budget("decoded frames", frames > 3UL*n);
+  }
+}
+
+// Bytes sent to the board per LED pattern in 10 s, on the board or streamed by the host
+static void benchPatternBytes() {
+  const uint8_t versions[] = {SB_PROTO_LEGACY, SB_PROTO_LED_DELTA, SB_PROTO_PATTERN, SB_PROTO_COMPACT};
+  const char *names[] = {"idle", "color", "blink", "round", "glow", "rainbow", "power"};
+  const int numPatterns = sizeof(names)/sizeof(names[0]);
+  unsigned long duration = 10000;
+  size_t bytes[sizeof(versions)][numPatterns];
+  for (size_t v = 0; v < sizeof(versions); v++) {
+    for (int p = 0; p < numPatterns; p++) {
+      Simulation sim(versions[v]);
+      SensorBoard host(&sim.link, 0.1, 0.1, 1, 2, 200);
+      connect(sim, host);
+      sim.run(100);
+      size_t before = sim.link.bytesToBoard;
+      switch (p) {
+        case 1: host.setColor(COLOR_BLUE); break;
+        case 2: host.blink(COLOR_RED); break;
+        case 3: host.newLEDPattern(LEDPattern::roundPattern, -1, COLOR_GREEN, COLOR_BLACK); break;
+        case 4: host.glow(COLOR_PINK); break;
+        case 5: host.setRainbow(); break;
+        case 6: host.displayPowerColor(); break;
+        default: break;
+      }
+      sim.run(duration);
+      bytes[v][p] = sim.link.bytesToBoard - before;
+    }
+  }
+  printf("bytes to the board in %lu s:\n  %-10s", duration/1000, "protocol");
+  for (int p = 0; p < numPatterns; p++) printf("%9s", names[p]);
+  printf("\n");
+  for (size_t v = 0; v < sizeof(versions); v++) {
+    printf("  %-10u", versions[v]);
+    for (int p = 0; p < numPatterns; p++) printf("%9zu", bytes[v][p]);
+    printf("\n");
+  }
+  // Patterns on the board cost a single frame instead of a stream
+  budget("blink bytes", bytes[sizeof(versions)-1][2] < bytes[0][2]);
+}
+
+// CPU time of update() without and with work to do
+static void benchUpdate() {
+  const char *names[] = {"idle", "blink on host", "blink on board", "power"};
+  const uint8_t versions[] = {SB_PROTO_COMPACT, SB_PROTO_LED_DELTA, SB_PROTO_COMPACT, SB_PROTO_COMPACT};
+  unsigned long ticks = quick ? 20000 : 200000;
+  for (int p = 0; p < 4; p++) {
+    Simulation sim(versions[p]);
+    SensorBoard host(&sim.link, 0.1, 0.1, 1, 2, 200);
+    connect(sim, host);
+    if (p == 1 || p == 2) host.blink(COLOR_RED);
+    if (p == 3) host.displayPowerColor();
+    // The fake board's share of the loop is taken off with a run without host
+    double start = cpuSeconds();
+    sim.run(ticks);
+    double withHost = cpuSeconds() - start;
+    sim.host = NULL;
+    start = cpuSeconds();
+    sim.run(ticks);
+    double boardOnly = cpuSeconds() - start;
+    double perUpdate = (withHost - boardOnly)/ticks*1e6;
+    if (perUpdate < 0) perUpdate = 0;
+    printf("update() %-15s %.3f us CPU per call at 1 call/ms\n", names[p], perUpdate);
+    budget("update() time", perUpdate < BUDGET_UPDATE_US);
+  }
+}
+
+int main(int argc, char **argv) {
+  bool check = false;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--quick") == 0) quick = true;
+    else if (strcmp(argv[i], "--check") == 0) check = true;
+  }
+  benchHandleLatency();
+  benchFramesPerSecond();
+  benchPatternBytes();
+  benchUpdate();
+  if (check && misses) {
+    printf("%d budget(s) missed\n", misses);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,127 @@
+/***************************************************
+ Arduino core to run the SensorBoard sketch on Linux
+
+ Time is the monotonic clock, Serial is a file descriptor,
+ e.g. the master side of a pty. Interrupts of the button
+ and the simulated DHT22 are delivered whenever the sketch
+ calls into the core, with micros() at the time of the edge,
+ and are held back while interrupts are off (FastLED.show()).
+
+ Everything lives in namespace firmware, so the sketch can
+ share a process with the host library.
+
+ Feel free to use the code as it is.
+
+ Benjamin Voelker, voelkerb@me.com
+ Embedded Systems
+ University of Freiburg, Institute of Computer Science
+ ****************************************************/
+
+#ifndef ARDUINO_h
+#define ARDUINO_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define CHANGE 1
+#define FALLING 2
+#define RISING 3
+// 8MHz ATmega328
+#define F_CPU 8000000UL
+#define ICACHE_RAM_ATTR
+#define NUM_DIGITAL_PINS 20
+#define digitalPinToInterrupt(pin) (pin)
+
+// Pins the simulated hardware is wired to, as in the sketch
+#define SIM_BUTTON_PIN 3
+#define SIM_PIR_PIN 7
+#define SIM_DHT_PIN 9
+
+namespace firmware {
+
+using std::min;
+using std::max;
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void yield();
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+void attachInterrupt(uint8_t interrupt, void (*isr)(void), int mode);
+void detachInterrupt(uint8_t interrupt);
+void noInterrupts();
+void interrupts();
+
+class HardwareSerial {
+  public:
+    HardwareSerial();
+    void begin(unsigned long baud);
+    int available();
+    int read();
+    int peek();
+    size_t write(uint8_t c);
+    size_t write(const uint8_t *data, size_t n);
+    size_t print(const char *s);
+    size_t print(char c);
+    size_t print(long value);
+    size_t print(float value);
+    size_t println();
+    template < typename T >
+    size_t println(T value) { return print(value) + println(); }
+    void flush() {}
+    operator bool() { return _fd >= 0; }
+    // Host side: descriptor of the link and the rate set by the sketch
+    void setFd(int fd);
+    unsigned long baudRate() const { return _baud; }
+    int fd() const { return _fd; }
+  private:
+    int _fd;
+    unsigned long _baud;
+    // Receive buffer of the UART
+    uint8_t _rx[64];
+    uint8_t _rxHead;
+    uint8_t _rxCount;
+    void fill();
+};
+
+extern HardwareSerial Serial;
+
+// Host side of the simulated board, called by the harness from any thread
+namespace host {
+  // Button and PIR levels, pressed pulls the button pin low
+  void setButton(bool pressed);
+  // Same, right after the next bytes the sketch writes, e.g. within one of its frames
+  void setButtonOnWrite(bool pressed);
+  void setPIR(bool on);
+  // Values the DHT22 answers with, fail makes it stay silent
+  void setDHT(float temp, float hum, bool fail=false);
+  void setLux(long lux);
+  // Conversions the DHT22 answered, edges held back while interrupts were off
+  // and start signals it ignored because they were too short or too long
+  unsigned long dhtAnswers();
+  unsigned long dhtMaskedEdges();
+  unsigned long dhtBadStarts();
+  // Sleep like the AVR's idle mode until the link or the button wakes us up, at most ms
+  void idle(unsigned long ms);
+  // Wake idle() from another thread
+  void wake();
+  // Time in us on the same clock as micros(), but without delivering interrupts
+  unsigned long now();
+}
+
+}
+
+#endif
@@ -0,0 +1,29 @@
+/***************************************************
+ TSL2561 for the SensorBoard sketch on Linux, reads the
+ value set with host::setLux()
+
+ Feel free to use the code as it is.
+
+ Benjamin Voelker, voelkerb@me.com
+ Embedded Systems
+ University of Freiburg, Institute of Computer Science
+ ****************************************************/
+
+#ifndef DIGITAL_LIGHT_TSL2561_h
+#define DIGITAL_LIGHT_TSL2561_h
+
+#include "Arduino.h"
+
+namespace firmware {
+
+class TSL2561_CalculateLux {
+  public:
+    void init() {}
+    signed long readVisibleLux();
+};
+
+extern TSL2561_CalculateLux TSL2561;
+
+}
+
+#endif
@@ -0,0 +1,49 @@
+/***************************************************
+ EEPROM for the SensorBoard sketch on Linux, kept in
+ memory and erased (0xFF) at start
+
+ Feel free to use the code as it is.
+
+ Benjamin Voelker, voelkerb@me.com
+ Embedded Systems
+ University of Freiburg, Institute of Computer Science
+ ****************************************************/
+
+#ifndef EEPROM_h
+#define EEPROM_h
+
+#include "Arduino.h"
+
+// Size of the ATmega328's EEPROM
+#define SIM_EEPROM_SIZE 1024
+
+namespace firmware {
+
+class EEPROMClass {
+  public:
+    EEPROMClass() { memset(_data, 0xFF, sizeof(_data)); }
+    void begin(size_t size) { (void)size; }
+    bool commit() { return true; }
+    uint8_t read(int address) const { return _data[address % SIM_EEPROM_SIZE]; }
+    void write(int address, uint8_t value) { _data[address % SIM_EEPROM_SIZE] = value; writes++; }
+    template < typename T >
+    T &get(int address, T &value) const {
+      for (size_t i = 0; i < sizeof(T); i++) ((uint8_t *)&value)[i] = read(address+i);
+      return value;
+    }
+    template < typename T >
+    const T &put(int address, const T &value) {
+      for (size_t i = 0; i < sizeof(T); i++) write(address+i, ((const uint8_t *)&value)[i]);
+      return value;
+    }
+    // Bytes written, each one wears the cell
+    unsigned long writes = 0;
+  private:
+    uint8_t _data[SIM_EEPROM_SIZE];
+};
+
+extern EEPROMClass EEPROM;
+
+}
+
+#endif
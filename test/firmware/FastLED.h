@@ -0,0 +1,93 @@
+/***************************************************
+ FastLED for the SensorBoard sketch on Linux
+
+ show() takes about as long as on the board, 30us per
+ WS2812B LED with interrupts off, and hands the colors to
+ the harness.
+
+ Feel free to use the code as it is.
+
+ Benjamin Voelker, voelkerb@me.com
+ Embedded Systems
+ University of Freiburg, Institute of Computer Science
+ ****************************************************/
+
+#ifndef FASTLED_h
+#define FASTLED_h
+
+#include "Arduino.h"
+
+// Time to shift out one LED, interrupts are off meanwhile
+#define SIM_LED_SHOW_US 30
+
+namespace firmware {
+
+struct CRGB {
+  union {
+    struct {
+      union {
+        uint8_t r;
+        uint8_t red;
+      };
+      union {
+        uint8_t g;
+        uint8_t green;
+      };
+      union {
+        uint8_t b;
+        uint8_t blue;
+      };
+    };
+    uint8_t raw[3];
+  };
+  enum HTMLColorCode {
+    Black = 0x000000,
+    Blue = 0x0000FF,
+    Green = 0x008000,
+    Red = 0xFF0000
+  };
+  CRGB() {}
+  CRGB(uint8_t ir, uint8_t ig, uint8_t ib) : r(ir), g(ig), b(ib) {}
+  CRGB(HTMLColorCode code) : r((code >> 16) & 0xFF), g((code >> 8) & 0xFF), b(code & 0xFF) {}
+};
+
+inline bool operator== (const CRGB& lhs, const CRGB& rhs) { return lhs.r == rhs.r && lhs.g == rhs.g && lhs.b == rhs.b; }
+inline bool operator!= (const CRGB& lhs, const CRGB& rhs) { return !(lhs == rhs); }
+
+// Scale, but never down to 0 unless one of them is 0
+inline uint8_t scale8_video(uint8_t i, uint8_t scale) {
+  return (uint8_t)((((int)i * (int)scale) >> 8) + ((i && scale) ? 1 : 0));
+}
+
+enum EOrder {RGB, RBG, GRB, GBR, BRG, BGR};
+template < uint8_t DATA_PIN, EOrder RGB_ORDER >
+class WS2812B {};
+
+class CFastLED {
+  public:
+    CFastLED() : _leds(NULL), _numLEDs(0), _brightness(255) {}
+    template < template < uint8_t, EOrder > class CHIPSET, uint8_t DATA_PIN, EOrder RGB_ORDER >
+    void addLeds(CRGB *leds, int n) {
+      _leds = leds;
+      _numLEDs = n;
+    }
+    void setBrightness(uint8_t brightness) { _brightness = brightness; }
+    uint8_t getBrightness() const { return _brightness; }
+    void show();
+  private:
+    CRGB *_leds;
+    int _numLEDs;
+    uint8_t _brightness;
+};
+
+extern CFastLED FastLED;
+
+namespace host {
+  // Called on the sketch's thread after each show() with the colors before brightness
+  void setShowCallback(void (*showCB)(const CRGB *leds, int n, uint8_t brightness));
+  unsigned long shows();
+}
+
+}
+
+#endif
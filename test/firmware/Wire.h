@@ -0,0 +1,28 @@
+/***************************************************
+ Wire for the SensorBoard sketch on Linux, the TSL2561
+ is simulated without a bus
+
+ Feel free to use the code as it is.
+
+ Benjamin Voelker, voelkerb@me.com
+ Embedded Systems
+ University of Freiburg, Institute of Computer Science
+ ****************************************************/
+
+#ifndef WIRE_h
+#define WIRE_h
+
+#include "Arduino.h"
+
+namespace firmware {
+
+class TwoWire {
+  public:
+    void begin() {}
+};
+
+extern TwoWire Wire;
+
+}
+
+#endif
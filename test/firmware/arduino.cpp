@@ -0,0 +1,482 @@
+/***************************************************
+ Arduino core to run the SensorBoard sketch on Linux
+
+ Feel free to use the code as it is.
+
+ Benjamin Voelker, voelkerb@me.com
+ Embedded Systems
+ University of Freiburg, Institute of Computer Science
+ ****************************************************/
+
+#include "Arduino.h"
+#include "FastLED.h"
+#include "Wire.h"
+#include "Digital_Light_TSL2561.h"
+#include "EEPROM.h"
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+// DHT22 timing in us, the host pulls low for at least 0.8ms, more than 20ms is no start signal
+#define DHT_MIN_START 800
+#define DHT_MAX_START 20000
+#define DHT_RESPONSE_WAIT 30
+#define DHT_RESPONSE 80
+#define DHT_BIT_LOW 50
+#define DHT_ZERO_HIGH 27
+#define DHT_ONE_HIGH 70
+
+namespace firmware {
+
+HardwareSerial Serial;
+CFastLED FastLED;
+TwoWire Wire;
+TSL2561_CalculateLux TSL2561;
+EEPROMClass EEPROM;
+
+namespace {
+
+// A level change of an input pin at a time in us
+struct Edge {
+  unsigned long time;
+  uint8_t pin;
+  uint8_t level;
+};
+
+struct State {
+  State() : wakeRead(-1), wakeWrite(-1) {
+    int fds[2];
+    if (pipe(fds) == 0) {
+      wakeRead = fds[0];
+      wakeWrite = fds[1];
+      fcntl(wakeRead, F_SETFL, O_NONBLOCK);
+      fcntl(wakeWrite, F_SETFL, O_NONBLOCK);
+    }
+    for (int i = 0; i < NUM_DIGITAL_PINS; i++) {
+      levels[i] = HIGH;
+      modes[i] = INPUT;
+      outputs[i] = LOW;
+      isrs[i] = NULL;
+      isrModes[i] = CHANGE;
+    }
+    levels[SIM_PIR_PIN] = LOW;
+  }
+  // Inputs set by the harness
+  std::mutex lock;
+  std::deque<Edge> edges;
+  float dhtTemp = 21.0;
+  float dhtHum = 40.0;
+  bool dhtFail = false;
+  std::atomic<long> lux{100};
+  std::atomic<unsigned long> dhtAnswers{0};
+  std::atomic<unsigned long> dhtMasked{0};
+  std::atomic<unsigned long> dhtBadStarts{0};
+  std::atomic<unsigned long> shows{0};
+  // Level of the button edge armed for the next written byte, -1 if none
+  std::atomic<int> buttonOnWrite{-1};
+  int wakeRead;
+  int wakeWrite;
+  // Only touched by the sketch's thread
+  uint8_t levels[NUM_DIGITAL_PINS];
+  uint8_t modes[NUM_DIGITAL_PINS];
+  uint8_t outputs[NUM_DIGITAL_PINS];
+  void (*isrs[NUM_DIGITAL_PINS])(void);
+  int isrModes[NUM_DIGITAL_PINS];
+  bool interruptsOn = true;
+  bool inISR = false;
+  unsigned long isrTime = 0;
+  unsigned long maskedSince = 0;
+  unsigned long dhtLowSince = 0;
+  bool dhtDriven = false;
+  void (*showCB)(const CRGB *leds, int n, uint8_t brightness) = NULL;
+};
+
+// Created on first use, the sketch calls millis() from its static initializers
+State &state() {
+  static State s;
+  return s;
+}
+
+unsigned long monotonicMicros() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long)ts.tv_sec*1000000UL + ts.tv_nsec/1000UL;
+}
+
+// Time since start in us
+unsigned long realMicros() {
+  static const unsigned long start = monotonicMicros();
+  return monotonicMicros() - start;
+}
+
+// Keep the edges in time order, button and DHT edges come from different threads
+void postEdge(const Edge &edge) {
+  State &s = state();
+  std::lock_guard<std::mutex> guard(s.lock);
+  std::deque<Edge>::iterator it = s.edges.end();
+  while (it != s.edges.begin() && (it-1)->time > edge.time) --it;
+  s.edges.insert(it, edge);
+}
+
+bool nextEdge(unsigned long until, Edge &edge) {
+  State &s = state();
+  std::lock_guard<std::mutex> guard(s.lock);
+  if (s.edges.empty() || s.edges.front().time > until) return false;
+  edge = s.edges.front();
+  s.edges.pop_front();
+  return true;
+}
+
+void runISR(uint8_t pin, unsigned long time) {
+  State &s = state();
+  if (s.isrs[pin] == NULL) return;
+  int mode = s.isrModes[pin];
+  if (mode == RISING && s.levels[pin] != HIGH) return;
+  if (mode == FALLING && s.levels[pin] != LOW) return;
+  s.inISR = true;
+  s.isrTime = time;
+  s.isrs[pin]();
+  s.inISR = false;
+}
+
+// Run the interrupts of all edges that happened until now
+void serviceInterrupts() {
+  State &s = state();
+  if (s.inISR || !s.interruptsOn) return;
+  Edge edge;
+  while (nextEdge(realMicros(), edge)) {
+    if (s.levels[edge.pin] == edge.level) continue;
+    s.levels[edge.pin] = edge.level;
+    runISR(edge.pin, edge.time);
+  }
+}
+
+// Edges while interrupts were off only set the pin's flag, its interrupt runs once they are back on
+void releaseInterrupts() {
+  State &s = state();
+  unsigned long now = realMicros();
+  bool pending[NUM_DIGITAL_PINS] = {false};
+  Edge edge;
+  while (nextEdge(now, edge)) {
+    if (s.levels[edge.pin] == edge.level) continue;
+    s.levels[edge.pin] = edge.level;
+    pending[edge.pin] = true;
+    if (edge.pin == SIM_DHT_PIN && s.isrs[edge.pin]) s.dhtMasked++;
+  }
+  for (int pin = 0; pin < NUM_DIGITAL_PINS; pin++) if (pending[pin]) runISR(pin, now);
+}
+
+// The DHT22 answers the released start signal with its response and 40 bits
+void dhtRelease() {
+  State &s = state();
+  unsigned long now = realMicros();
+  unsigned long low = now - s.dhtLowSince;
+  float temp, hum;
+  bool fail;
+  {
+    std::lock_guard<std::mutex> guard(s.lock);
+    temp = s.dhtTemp;
+    hum = s.dhtHum;
+    fail = s.dhtFail;
+  }
+  s.levels[SIM_DHT_PIN] = HIGH;
+  if (fail) return;
+  if (low < DHT_MIN_START || low > DHT_MAX_START) {
+    s.dhtBadStarts++;
+    return;
+  }
+  uint16_t rawHum = (uint16_t)lroundf(hum*10);
+  uint16_t rawTemp = (uint16_t)lroundf(fabsf(temp)*10);
+  if (temp < 0) rawTemp |= 0x8000;
+  uint8_t data[5] = {(uint8_t)(rawHum >> 8), (uint8_t)rawHum, (uint8_t)(rawTemp >> 8), (uint8_t)rawTemp, 0};
+  data[4] = data[0] + data[1] + data[2] + data[3];
+  unsigned long t = now + DHT_RESPONSE_WAIT;
+  postEdge(Edge{t, SIM_DHT_PIN, LOW});
+  t += DHT_RESPONSE;
+  postEdge(Edge{t, SIM_DHT_PIN, HIGH});
+  t += DHT_RESPONSE;
+  for (int bit = 0; bit < 40; bit++) {
+    postEdge(Edge{t, SIM_DHT_PIN, LOW});
+    t += DHT_BIT_LOW;
+    postEdge(Edge{t, SIM_DHT_PIN, HIGH});
+    t += (data[bit/8] & (0x80 >> (bit % 8))) ? DHT_ONE_HIGH : DHT_ZERO_HIGH;
+  }
+  postEdge(Edge{t, SIM_DHT_PIN, LOW});
+  t += DHT_BIT_LOW;
+  postEdge(Edge{t, SIM_DHT_PIN, HIGH});
+  s.dhtAnswers++;
+}
+
+}
+
+// _____________________________________Core_____________________________________________________
+
+unsigned long micros() {
+  serviceInterrupts();
+  State &s = state();
+  return s.inISR ? s.isrTime : realMicros();
+}
+
+unsigned long millis() {
+  return micros()/1000;
+}
+
+void delay(unsigned long ms) {
+  unsigned long end = realMicros() + ms*1000;
+  while (realMicros() < end) {
+    serviceInterrupts();
+    usleep(50);
+  }
+}
+
+void delayMicroseconds(unsigned int us) {
+  unsigned long end = realMicros() + us;
+  while (realMicros() < end) {}
+}
+
+void yield() {
+  serviceInterrupts();
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {
+  if (pin >= NUM_DIGITAL_PINS) return;
+  State &s = state();
+  s.modes[pin] = mode;
+  if (pin != SIM_DHT_PIN) return;
+  if (mode == OUTPUT) {
+    s.dhtDriven = true;
+    if (s.outputs[pin] == LOW) s.dhtLowSince = realMicros();
+  } else if (s.dhtDriven) {
+    s.dhtDriven = false;
+    if (s.outputs[pin] == LOW) dhtRelease();
+  }
+}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+  if (pin >= NUM_DIGITAL_PINS) return;
+  State &s = state();
+  if (pin == SIM_DHT_PIN && s.dhtDriven && value == LOW && s.outputs[pin] != LOW) s.dhtLowSince = realMicros();
+  s.outputs[pin] = value;
+}
+
+int digitalRead(uint8_t pin) {
+  if (pin >= NUM_DIGITAL_PINS) return LOW;
+  serviceInterrupts();
+  State &s = state();
+  if (s.modes[pin] == OUTPUT) return s.outputs[pin];
+  return s.levels[pin];
+}
+
+void attachInterrupt(uint8_t interrupt, void (*isr)(void), int mode) {
+  if (interrupt >= NUM_DIGITAL_PINS) return;
+  state().isrModes[interrupt] = mode;
+  state().isrs[interrupt] = isr;
+}
+
+void detachInterrupt(uint8_t interrupt) {
+  if (interrupt >= NUM_DIGITAL_PINS) return;
+  state().isrs[interrupt] = NULL;
+}
+
+void noInterrupts() {
+  State &s = state();
+  if (!s.interruptsOn) return;
+  serviceInterrupts();
+  s.interruptsOn = false;
+  s.maskedSince = realMicros();
+}
+
+void interrupts() {
+  State &s = state();
+  if (s.interruptsOn) return;
+  s.interruptsOn = true;
+  releaseInterrupts();
+}
+
+// _____________________________________Serial___________________________________________________
+
+HardwareSerial::HardwareSerial() : _fd(-1), _baud(0), _rxHead(0), _rxCount(0) {}
+
+void HardwareSerial::setFd(int fd) {
+  _fd = fd;
+  if (fd >= 0) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+void HardwareSerial::begin(unsigned long baud) {
+  _baud = baud;
+}
+
+void HardwareSerial::fill() {
+  if (_fd < 0 || _rxCount == sizeof(_rx)) return;
+  uint8_t tail = (_rxHead + _rxCount) % sizeof(_rx);
+  size_t chunk = tail >= _rxHead ? sizeof(_rx) - tail : _rxHead - tail;
+  ssize_t got = ::read(_fd, &_rx[tail], chunk);
+  if (got > 0) _rxCount += got;
+}
+
+int HardwareSerial::available() {
+  serviceInterrupts();
+  fill();
+  return _rxCount;
+}
+
+int HardwareSerial::peek() {
+  if (available() == 0) return -1;
+  return _rx[_rxHead];
+}
+
+int HardwareSerial::read() {
+  if (available() == 0) return -1;
+  uint8_t c = _rx[_rxHead];
+  _rxHead = (_rxHead + 1) % sizeof(_rx);
+  _rxCount--;
+  return c;
+}
+
+size_t HardwareSerial::write(const uint8_t *data, size_t n) {
+  if (_fd < 0) return 0;
+  size_t sent = 0;
+  while (sent < n) {
+    ssize_t w = ::write(_fd, data + sent, n - sent);
+    if (w > 0) {
+      sent += w;
+      continue;
+    }
+    if (w < 0 && errno != EAGAIN && errno != EINTR) break;
+    struct pollfd pfd = {_fd, POLLOUT, 0};
+    if (poll(&pfd, 1, 100) <= 0) break;
+  }
+  int level = state().buttonOnWrite.exchange(-1);
+  if (level >= 0) postEdge(Edge{realMicros(), SIM_BUTTON_PIN, (uint8_t)level});
+  // Interrupts come in between the bytes as on the UART
+  serviceInterrupts();
+  return sent;
+}
+
+size_t HardwareSerial::write(uint8_t c) {
+  return write(&c, 1);
+}
+
+size_t HardwareSerial::print(const char *s) {
+  return write((const uint8_t *)s, strlen(s));
+}
+
+size_t HardwareSerial::print(char c) {
+  return write((uint8_t)c);
+}
+
+size_t HardwareSerial::print(long value) {
+  char buf[24];
+  snprintf(buf, sizeof(buf), "%ld", value);
+  return print(buf);
+}
+
+size_t HardwareSerial::print(float value) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.2f", value);
+  return print(buf);
+}
+
+size_t HardwareSerial::println() {
+  return print("\r\n");
+}
+
+// _____________________________________Peripherals______________________________________________
+
+void CFastLED::show() {
+  State &s = state();
+  noInterrupts();
+  unsigned long end = realMicros() + (unsigned long)_numLEDs*SIM_LED_SHOW_US;
+  while (realMicros() < end) {}
+  interrupts();
+  s.shows++;
+  if (s.showCB) s.showCB(_leds, _numLEDs, _brightness);
+}
+
+signed long TSL2561_CalculateLux::readVisibleLux() {
+  return state().lux;
+}
+
+// _____________________________________Host side________________________________________________
+
+namespace host {
+
+void setButton(bool pressed) {
+  postEdge(Edge{realMicros(), SIM_BUTTON_PIN, (uint8_t)(pressed ? LOW : HIGH)});
+  wake();
+}
+
+void setButtonOnWrite(bool pressed) {
+  state().buttonOnWrite = pressed ? LOW : HIGH;
+}
+
+void setPIR(bool on) {
+  postEdge(Edge{realMicros(), SIM_PIR_PIN, (uint8_t)(on ? HIGH : LOW)});
+  wake();
+}
+
+void setDHT(float temp, float hum, bool fail) {
+  State &s = state();
+  std::lock_guard<std::mutex> guard(s.lock);
+  s.dhtTemp = temp;
+  s.dhtHum = hum;
+  s.dhtFail = fail;
+}
+
+void setLux(long lux) {
+  state().lux = lux;
+}
+
+unsigned long dhtAnswers() {
+  return state().dhtAnswers;
+}
+
+unsigned long dhtMaskedEdges() {
+  return state().dhtMasked;
+}
+
+unsigned long dhtBadStarts() {
+  return state().dhtBadStarts;
+}
+
+void idle(unsigned long ms) {
+  State &s = state();
+  {
+    std::lock_guard<std::mutex> guard(s.lock);
+    if (!s.edges.empty() && s.edges.front().time <= realMicros()) return;
+  }
+  // The timer tick wakes the AVR every ms
+  struct pollfd pfds[2] = {{Serial.fd(), POLLIN, 0}, {s.wakeRead, POLLIN, 0}};
+  poll(pfds, 2, ms < 1 ? 0 : 1);
+  uint8_t drain[16];
+  while (::read(s.wakeRead, drain, sizeof(drain)) > 0) {}
+}
+
+void wake() {
+  uint8_t c = 0;
+  ssize_t w = ::write(state().wakeWrite, &c, 1);
+  (void)w;
+}
+
+unsigned long now() {
+  return realMicros();
+}
+
+void setShowCallback(void (*showCB)(const CRGB *leds, int n, uint8_t brightness)) {
+  state().showCB = showCB;
+}
+
+unsigned long shows() {
+  return state().shows;
+}
+
+}
+
+}
@@ -0,0 +1,15 @@
+# Declare the functions of an Arduino sketch as arduino-builder does,
+# so the .ino compiles as plain C++
+#   cmake -DSKETCH=<sketch.ino> -DOUTPUT=<header> -P prototypes.cmake
+file(STRINGS ${SKETCH} lines)
+set(prototypes "// Generated from ${SKETCH}\n")
+foreach(line IN LISTS lines)
+  if(line MATCHES "^([A-Za-z_][A-Za-z0-9_ ]*[ *&]+[A-Za-z_][A-Za-z0-9_]*\\([^)]*\\)) *{")
+    set(signature ${CMAKE_MATCH_1})
+    # Declared by the sketch itself
+    if(NOT signature MATCHES "BUTTON_PRESS")
+      set(prototypes "${prototypes}${signature};\n")
+    endif()
+  endif()
+endforeach()
+file(WRITE ${OUTPUT} "${prototypes}")
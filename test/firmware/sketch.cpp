@@ -0,0 +1,23 @@
+/***************************************************
+ The SensorBoard sketch compiled for Linux
+
+ The sketch lives in namespace firmware next to the
+ stubbed core, so it does not clash with the host library.
+
+ Feel free to use the code as it is.
+
+ Benjamin Voelker, voelkerb@me.com
+ Embedded Systems
+ University of Freiburg, Institute of Computer Science
+ ****************************************************/
+
+#include "Arduino.h"
+#include "FastLED.h"
+#include "Wire.h"
+#include "Digital_Light_TSL2561.h"
+#include "EEPROM.h"
+
+namespace firmware {
+#include "sketchPrototypes.h"
+#include "sensorBoard.ino"
+}
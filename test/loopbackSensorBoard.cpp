@@ -0,0 +1,258 @@
+/***************************************************
+ The SensorBoard sketch and the host library in one process,
+ linked by a pty
+
+   loopbackSensorBoard [--iterations N] [--check]
+
+ The sketch runs on its own thread on the stubbed Arduino
+ core in test/firmware, the host on a SensorBoardHub with the
+ pty's other end as a PosixSerial. Measures the time from a
+ button edge to buttonCB and from setColor() to the LEDs' show,
+ presses the button while the board sends and reads the DHT22
+ while the LEDs fade.
+ --check fails if a latency misses its budget or a value
+ arrives wrong.
+
+ Feel free to use the code as it is.
+
+ Benjamin Voelker, voelkerb@me.com
+ Embedded Systems
+ University of Freiburg, Institute of Computer Science
+ ****************************************************/
+
+#include "sensorBoardHub.h"
+#include "posixSerial.h"
+#include "firmware/Arduino.h"
+#include "firmware/FastLED.h"
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Budgets of --check in ms, far from what a desktop reaches
+#define BUDGET_BUTTON_P99_MS 50.0
+#define BUDGET_LED_P99_MS 50.0
+// Max time to wait for anything in ms
+#define WAIT_TIMEOUT 2000
+// Time between the button edges, above the sketch's debounce
+#define BUTTON_HOLD 30
+// Values of the simulated sensors
+#define SIM_TEMP 23.4
+#define SIM_HUM 45.6
+// Values while the LEDs fade, only a good conversion brings them to the host
+#define SIM_FADE_TEMP 24.5
+#define SIM_FADE_HUM 50.2
+#define SIM_LUX 321
+
+// Entry points of the sketch
+namespace firmware {
+  void setup();
+  void loop();
+  unsigned long nextDeadline();
+}
+
+static std::atomic<bool> running(true);
+static std::atomic<bool> setupDone(false);
+// First LED and time of the last show
+static std::atomic<uint32_t> shownColor(0);
+static std::atomic<unsigned long> shownAt(0);
+
+static SensorBoardHub hub;
+static SensorBoard *board = NULL;
+static unsigned long buttonAt = 0;
+static int buttons = 0;
+static int misses = 0;
+
+static uint32_t packColor(uint8_t r, uint8_t g, uint8_t b) {
+  return ((uint32_t)r << 16) | ((uint32_t)g << 8) | b;
+}
+
+static void onShow(const firmware::CRGB *leds, int n, uint8_t brightness) {
+  (void)brightness;
+  if (n > 0) shownColor = packColor(leds[0].r, leds[0].g, leds[0].b);
+  shownAt = firmware::host::now();
+}
+
+static void onButton(BUTTON_PRESS press) {
+  (void)press;
+  buttonAt = firmware::host::now();
+  buttons++;
+}
+
+static void runFirmware() {
+  firmware::setup();
+  setupDone = true;
+  while (running) {
+    firmware::loop();
+    unsigned long next = firmware::nextDeadline();
+    if (next > 0) firmware::host::idle(next);
+  }
+}
+
+// Run the hub until done() or the timeout, false on timeout
+template < typename F >
+static bool waitFor(F done, unsigned long ms=WAIT_TIMEOUT) {
+  unsigned long start = firmware::host::now();
+  while (!done()) {
+    if (firmware::host::now() - start > ms*1000) return false;
+    hub.update(1);
+  }
+  return true;
+}
+
+static void runFor(unsigned long ms) {
+  unsigned long start = firmware::host::now();
+  waitFor([start, ms]() { return firmware::host::now() - start >= ms*1000; }, ms+1);
+}
+
+static void report(const char *name, std::vector<double> &times, double budget) {
+  if (times.empty()) {
+    printf("%s: no samples\n", name);
+    misses++;
+    return;
+  }
+  std::sort(times.begin(), times.end());
+  size_t n = times.size();
+  double p99 = times[std::min(n-1, n*99/100)];
+  printf("%s: p50 %.2f ms, p99 %.2f ms, max %.2f ms (%zu samples)\n", name, times[n/2], p99, times[n-1], n);
+  if (p99 > budget) {
+    printf("  %s misses its budget\n", name);
+    misses++;
+  }
+}
+
+static void fail(const char *what) {
+  printf("  %s\n", what);
+  misses++;
+}
+
+static void measureButton(int iterations) {
+  std::vector<double> times;
+  for (int i = 0; i < 2*iterations; i++) {
+    int before = buttons;
+    unsigned long start = firmware::host::now();
+    firmware::host::setButton(i % 2 == 0);
+    if (waitFor([before]() { return buttons > before; })) times.push_back((buttonAt - start)/1000.0);
+    runFor(BUTTON_HOLD);
+  }
+  report("button edge to buttonCB", times, BUDGET_BUTTON_P99_MS);
+}
+
+static void measureLEDs(int iterations) {
+  std::vector<double> times;
+  for (int i = 0; i < iterations; i++) {
+    // A new color each time, so the host does not skip it
+    CRGB color = {(uint8_t)(10 + 7*i), (uint8_t)(200 - 5*i), (uint8_t)(i % 2 ? 50 : 150)};
+    uint32_t packed = packColor(color.r, color.g, color.b);
+    unsigned long start = firmware::host::now();
+    board->setColor(color);
+    if (waitFor([packed]() { return shownColor == packed; })) times.push_back((shownAt - start)/1000.0);
+    runFor(10);
+  }
+  report("setColor() to LED show", times, BUDGET_LED_P99_MS);
+}
+
+// Button edges while the board sends its answers, their events must not break up the frames
+static void checkButtonWhileSending(int iterations) {
+  unsigned long invalid = board->stats().invalidFrames;
+  int answered = 0;
+  for (int i = 0; i < 2*iterations; i++) {
+    int before = buttons;
+    int id = board->requestSensor(NEW_SENSOR_VALUE::NEW_SENSORS);
+    firmware::host::setButtonOnWrite(i % 2 == 0);
+    if (waitFor([before, id]() { return buttons > before && board->requestState(id) != REQUEST_STATE::PENDING; })
+        && board->requestState(id) == REQUEST_STATE::DONE) answered++;
+    runFor(BUTTON_HOLD);
+  }
+  invalid = board->stats().invalidFrames - invalid;
+  printf("button edges while sending: %d of %d answered, %lu invalid frames\n", answered, 2*iterations, invalid);
+  if (invalid > 0) fail("button events broke up frames");
+  if (answered < 2*iterations) fail("answers or button events missing");
+}
+
+// Keep the LEDs fading, each step is a show with interrupts off, while the DHT22 is read
+static void measureDHT(unsigned long duration) {
+  unsigned long answers = firmware::host::dhtAnswers();
+  unsigned long masked = firmware::host::dhtMaskedEdges();
+  firmware::host::setDHT(SIM_FADE_TEMP, SIM_FADE_HUM);
+  unsigned long start = firmware::host::now();
+  bool bright = false;
+  while (firmware::host::now() - start < duration*1000) {
+    bright = !bright;
+    board->setColor(bright ? COLOR_GREY : COLOR_BLACK, -1, true);
+    runFor(300);
+  }
+  answers = firmware::host::dhtAnswers() - answers;
+  masked = firmware::host::dhtMaskedEdges() - masked;
+  int id = board->requestSensor(NEW_SENSOR_VALUE::NEW_SENSORS);
+  bool arrived = id >= 0 && waitFor([id]() { return board->requestState(id) != REQUEST_STATE::PENDING; })
+                 && board->requestState(id) == REQUEST_STATE::DONE;
+  printf("DHT22 while fading: %lu conversions, %lu edges held back by shows, %.1f C %.1f %%\n",
+         answers, masked, board->temperature, board->humidity);
+  if (answers == 0) fail("DHT22 was not read");
+  // The sketch holds shows back during a conversion
+  if (masked > 0) fail("shows broke the DHT22 readout");
+  if (firmware::host::dhtBadStarts() > 0) fail("start signals of the wrong length");
+  if (!arrived) fail("no sensor values");
+  else if (fabs(board->temperature - SIM_FADE_TEMP) > 0.05 || fabs(board->humidity - SIM_FADE_HUM) > 0.05) fail("wrong DHT22 values");
+}
+
+int main(int argc, char **argv) {
+  int iterations = 100;
+  bool check = false;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--iterations") == 0 && i+1 < argc) iterations = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--check") == 0) check = true;
+  }
+
+  int master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+    perror("pty");
+    return 1;
+  }
+  PosixSerial serial;
+  if (!serial.open(ptsname(master), 38400)) {
+    perror("open pty");
+    return 1;
+  }
+  firmware::Serial.setFd(master);
+  firmware::host::setDHT(SIM_TEMP, SIM_HUM);
+  firmware::host::setLux(SIM_LUX);
+  firmware::host::setShowCallback(&onShow);
+
+  std::thread sketch(runFirmware);
+  while (!setupDone) runFor(1);
+
+  SensorBoard sensorBoard(&serial, 0.1, 0.1, 1, 2, 200);
+  board = &sensorBoard;
+  sensorBoard.buttonCB = &onButton;
+  hub.addBoard(&sensorBoard, serial.fd());
+  sensorBoard.init();
+  if (!waitFor([]() { return board->ready(); }, 5000)) {
+    printf("board did not get ready\n");
+    running = false;
+    sketch.join();
+    return 1;
+  }
+  printf("ready: protocol %u at %lu baud\n", sensorBoard.protocol, serial.baudRate());
+
+  measureButton(iterations);
+  checkButtonWhileSending(iterations);
+  measureLEDs(iterations);
+  measureDHT(4500);
+
+  running = false;
+  firmware::host::wake();
+  sketch.join();
+  if (check && misses) {
+    printf("%d check(s) failed\n", misses);
+    return 1;
+  }
+  return 0;
+}
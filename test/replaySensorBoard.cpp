@@ -0,0 +1,146 @@
+/***************************************************
+ Replays captures of SensorBoard traffic as a benchmark
+
+   replaySensorBoard [--speed F] [--check] [capture ...]
+
+ Each capture, written through SensorBoard::setRecorder(),
+ runs through a fresh host as fast as possible (or F times
+ real time). Without captures, a session with the simulated
+ board is recorded first: sensor values and button presses.
+ --check fails if a capture cannot be read or the host writes
+ other bytes than the recorded ones. Calls of the application,
+ e.g. setColor(), are not in a capture, captures of sessions
+ with them are written differently on replay.
+
+ Feel free to use the code as it is.
+
+ Benjamin Voelker, voelkerb@me.com
+ Embedded Systems
+ University of Freiburg, Institute of Computer Science
+ ****************************************************/
+
+#include "simulation.h"
+#include "sensorBoardReplay.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+// Length of the recorded session in ms
+#define SESSION_DURATION 60000
+
+static std::vector<uint8_t> capture;
+static unsigned long events = 0;
+
+static double wallSeconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+static void recordCapture(const uint8_t *data, size_t size) {
+  capture.insert(capture.end(), data, data+size);
+}
+
+static void onEvent(void *arg, NEW_SENSOR_VALUE value) {
+  (void)arg;
+  (void)value;
+  events++;
+}
+
+// Record a session with the simulated board to a temporary file, empty on failure
+static std::string recordSession() {
+  capture.clear();
+  {
+    Simulation sim;
+    SensorBoard host(&sim.link, 0.1, 0.1, 1, 2, 200);
+    sim.attach(&host);
+    host.setRecorder(&recordCapture);
+    host.init();
+    if (!sim.runUntilReady()) return "";
+    sim.board.autoSend = true;
+    for (unsigned long t = 0; t < SESSION_DURATION; t += 500) {
+      unsigned long step = t/500;
+      sim.board.setSensors(20.0 + (step % 7)*0.5, 40.0 + (step % 5), 100 + 20*(step % 3), step % 11 == 0);
+      if (step % 20 == 0) sim.board.press();
+      if (step % 20 == 1) sim.board.release();
+      sim.run(500);
+    }
+    host.setRecorder(NULL);
+  }
+  char path[] = "/tmp/replaySensorBoardXXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) return "";
+  FILE *file = fdopen(fd, "wb");
+  bool written = fwrite(capture.data(), 1, capture.size(), file) == capture.size();
+  fclose(file);
+  if (!written) {
+    unlink(path);
+    return "";
+  }
+  return path;
+}
+
+// Replay one capture, false if it cannot be read or the host wrote other bytes
+static bool replay(const char *path, float speed) {
+  SensorBoardReplay replay;
+  if (!replay.open(path)) {
+    printf("%s: cannot read capture\n", path);
+    return false;
+  }
+  replay.setSpeed(speed);
+  unsigned long baud = replay.baudRate();
+  unsigned long first = SensorBoardReplay::clock();
+  SensorBoard host(&replay, 0.1, 0.1, 1, 2, 200);
+  host.setClock(&SensorBoardReplay::clock);
+  host.eventCB = &onEvent;
+  events = 0;
+  double start = wallSeconds();
+  host.init();
+  while (replay.step(host.nextDeadline())) host.update();
+  host.update();
+  double seconds = wallSeconds() - start;
+  unsigned long duration = SensorBoardReplay::clock() - first;
+  printf("%s: protocol %u at %lu baud, %.1f s of traffic, %zu bytes, %lu events\n", path,
+         replay.protocol(), baud, duration/1000.0, replay.rxBytes(), events);
+  printf("  replayed in %.3f s, %.0fx real time, %.1f MB/s, %zu bytes written differently\n",
+         seconds, duration/1000.0/seconds, replay.rxBytes()/seconds/1e6, replay.txMismatches());
+  if (replay.protocol() != SB_PROTOCOL_VERSION) {
+    printf("  recorded with protocol %u, this host speaks %u\n", replay.protocol(), SB_PROTOCOL_VERSION);
+  }
+  return replay.txMismatches() == 0;
+}
+
+int main(int argc, char **argv) {
+  float speed = 0;
+  bool check = false;
+  std::vector<std::string> paths;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--speed") == 0 && i+1 < argc) speed = atof(argv[++i]);
+    else if (strcmp(argv[i], "--check") == 0) check = true;
+    else paths.push_back(argv[i]);
+  }
+  std::string session;
+  if (paths.empty()) {
+    session = recordSession();
+    if (session.empty()) {
+      printf("recording the simulated session failed\n");
+      return 1;
+    }
+    paths.push_back(session);
+  }
+  int failed = 0;
+  for (size_t i = 0; i < paths.size(); i++) {
+    if (!replay(paths[i].c_str(), speed)) failed++;
+  }
+  if (!session.empty()) unlink(session.c_str());
+  if (check && failed) {
+    printf("%d capture(s) failed\n", failed);
+    return 1;
+  }
+  return 0;
+}
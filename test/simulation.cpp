@@ -0,0 +1,466 @@
+/***************************************************
+ Simulated SensorBoard for native tests and benchmarks
+
+ Feel free to use the code as it is.
+
+ Benjamin Voelker, voelkerb@me.com
+ Embedded Systems
+ University of Freiburg, Institute of Computer Science
+ ****************************************************/
+
+#include "simulation.h"
+
+#include <math.h>
+
+unsigned long VirtualClock::_now = 0;
+
+static uint8_t crc8(uint8_t crc, uint8_t data) {
+  crc ^= data;
+  for (int i = 0; i < 8; i++) {
+    crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1);
+  }
+  return crc;
+}
+
+// _____________________________________MemoryTransport__________________________________________
+
+MemoryTransport::MemoryTransport() {
+  boardBaud = FAKE_BOARD_BAUD;
+  _hostBaud = FAKE_BOARD_BAUD;
+  delay = 0;
+  clear();
+}
+
+void MemoryTransport::clear() {
+  _toBoard.clear();
+  _toHost.clear();
+  bytesToBoard = 0;
+  bytesToHost = 0;
+}
+
+void MemoryTransport::push(std::deque<Byte> &queue, const uint8_t *data, size_t n) {
+  // A UART at the wrong rate reads garbage
+  bool garbled = _hostBaud != boardBaud;
+  for (size_t i = 0; i < n; i++) {
+    Byte byte = {VirtualClock::millis() + delay, (uint8_t)(garbled ? data[i] ^ 0x5A : data[i])};
+    queue.push_back(byte);
+  }
+}
+
+size_t MemoryTransport::pop(std::deque<Byte> &queue, uint8_t *data, size_t n) {
+  size_t got = 0;
+  while (got < n && !queue.empty() && (long)(VirtualClock::millis() - queue.front().time) >= 0) {
+    data[got++] = queue.front().value;
+    queue.pop_front();
+  }
+  return got;
+}
+
+size_t MemoryTransport::read(uint8_t *data, size_t n) {
+  return pop(_toHost, data, n);
+}
+
+size_t MemoryTransport::write(const uint8_t *data, size_t n) {
+  push(_toBoard, data, n);
+  bytesToBoard += n;
+  return n;
+}
+
+size_t MemoryTransport::boardRead(uint8_t *data, size_t n) {
+  return pop(_toBoard, data, n);
+}
+
+void MemoryTransport::boardWrite(const uint8_t *data, size_t n) {
+  push(_toHost, data, n);
+  bytesToHost += n;
+}
+
+// _____________________________________FakeBoard________________________________________________
+
+FakeBoard::FakeBoard(MemoryTransport *link, uint8_t version) {
+  _link = link;
+  this->version = version;
+  clockOffset = 0;
+  clockRate = 1.0;
+  badBaud = 0;
+  temp = 21.5;
+  hum = 40.0;
+  light = 120;
+  pir = false;
+  storedBaud = FAKE_BOARD_BAUD;
+  memset(config, 0, sizeof(config));
+  reset();
+}
+
+void FakeBoard::reset() {
+  protocol = SB_PROTO_LEGACY;
+  autoSend = false;
+  for (int i = 0; i < NUM_LEDS; i++) leds[i] = COLOR_BLACK;
+  brightness = 255;
+  pattern = 0;
+  patternDuration = -1;
+  _patternStart = 0;
+  memset(filters, 0, sizeof(filters));
+  memset(_sent, 0, sizeof(_sent));
+  memset(_lastSent, 0, sizeof(_lastSent));
+  memset(_force, 0, sizeof(_force));
+  memset(commands, 0, sizeof(commands));
+  ledFrames = 0;
+  _rxState = RxState::START;
+  _replyCmd = 0;
+  _replySeq = 0;
+  _baudTrial = false;
+  _oldBaud = storedBaud;
+  _baudTimer = 0;
+  _link->boardBaud = storedBaud;
+  // Stored settings apply right away like in setup()
+  if (config[0] == 1 && crc8Blob(config) == config[FAKE_BOARD_CONFIG_SIZE-1]) {
+    brightness = config[1];
+    memcpy(filters, &config[2], sizeof(filters));
+  }
+}
+
+unsigned long FakeBoard::millis() {
+  return (unsigned long)(clockOffset + (long long)llround(VirtualClock::millis()*clockRate));
+}
+
+void FakeBoard::update() {
+  uint8_t bytes[64];
+  size_t got;
+  while ((got = _link->boardRead(bytes, sizeof(bytes))) > 0) {
+    for (size_t i = 0; i < got; i++) parseByte(bytes[i]);
+  }
+  // New baud rate was not committed, the host cannot hear us
+  if (_baudTrial && millis() - _baudTimer > FAKE_BOARD_BAUD_TRIAL) {
+    _baudTrial = false;
+    _link->boardBaud = _oldBaud;
+  }
+  if (pattern != 0 && patternDuration >= 0 && (long)(millis() - _patternStart) > patternDuration) {
+    uint8_t expired = pattern;
+    pattern = 0;
+    sendEvent('P', &expired, 1);
+  }
+  // Values held back by minInterval and re-sends after maxInterval, the sketch polls its sensors
+  if (autoSend) sendAuto();
+}
+
+void FakeBoard::parseByte(uint8_t c) {
+  switch (_rxState) {
+    case RxState::START:
+      _data.clear();
+      if (c == SB_FRAME_SOF) _rxState = RxState::BIN_LEN;
+      else if (c == '?' || c == '!') _rxState = RxState::CMD;
+      break;
+    case RxState::CMD:
+      _cmd = c;
+      _expected = c == 'b' ? 1 : c == 'L' ? 3*NUM_LEDS : 0;
+      _rxState = _expected ? RxState::ARGS : RxState::END;
+      break;
+    case RxState::ARGS:
+      _data.push_back(c);
+      if (_data.size() >= _expected) _rxState = RxState::END;
+      break;
+    case RxState::END:
+      if (c == '\n') {
+        _rxState = RxState::START;
+        handleCommand(_cmd, _data.data(), _data.size());
+      } else if (c != '\r') {
+        // Optional protocol version of the host or fade flag
+        _data.push_back(c);
+      }
+      break;
+    case RxState::BIN_LEN:
+      _expected = c;
+      _crc = crc8(0, c);
+      _rxState = RxState::BIN_CMD;
+      break;
+    case RxState::BIN_CMD:
+      _cmd = c;
+      _crc = crc8(_crc, c);
+      _rxState = _expected ? RxState::BIN_PAYLOAD : RxState::BIN_CRC;
+      break;
+    case RxState::BIN_PAYLOAD:
+      _data.push_back(c);
+      _crc = crc8(_crc, c);
+      if (_data.size() >= _expected) _rxState = RxState::BIN_CRC;
+      break;
+    case RxState::BIN_CRC:
+      _rxState = RxState::START;
+      if (c != _crc) break;
+      if ((_cmd & SB_SEQ_FLAG) && !_data.empty()) {
+        _cmd &= ~SB_SEQ_FLAG;
+        _replyCmd = _cmd;
+        _replySeq = _data[0];
+        _data.erase(_data.begin());
+      }
+      handleCommand(_cmd, _data.data(), _data.size());
+      _replyCmd = 0;
+      break;
+  }
+}
+
+void FakeBoard::handleCommand(uint8_t cmd, const uint8_t *data, uint8_t len) {
+  if (cmd < 128) commands[cmd]++;
+  switch (cmd) {
+    case '?': {
+      uint8_t hostVersion = len > 0 && data[0] >= '0' ? data[0] - '0' : SB_PROTO_LEGACY;
+      // Handshake reply is always legacy framed
+      protocol = SB_PROTO_LEGACY;
+      uint8_t own = '0' + version;
+      sendFrame('!', &own, 1);
+      protocol = hostVersion < version ? hostVersion : version;
+      break;
+    }
+    case 't': sendValue('t', temp); break;
+    case 'h': sendValue('h', hum); break;
+    case 'l': sendLight(); break;
+    case 'p': {
+      uint8_t value = pir;
+      sendEvent('p', &value, 1);
+      break;
+    }
+    case 's': {
+      uint8_t payload[14];
+      memcpy(&payload[0], &light, 4);
+      memcpy(&payload[4], &temp, 4);
+      memcpy(&payload[8], &hum, 4);
+      payload[12] = pir;
+      payload[13] = SB_VALID_LIGHT | SB_VALID_TEMP | SB_VALID_HUM | SB_VALID_PIR;
+      sendEvent('s', payload, sizeof(payload));
+      break;
+    }
+    case 'a':
+      autoSend = true;
+      for (int i = 0; i < 4; i++) _force[i] = true;
+      sendAuto();
+      break;
+    case 'o':
+      autoSend = false;
+      break;
+    case 'b':
+      if (len > 0) brightness = data[0];
+      break;
+    case 'L':
+      if (len < 3*NUM_LEDS) break;
+      ledFrames++;
+      pattern = 0;
+      for (int i = 0; i < NUM_LEDS; i++) leds[i] = CRGB{data[3*i], data[3*i+1], data[3*i+2]};
+      break;
+    case 'U':
+      if (len < 1) break;
+      ledFrames++;
+      pattern = 0;
+      for (int i = 1; i+3 < len; i += 4) {
+        if (data[i] < NUM_LEDS) leds[data[i]] = CRGB{data[i+1], data[i+2], data[i+3]};
+      }
+      break;
+    case 'P': {
+      if (len < 13) break;
+      ledFrames++;
+      pattern = data[0];
+      int32_t duration;
+      memcpy(&duration, &data[9], 4);
+      patternDuration = duration;
+      _patternStart = millis();
+      break;
+    }
+    case 'F': {
+      if (len < 11) break;
+      const char *sensor = strchr("thlp", data[0]);
+      if (data[0] == 0 || sensor == NULL) break;
+      memcpy(&filters[sensor - "thlp"], &data[1], sizeof(SensorBoardFilter));
+      break;
+    }
+    case 'c': {
+      if (len >= FAKE_BOARD_CONFIG_SIZE && data[0] == 1 && crc8Blob(data) == data[FAKE_BOARD_CONFIG_SIZE-1]) {
+        memcpy(config, data, FAKE_BOARD_CONFIG_SIZE);
+        brightness = config[1];
+        memcpy(filters, &config[2], sizeof(filters));
+      }
+      uint8_t blob[FAKE_BOARD_CONFIG_SIZE];
+      uint8_t reply[2] = {1, buildConfig(blob)};
+      sendFrame('c', reply, 2);
+      break;
+    }
+    case 'B': {
+      if (len < 4) break;
+      uint32_t baud;
+      memcpy(&baud, data, 4);
+      if (baud < FAKE_BOARD_MIN_BAUD || baud > FAKE_BOARD_MAX_BAUD) baud = 0;
+      sendFrame('B', (const uint8_t *)&baud, 4);
+      if (baud == 0) break;
+      if (!_baudTrial) _oldBaud = _link->boardBaud;
+      _link->boardBaud = baud;
+      _baudTrial = true;
+      _baudTimer = millis();
+      break;
+    }
+    case 'e': {
+      std::vector<uint8_t> echo(data, data+len);
+      if (_link->boardBaud == badBaud && len > 0) echo[len/2] ^= 0x01;
+      sendFrame('e', echo.data(), len);
+      break;
+    }
+    case 'C':
+      if (_baudTrial) {
+        _baudTrial = false;
+        storedBaud = _link->boardBaud;
+      }
+      sendFrame('C', NULL, 0);
+      break;
+    case 'T': {
+      uint32_t now = millis();
+      sendFrame('T', (const uint8_t *)&now, 4);
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+void FakeBoard::sendFrame(char cmd, const uint8_t *data, uint8_t len) {
+  std::vector<uint8_t> frame;
+  if (protocol >= SB_PROTO_BINARY) {
+    bool tagged = _replyCmd != 0 && cmd == _replyCmd;
+    uint8_t header = tagged ? (uint8_t)cmd | SB_SEQ_FLAG : (uint8_t)cmd;
+    frame.push_back(SB_FRAME_SOF);
+    frame.push_back(tagged ? len+1 : len);
+    frame.push_back(header);
+    if (tagged) {
+      frame.push_back(_replySeq);
+      _replyCmd = 0;
+    }
+    frame.insert(frame.end(), data, data+len);
+    uint8_t crc = 0;
+    for (size_t i = 1; i < frame.size(); i++) crc = crc8(crc, frame[i]);
+    frame.push_back(crc);
+  } else {
+    frame.push_back('!');
+    frame.push_back(cmd);
+    frame.insert(frame.end(), data, data+len);
+    frame.push_back('\r');
+    frame.push_back('\n');
+  }
+  _link->boardWrite(frame.data(), frame.size());
+}
+
+void FakeBoard::sendEvent(char cmd, const uint8_t *data, uint8_t len) {
+  if (protocol < SB_PROTO_TIME) {
+    sendFrame(cmd, data, len);
+    return;
+  }
+  std::vector<uint8_t> payload(data, data+len);
+  uint16_t stamp = (uint16_t)millis();
+  payload.push_back(stamp & 0xFF);
+  payload.push_back(stamp >> 8);
+  sendFrame(cmd, payload.data(), payload.size());
+}
+
+void FakeBoard::sendValue(char cmd, float value) {
+  if (protocol < SB_PROTO_COMPACT) {
+    sendEvent(cmd, (const uint8_t *)&value, 4);
+    return;
+  }
+  int16_t centi = (int16_t)lroundf(value*100);
+  sendEvent(cmd, (const uint8_t *)&centi, 2);
+}
+
+void FakeBoard::sendLight() {
+  if (protocol < SB_PROTO_COMPACT) {
+    sendEvent('l', (const uint8_t *)&light, 4);
+    return;
+  }
+  uint8_t varint[5];
+  uint8_t len = 0;
+  uint32_t value = (uint32_t)light;
+  do {
+    varint[len] = value & 0x7F;
+    value >>= 7;
+    if (value) varint[len] |= 0x80;
+    len++;
+  } while (value);
+  sendEvent('l', varint, len);
+}
+
+void FakeBoard::press() {
+  sendEvent('b', NULL, 0);
+}
+
+void FakeBoard::release() {
+  sendEvent('r', NULL, 0);
+}
+
+void FakeBoard::setSensors(float temp, float hum, int32_t light, bool pir) {
+  this->temp = temp;
+  this->hum = hum;
+  this->light = light;
+  this->pir = pir;
+  if (autoSend) sendAuto();
+}
+
+// Same as the sketch's filterPass()
+bool FakeBoard::filterPass(int i, float value) {
+  unsigned long since = millis() - _lastSent[i];
+  bool due = _force[i] || (filters[i].maxInterval > 0 && since >= filters[i].maxInterval);
+  if (!due && (since < filters[i].minInterval || fabs(value - _sent[i]) <= filters[i].deadband)) return false;
+  _sent[i] = value;
+  _lastSent[i] = millis();
+  _force[i] = false;
+  return true;
+}
+
+// Auto mode sends what passes the filters of temperature, humidity, light and PIR
+void FakeBoard::sendAuto() {
+  if (filterPass(0, temp)) sendValue('t', temp);
+  if (filterPass(1, hum)) sendValue('h', hum);
+  if (filterPass(2, light)) sendLight();
+  if (filterPass(3, pir)) {
+    uint8_t value = pir;
+    sendEvent('p', &value, 1);
+  }
+}
+
+uint8_t FakeBoard::crc8Blob(const uint8_t *blob) {
+  uint8_t crc = 0;
+  for (int i = 0; i < FAKE_BOARD_CONFIG_SIZE-1; i++) crc = crc8(crc, blob[i]);
+  return crc;
+}
+
+uint8_t FakeBoard::buildConfig(uint8_t *blob) {
+  blob[0] = 1;
+  blob[1] = brightness;
+  memcpy(&blob[2], filters, sizeof(filters));
+  blob[FAKE_BOARD_CONFIG_SIZE-1] = crc8Blob(blob);
+  return blob[FAKE_BOARD_CONFIG_SIZE-1];
+}
+
+// _____________________________________Simulation_______________________________________________
+
+Simulation::Simulation(uint8_t version) : board(&link, version) {
+  host = NULL;
+  // Away from zero so the first timers do not start at the epoch
+  VirtualClock::set(100000);
+}
+
+void Simulation::attach(SensorBoard *host) {
+  this->host = host;
+  host->setClock(&VirtualClock::millis);
+}
+
+void Simulation::run(unsigned long ms) {
+  for (unsigned long i = 0; i <= ms; i++) {
+    if (i > 0) VirtualClock::advance(1);
+    board.update();
+    if (!host) continue;
+    host->update();
+    #ifdef SB_EVENT_QUEUE
+    // The callbacks run right after, as on a consumer task that keeps up
+    host->dispatchEvents();
+    #endif
+  }
+}
+
+bool Simulation::runUntilReady(unsigned long ms) {
+  for (unsigned long i = 0; i < ms && host && !host->ready(); i++) run(1);
+  return host && host->ready();
+}
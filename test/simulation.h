@@ -0,0 +1,172 @@
+/***************************************************
+ Simulated SensorBoard for native tests and benchmarks
+
+ A virtual clock, an in-memory link and a scripted fake
+ firmware that speaks the board's protocol. The library
+ runs unchanged against them on Linux:
+
+   Simulation sim;
+   SensorBoard board(&sim.link, ...);
+   sim.attach(&board);
+   board.init();
+   sim.run(500);
+
+ Feel free to use the code as it is.
+
+ Benjamin Voelker, voelkerb@me.com
+ Embedded Systems
+ University of Freiburg, Institute of Computer Science
+ ****************************************************/
+
+#ifndef SIMULATION_h
+#define SIMULATION_h
+
+#include "sensorBoard.h"
+
+#include <deque>
+#include <vector>
+
+// Rate the firmware starts with
+#define FAKE_BOARD_BAUD 38400
+// Same limits and trial time as the firmware
+#define FAKE_BOARD_MIN_BAUD 9600
+#define FAKE_BOARD_MAX_BAUD 1000000
+#define FAKE_BOARD_BAUD_TRIAL 500
+#define FAKE_BOARD_CONFIG_SIZE 43
+
+// Virtual time in ms shared by the host library and the fake firmware,
+// pass VirtualClock::millis to SensorBoard::setClock()
+class VirtualClock {
+  public:
+    static unsigned long millis() { return _now; }
+    static void advance(unsigned long ms) { _now += ms; }
+    static void set(unsigned long now) { _now = now; }
+  private:
+    static unsigned long _now;
+};
+
+// In-memory serial link, the host end is the transport of the library.
+// Bytes arrive after the link delay and garbled if both ends run at different baud rates
+class MemoryTransport : public SensorBoardTransport {
+  public:
+    MemoryTransport();
+
+    size_t read(uint8_t *data, size_t n);
+    size_t write(const uint8_t *data, size_t n);
+    unsigned long baudRate() { return _hostBaud; }
+    bool setBaudRate(unsigned long baud) { _hostBaud = baud; return true; }
+
+    // Board end
+    size_t boardRead(uint8_t *data, size_t n);
+    void boardWrite(const uint8_t *data, size_t n);
+    unsigned long boardBaud;
+    // Time in ms a byte is on the way, in both directions
+    unsigned long delay;
+    // Bytes written by each end
+    size_t bytesToBoard;
+    size_t bytesToHost;
+    void clear();
+
+  private:
+    struct Byte {
+      unsigned long time;
+      uint8_t value;
+    };
+    std::deque<Byte> _toBoard;
+    std::deque<Byte> _toHost;
+    unsigned long _hostBaud;
+    void push(std::deque<Byte> &queue, const uint8_t *data, size_t n);
+    size_t pop(std::deque<Byte> &queue, uint8_t *data, size_t n);
+};
+
+// Fake firmware: frames the commands of the host and answers them like the sketch does,
+// in the framing, encoding and with the time stamps of the negotiated protocol
+class FakeBoard {
+  public:
+    FakeBoard(MemoryTransport *link, uint8_t version=SB_PROTOCOL_VERSION);
+
+    // Handle received commands and due patterns, call whenever the virtual clock moved
+    void update();
+    // Board time, runs off the virtual clock by offset and rate
+    unsigned long millis();
+
+    // Scripted input, sent as events like the button interrupt or auto mode would
+    void press();
+    void release();
+    void setSensors(float temp, float hum, int32_t light, bool pir);
+    // Send any event frame, stamped if the protocol requires it
+    void sendEvent(char cmd, const uint8_t *data, uint8_t len);
+
+    // Announced protocol version and the one negotiated with the host
+    uint8_t version;
+    uint8_t protocol;
+    long clockOffset;
+    double clockRate;
+    // Baud rate the echo test fails at, e.g. one the cable cannot do
+    unsigned long badBaud;
+    // Sensor values
+    float temp;
+    float hum;
+    int32_t light;
+    bool pir;
+    bool autoSend;
+    // State set by the host
+    CRGB leds[NUM_LEDS];
+    uint8_t brightness;
+    uint8_t pattern;
+    long patternDuration;
+    SensorBoardFilter filters[4];
+    // Committed baud rate and stored config, kept across reset()
+    unsigned long storedBaud;
+    uint8_t config[FAKE_BOARD_CONFIG_SIZE];
+    // Commands received per command byte, LED frames include !L, !U and !P
+    unsigned int commands[128];
+    unsigned int ledFrames;
+    // Reboot, forgets everything but the stored settings
+    void reset();
+
+  private:
+    MemoryTransport *_link;
+    // Frame parser like the sketch's
+    enum class RxState {START, CMD, ARGS, END, BIN_LEN, BIN_CMD, BIN_PAYLOAD, BIN_CRC};
+    RxState _rxState;
+    uint8_t _cmd;
+    uint8_t _expected;
+    uint8_t _crc;
+    std::vector<uint8_t> _data;
+    char _replyCmd;
+    uint8_t _replySeq;
+    bool _baudTrial;
+    unsigned long _oldBaud;
+    unsigned long _baudTimer;
+    unsigned long _patternStart;
+    void parseByte(uint8_t c);
+    void handleCommand(uint8_t cmd, const uint8_t *data, uint8_t len);
+    void sendFrame(char cmd, const uint8_t *data, uint8_t len);
+    void sendValue(char cmd, float value);
+    void sendLight();
+    uint8_t buildConfig(uint8_t *blob);
+    // Auto mode state per filter like the sketch's SensorFilter: last sent value and time
+    float _sent[4];
+    unsigned long _lastSent[4];
+    bool _force[4];
+    bool filterPass(int i, float value);
+    void sendAuto();
+    static uint8_t crc8Blob(const uint8_t *blob);
+};
+
+// Steps the virtual clock in 1 ms ticks and runs board and host on each one
+class Simulation {
+  public:
+    Simulation(uint8_t version=SB_PROTOCOL_VERSION);
+    // Drive the library from the virtual clock
+    void attach(SensorBoard *board);
+    void run(unsigned long ms);
+    // Run until the board is ready or the time is up, true if it is ready
+    bool runUntilReady(unsigned long ms=5000);
+    MemoryTransport link;
+    FakeBoard board;
+    SensorBoard *host;
+};
+
+#endif
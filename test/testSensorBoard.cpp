@@ -0,0 +1,805 @@
+/***************************************************
+ Tests of the SensorBoard library against the simulated board
+
+ Run all tests or the ones given by name:
+   testSensorBoard [name ...]
+
+ Feel free to use the code as it is.
+
+ Benjamin Voelker, voelkerb@me.com
+ Embedded Systems
+ University of Freiburg, Institute of Computer Science
+ ****************************************************/
+
+#include "simulation.h"
+#include "sensorBoardReplay.h"
+#include "sensorBoardHub.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+      printf("  %s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+      failures++; \
+    } \
+  } while (0)
+
+#define CHECK_NEAR(a, b, eps) do { \
+    double _a = (a), _b = (b); \
+    if (fabs(_a - _b) > (eps)) { \
+      printf("  %s:%d: CHECK_NEAR(%s, %s) failed: %f vs %f\n", __FILE__, __LINE__, #a, #b, _a, _b); \
+      failures++; \
+    } \
+  } while (0)
+
+// Host with the hysteresis and LED range the tests use
+#define NEW_HOST(name, sim) SensorBoard name(&(sim).link, 0.1, 0.1, 1, 2, 200); (sim).attach(&name)
+
+// Callbacks write here, reset by each test
+static std::vector<BUTTON_PRESS> buttons;
+static std::vector<unsigned long> buttonTimes;
+static std::vector<NEW_SENSOR_VALUE> events;
+static float lastTemp;
+static int temps;
+static SensorBoard *current;
+
+static void onButton(BUTTON_PRESS press) {
+  buttons.push_back(press);
+  buttonTimes.push_back(current->eventTime());
+}
+
+static void onTemp(float temp) {
+  lastTemp = temp;
+  temps++;
+}
+
+static void onEvent(void *arg, NEW_SENSOR_VALUE value) {
+  (void)arg;
+  events.push_back(value);
+}
+
+static void reset(SensorBoard *host) {
+  buttons.clear();
+  buttonTimes.clear();
+  events.clear();
+  lastTemp = 0;
+  temps = 0;
+  current = host;
+  host->buttonCB = &onButton;
+  host->tempCB = &onTemp;
+  host->eventCB = &onEvent;
+}
+
+// Run the callbacks of queued events where the simulation does not, as a consumer task would
+static void dispatch(SensorBoard &host) {
+  #ifdef SB_EVENT_QUEUE
+  host.dispatchEvents();
+  #else
+  (void)host;
+  #endif
+}
+
+// Frames of a command the host received
+static uint32_t framesOf(const SensorBoardStats &stats, char cmd) {
+  return stats.frames[strchr(SB_STATS_COMMANDS, cmd) - SB_STATS_COMMANDS];
+}
+
+static uint32_t totalFrames(const SensorBoardStats &stats) {
+  uint32_t total = 0;
+  for (size_t i = 0; i < SB_STATS_NUM_COMMANDS; i++) total += stats.frames[i];
+  return total;
+}
+
+// _____________________________________Tests____________________________________________________
+
+static void testHandshake() {
+  const uint8_t versions[] = {SB_PROTO_LEGACY, SB_PROTO_BINARY, SB_PROTO_SEQ, SB_PROTO_CONFIG,
+                              SB_PROTO_TIME, SB_PROTO_COMPACT};
+  for (size_t i = 0; i < sizeof(versions); i++) {
+    Simulation sim(versions[i]);
+    NEW_HOST(host, sim);
+    host.init();
+    CHECK(sim.runUntilReady());
+    CHECK(host.protocol == versions[i]);
+    CHECK(sim.board.protocol == versions[i]);
+  }
+}
+
+static void testLegacyEvents() {
+  Simulation sim(SB_PROTO_LEGACY);
+  NEW_HOST(host, sim);
+  reset(&host);
+  host.init();
+  CHECK(sim.runUntilReady());
+  sim.board.press();
+  sim.run(10);
+  sim.board.release();
+  sim.run(10);
+  CHECK(buttons.size() == 2);
+  CHECK(buttons.size() == 2 && buttons[0] == BUTTON_PRESS::PRESS && buttons[1] == BUTTON_PRESS::RELEASE);
+  host.updateTemp(false);
+  sim.run(10);
+  CHECK(temps == 1);
+  CHECK_NEAR(host.temperature, 21.5, 1e-6);
+  // Unknown commands still reach eventCB
+  events.clear();
+  sim.board.sendEvent('x', NULL, 0);
+  sim.run(10);
+  CHECK(events.size() == 1 && events[0] == NEW_SENSOR_VALUE::UNKNOWN);
+}
+
+static void testRequests() {
+  Simulation sim;
+  NEW_HOST(host, sim);
+  reset(&host);
+  // The first handshake reply comes too late, the second try gets it
+  sim.link.delay = SB_INIT_TIMEOUT;
+  host.init();
+  sim.run(SB_INIT_TIMEOUT + 1);
+  sim.link.delay = 0;
+  CHECK(sim.runUntilReady());
+  CHECK(host.stats().retries == 1);
+  host.resetStats();
+  int id = host.requestSensor(NEW_SENSOR_VALUE::NEW_SENSORS);
+  CHECK(id >= 0);
+  CHECK(host.requestState(id) == REQUEST_STATE::PENDING);
+  sim.run(5);
+  CHECK(host.requestState(id) == REQUEST_STATE::DONE);
+  CHECK_NEAR(host.temperature, 21.5, 1e-6);
+  CHECK_NEAR(host.humidity, 40.0, 1e-6);
+  CHECK(host.light == 120);
+
+  // Replies that come too late fail the request
+  sim.link.delay = 200;
+  id = host.requestSensor(NEW_SENSOR_VALUE::NEW_TEMP, 100);
+  sim.run(150);
+  CHECK(host.requestState(id) == REQUEST_STATE::FAILED);
+  sim.run(500);
+  // Both replies, the late one too, and a clock ping on the way
+  SensorBoardStats stats = host.stats();
+  CHECK(framesOf(stats, 's') == 1);
+  CHECK(framesOf(stats, 't') == 1);
+  CHECK(framesOf(stats, 'T') == 1);
+  CHECK(totalFrames(stats) == 3);
+  CHECK(stats.unknownFrames == 0);
+  CHECK(stats.invalidFrames == 0);
+  CHECK(stats.crcErrors == 0);
+  CHECK(stats.resyncs == 0);
+  CHECK(stats.shortReads == 0);
+  CHECK(stats.retries == 0);
+  CHECK(stats.requestTimeouts == 1);
+}
+
+static uint8_t crc8(uint8_t crc, uint8_t data) {
+  crc ^= data;
+  for (int i = 0; i < 8; i++) crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1);
+  return crc;
+}
+
+static void testResync() {
+  Simulation sim(SB_PROTO_BINARY);
+  NEW_HOST(host, sim);
+  reset(&host);
+  host.init();
+  CHECK(sim.runUntilReady());
+  host.resetStats();
+  // A frame with a broken length, its crc byte is the start of the next valid one
+  float temp = 23.0;
+  std::vector<uint8_t> bytes = {SB_FRAME_SOF, 5, 't', 1, 2, 3, 4, 9};
+  bytes.push_back(SB_FRAME_SOF);
+  bytes.push_back(4);
+  bytes.push_back('t');
+  uint8_t crc = crc8(crc8(0, 4), 't');
+  for (int i = 0; i < 4; i++) {
+    bytes.push_back(((uint8_t *)&temp)[i]);
+    crc = crc8(crc, bytes.back());
+  }
+  bytes.push_back(crc);
+  sim.link.boardWrite(bytes.data(), bytes.size());
+  sim.run(5);
+  CHECK(temps == 1);
+  CHECK_NEAR(lastTemp, 23.0, 1e-6);
+  // A valid frame of an unknown command
+  events.clear();
+  sim.board.sendEvent('x', NULL, 0);
+  sim.run(5);
+  CHECK(events.size() == 1 && events[0] == NEW_SENSOR_VALUE::UNKNOWN);
+  // A frame with less payload than its command needs
+  uint8_t half[2] = {0, 0};
+  sim.board.sendEvent('t', half, sizeof(half));
+  sim.run(5);
+  CHECK(temps == 1);
+  SensorBoardStats stats = host.stats();
+  CHECK(framesOf(stats, 't') == 1);
+  CHECK(totalFrames(stats) == 1);
+  CHECK(stats.unknownFrames == 1);
+  CHECK(stats.invalidFrames == 1);
+  CHECK(stats.crcErrors == 1);
+  CHECK(stats.resyncs == 1);
+  CHECK(stats.shortReads == 1);
+  CHECK(stats.retries == 0);
+  CHECK(stats.requestTimeouts == 0);
+}
+
+static void testLEDs() {
+  Simulation sim;
+  NEW_HOST(host, sim);
+  host.init();
+  CHECK(sim.runUntilReady());
+  host.setColor(COLOR_RED);
+  sim.run(100);
+  for (int i = 0; i < NUM_LEDS; i++) CHECK(sim.board.leds[i] == COLOR_RED);
+  CHECK(sim.board.commands['L'] == 1);
+  // A single changed LED goes out as a partial update
+  CRGB colors[NUM_LEDS];
+  for (int i = 0; i < NUM_LEDS; i++) colors[i] = COLOR_RED;
+  colors[1] = COLOR_BLUE;
+  host.setIndividualColors(colors, NUM_LEDS);
+  sim.run(100);
+  CHECK(sim.board.leds[1] == COLOR_BLUE);
+  CHECK(sim.board.leds[0] == COLOR_RED);
+  CHECK(sim.board.commands['U'] == 1);
+  // Nothing changed, nothing is sent
+  unsigned int frames = sim.board.ledFrames;
+  host.setIndividualColors(colors, NUM_LEDS);
+  sim.run(100);
+  CHECK(sim.board.ledFrames == frames);
+}
+
+static void testPatternOnBoard() {
+  Simulation sim;
+  NEW_HOST(host, sim);
+  host.init();
+  CHECK(sim.runUntilReady());
+  host.setColor(COLOR_GREEN);
+  sim.run(100);
+  host.blink(COLOR_RED, 500L);
+  sim.run(100);
+  CHECK(sim.board.pattern == (uint8_t)LEDPattern::blinkPattern);
+  unsigned int frames = sim.board.ledFrames;
+  sim.run(300);
+  // The board animates, the host does not stream frames
+  CHECK(sim.board.ledFrames == frames);
+  sim.run(500);
+  // Expired on the board, the host restored the green
+  CHECK(sim.board.pattern == 0);
+  for (int i = 0; i < NUM_LEDS; i++) CHECK(sim.board.leds[i] == COLOR_GREEN);
+
+  // The expiry of a replaced pattern does not end the new one
+  host.blink(COLOR_RED, 500L);
+  sim.run(400);
+  host.blink(COLOR_BLUE, 3000L);
+  sim.run(110);
+  frames = sim.board.ledFrames;
+  uint8_t expired = (uint8_t)LEDPattern::blinkPattern;
+  sim.board.sendEvent('P', &expired, 1);
+  sim.run(10);
+  CHECK(sim.board.ledFrames == frames);
+  CHECK(sim.board.pattern == (uint8_t)LEDPattern::blinkPattern);
+}
+
+static void testBaudNegotiation() {
+  {
+    Simulation sim;
+    NEW_HOST(host, sim);
+    host.init();
+    CHECK(sim.runUntilReady());
+    CHECK(sim.link.baudRate() == 500000);
+    CHECK(sim.board.storedBaud == 500000);
+    CHECK(sim.link.boardBaud == 500000);
+  }
+  {
+    // The fastest rate fails the echo test, the next one is used
+    Simulation sim;
+    sim.board.badBaud = 500000;
+    NEW_HOST(host, sim);
+    reset(&host);
+    host.init();
+    CHECK(sim.runUntilReady());
+    CHECK(sim.link.baudRate() == 250000);
+    CHECK(sim.board.storedBaud == 250000);
+    // Still talks after the switch
+    host.updateTemp(false);
+    sim.run(10);
+    CHECK(temps == 1);
+  }
+  {
+    // A board that restarted at another rate is found by the scan
+    Simulation sim;
+    sim.board.storedBaud = 115200;
+    sim.board.reset();
+    NEW_HOST(host, sim);
+    host.init();
+    CHECK(sim.runUntilReady(20000));
+    CHECK(sim.link.baudRate() == sim.link.boardBaud);
+  }
+}
+
+static void testConfigSync() {
+  Simulation sim;
+  NEW_HOST(host, sim);
+  host.init();
+  CHECK(sim.runUntilReady());
+  CHECK(sim.board.config[0] == SB_CONFIG_VERSION);
+  host.setBrightness(50);
+  // The push does not take the board out of ready()
+  bool ready = true;
+  for (int i = 0; i < SB_CONFIG_SYNC_DELAY + 1000; i++) {
+    sim.run(1);
+    ready &= host.ready();
+  }
+  CHECK(sim.board.config[1] == 127 || sim.board.config[1] == 128);
+  CHECK(ready);
+  // The board keeps the config across a reboot
+  sim.board.reset();
+  CHECK(sim.board.brightness == sim.board.config[1]);
+}
+
+static void testClockSync() {
+  Simulation sim;
+  sim.board.clockOffset = 123456789;
+  sim.board.clockRate = 1.001;
+  sim.link.delay = 5;
+  NEW_HOST(host, sim);
+  reset(&host);
+  host.init();
+  CHECK(sim.runUntilReady());
+  host.setAutoSensorMode(true);
+  long maxError = 0;
+  long maxEarlyError = 0;
+  for (int i = 0; i < 120; i++) {
+    // Measure once the drift is known
+    if (i == 60) host.resetLatency();
+    sim.run(500);
+    unsigned long sampled = VirtualClock::millis();
+    sim.board.setSensors(20.0 + (i % 2), 40.0, 120, false);
+    sim.run(20);
+    long error = (long)(host.eventTime() - sampled);
+    if (i > 60 && labs(error) > maxError) maxError = labs(error);
+    if (i <= 60 && labs(error) > maxEarlyError) maxEarlyError = labs(error);
+  }
+  // Before the drift is known the estimate is coarse, but a stamp never maps to another wrap
+  CHECK(maxEarlyError < 100);
+  CHECK(host.clockSynced());
+  CHECK_NEAR(host.clockDrift(), 0.001, 0.0003);
+  CHECK(maxError <= (long)host.clockError() + 1);
+  SensorBoardLatency latency = host.latency();
+  CHECK(latency.count > 0);
+  CHECK(latency.count > 0 && latency.sum/latency.count >= 4 && latency.sum/latency.count <= 6);
+}
+
+static void testCompactValues() {
+  size_t bytes[2];
+  const uint8_t versions[2] = {SB_PROTO_TIME, SB_PROTO_COMPACT};
+  for (int v = 0; v < 2; v++) {
+    Simulation sim(versions[v]);
+    sim.board.temp = -12.34;
+    sim.board.light = 70000;
+    NEW_HOST(host, sim);
+    host.init();
+    CHECK(sim.runUntilReady());
+    size_t before = sim.link.bytesToHost;
+    for (int i = 0; i < 10; i++) {
+      host.updateTemp(false);
+      host.updateLight(false);
+      sim.run(5);
+    }
+    bytes[v] = sim.link.bytesToHost - before;
+    CHECK_NEAR(host.temperature, -12.34, 0.006);
+    CHECK(host.light == 70000);
+  }
+  CHECK(bytes[1] < bytes[0]);
+}
+
+// Times of the temperature frames the host received while running ms
+static void runTempFrames(Simulation &sim, SensorBoard &host, unsigned long ms, std::vector<unsigned long> &times) {
+  for (unsigned long i = 0; i < ms; i++) {
+    uint32_t before = framesOf(host.stats(), 't');
+    sim.run(1);
+    if (framesOf(host.stats(), 't') != before) times.push_back(VirtualClock::millis());
+  }
+}
+
+static void testSensorFilter() {
+  Simulation sim;
+  NEW_HOST(host, sim);
+  reset(&host);
+  host.init();
+  CHECK(sim.runUntilReady());
+  CHECK(host.setSensorFilter(NEW_SENSOR_VALUE::NEW_TEMP, 0.5, 1000, 5000));
+  sim.run(10);
+  CHECK(sim.board.filters[0].deadband == 0.5f);
+  CHECK(sim.board.filters[0].minInterval == 1000);
+  CHECK(sim.board.filters[0].maxInterval == 5000);
+  std::vector<unsigned long> times;
+  // Auto mode starts with the current value
+  host.setAutoSensorMode(true);
+  runTempFrames(sim, host, 1500, times);
+  CHECK(times.size() == 1);
+  // Changes within the deadband stay on the board
+  times.clear();
+  sim.board.setSensors(21.8, 40.0, 120, false);
+  runTempFrames(sim, host, 500, times);
+  sim.board.setSensors(21.2, 40.0, 120, false);
+  runTempFrames(sim, host, 500, times);
+  CHECK(times.empty());
+  // A change beyond it goes out at once, the next one not before minInterval
+  unsigned long changed = VirtualClock::millis();
+  sim.board.setSensors(23.0, 40.0, 120, false);
+  runTempFrames(sim, host, 100, times);
+  sim.board.setSensors(25.0, 40.0, 120, false);
+  runTempFrames(sim, host, 1500, times);
+  CHECK(times.size() == 2);
+  CHECK(times.size() == 2 && times[0] - changed <= 5);
+  // Measured on 1 ms ticks
+  CHECK(times.size() == 2 && times[1] - times[0] >= 999 && times[1] - times[0] <= 1005);
+  CHECK_NEAR(host.temperature, 25.0, 1e-6);
+  // An unchanged value is sent again every maxInterval
+  if (times.empty()) return;
+  times.erase(times.begin(), times.end()-1);
+  runTempFrames(sim, host, 11000, times);
+  CHECK(times.size() == 3);
+  for (size_t i = 1; i < times.size(); i++) CHECK(times[i] - times[i-1] >= 4999 && times[i] - times[i-1] <= 5005);
+}
+
+static void testGestures() {
+  Simulation sim;
+  NEW_HOST(host, sim);
+  reset(&host);
+  host.init();
+  CHECK(sim.runUntilReady());
+  host.setGestures(true);
+
+  sim.board.press();
+  sim.run(100);
+  sim.board.release();
+  sim.run(SB_GESTURE_DOUBLE_PRESS + 100);
+  CHECK(buttons.size() == 2);
+  CHECK(buttons.size() == 2 && buttons[0] == BUTTON_PRESS::PROVISIONAL && buttons[1] == BUTTON_PRESS::SINGLE);
+
+  buttons.clear();
+  sim.board.press();
+  sim.run(100);
+  sim.board.release();
+  sim.run(100);
+  sim.board.press();
+  sim.run(100);
+  sim.board.release();
+  sim.run(SB_GESTURE_DOUBLE_PRESS + 100);
+  CHECK(buttons.size() == 3);
+  CHECK(buttons.size() == 3 && buttons[1] == BUTTON_PRESS::CANCEL && buttons[2] == BUTTON_PRESS::DOUBLE);
+
+  buttons.clear();
+  sim.board.press();
+  sim.run(SB_GESTURE_LONG_PRESS + 200);
+  sim.board.release();
+  sim.run(SB_GESTURE_DOUBLE_PRESS + 100);
+  CHECK(buttons.size() >= 3);
+  CHECK(buttons.size() >= 3 && buttons[1] == BUTTON_PRESS::CANCEL && buttons[2] == BUTTON_PRESS::LONG_START);
+
+  host.setGestures(false);
+  buttons.clear();
+  sim.board.press();
+  sim.run(10);
+  CHECK(buttons.size() == 1 && buttons[0] == BUTTON_PRESS::PRESS);
+
+  // A press within the window that reaches the host after it is still a double press
+  Simulation slow;
+  slow.link.delay = 60;
+  NEW_HOST(late, slow);
+  reset(&late);
+  late.init();
+  CHECK(slow.runUntilReady());
+  slow.run(SB_CLOCK_SAMPLES*SB_PING_INTERVAL_FAST);
+  CHECK(late.clockError() < SB_NO_DEADLINE);
+  late.setGestures(true);
+  slow.board.press();
+  slow.run(100);
+  slow.board.release();
+  slow.run(SB_GESTURE_DOUBLE_PRESS - 20);
+  slow.board.press();
+  slow.run(100);
+  slow.board.release();
+  slow.run(SB_GESTURE_DOUBLE_PRESS + 200);
+  CHECK(std::count(buttons.begin(), buttons.end(), BUTTON_PRESS::SINGLE) == 0);
+  CHECK(std::count(buttons.begin(), buttons.end(), BUTTON_PRESS::DOUBLE) == 1);
+}
+
+static std::vector<uint8_t> capture;
+
+static void recordCapture(const uint8_t *data, size_t size) {
+  capture.insert(capture.end(), data, data+size);
+}
+
+static void testRecordReplay() {
+  capture.clear();
+  int recorded;
+  {
+    Simulation sim;
+    NEW_HOST(host, sim);
+    reset(&host);
+    CHECK(host.setRecorder(&recordCapture));
+    host.init();
+    CHECK(sim.runUntilReady());
+    // Too late to replay the handshake
+    CHECK(!host.setRecorder(&recordCapture));
+    // Values come unasked, a replay does not repeat calls of the application
+    sim.board.autoSend = true;
+    sim.run(10);
+    for (int i = 0; i < 20; i++) {
+      sim.board.setSensors(20.0 + i, 40.0, 120, false);
+      sim.run(250);
+    }
+    recorded = temps;
+    host.setRecorder(NULL);
+  }
+  // The value auto mode starts with and one per change
+  CHECK(recorded == 21);
+  char path[] = "/tmp/testSensorBoardXXXXXX";
+  int fd = mkstemp(path);
+  CHECK(fd >= 0);
+  if (fd < 0) return;
+  FILE *file = fdopen(fd, "wb");
+  fwrite(capture.data(), 1, capture.size(), file);
+  fclose(file);
+
+  SensorBoardReplay replay;
+  CHECK(replay.open(path));
+  CHECK(replay.protocol() == SB_PROTOCOL_VERSION);
+  CHECK(replay.baudRate() == FAKE_BOARD_BAUD);
+  SensorBoard host(&replay, 0.1, 0.1, 1, 2, 200);
+  reset(&host);
+  host.setClock(&SensorBoardReplay::clock);
+  host.init();
+  while (replay.step(host.nextDeadline())) host.update();
+  host.update();
+  dispatch(host);
+  CHECK(host.ready());
+  CHECK(temps == recorded);
+  CHECK_NEAR(lastTemp, 39.0, 1e-6);
+  CHECK(replay.txMismatches() == 0);
+  unlink(path);
+}
+
+// One sample every 10 s from start on, valued by its minute since start
+static void addMinutes(SensorHistory &history, unsigned long start, unsigned long from, unsigned long to) {
+  for (unsigned long t = from; t < to; t += 10000) history.add(start + t, (float)(t/SB_HISTORY_MINUTE_MS));
+}
+
+static void testHistory() {
+  SensorHistory history;
+  unsigned long start = 100*SB_HISTORY_HOUR_MS;
+  addMinutes(history, start, 0, 3*SB_HISTORY_HOUR_MS);
+  HistorySample samples[4];
+  CHECK(history.latest(samples, 4) == 4);
+  CHECK(samples[0].time == start + 3*SB_HISTORY_HOUR_MS - 40000 && samples[3].time == start + 3*SB_HISTORY_HOUR_MS - 10000);
+  CHECK(samples[3].value == 179);
+
+  // A recent minute comes from the minute rollups
+  HistoryRollup result;
+  CHECK(history.range(start + 170*SB_HISTORY_MINUTE_MS, start + 171*SB_HISTORY_MINUTE_MS - 1, result));
+  CHECK(result.count == 6 && result.min == 170 && result.max == 170);
+  // The first hour left the minute ring, its hour rollup remains
+  CHECK(history.range(start, start + SB_HISTORY_HOUR_MS - 1, result));
+  CHECK(result.count == 360 && result.min == 0 && result.max == 59);
+  CHECK_NEAR(result.mean(), 29.5, 1e-3);
+  // Across the oldest minute in the ring: the whole second hour, then minutes 120 to 130
+  CHECK(history.range(start + 100*SB_HISTORY_MINUTE_MS, start + 130*SB_HISTORY_MINUTE_MS, result));
+  CHECK(result.count == 360 + 66 && result.min == 60 && result.max == 130);
+
+  // Hours beyond the ring are gone
+  addMinutes(history, start, 3*SB_HISTORY_HOUR_MS, (SB_HISTORY_HOURS+4)*SB_HISTORY_HOUR_MS);
+  CHECK(!history.range(start, start + SB_HISTORY_HOUR_MS - 1, result));
+  CHECK(history.range(start + 4*SB_HISTORY_HOUR_MS, start + 5*SB_HISTORY_HOUR_MS - 1, result));
+  CHECK(result.count == 360 && result.min == 240 && result.max == 299);
+
+  // The board's values across a wrap of the clock
+  Simulation sim;
+  NEW_HOST(host, sim);
+  reset(&host);
+  VirtualClock::set(0UL - 20*SB_HISTORY_MINUTE_MS);
+  host.init();
+  CHECK(sim.runUntilReady());
+  unsigned long from = VirtualClock::millis();
+  sim.board.autoSend = true;
+  for (int i = 0; i < 240; i++) {
+    sim.board.setSensors(20.0 + (i % 2), 40.0, 120, false);
+    sim.run(10000);
+  }
+  CHECK(VirtualClock::millis() < from);
+  CHECK(temps == 240);
+  CHECK(host.tempHistory.range(from, VirtualClock::millis(), result));
+  CHECK(result.count == 240 && result.min == 20 && result.max == 21);
+  // The last ten minutes, all after the wrap, plus the rest of the minute they start in
+  CHECK(host.tempHistory.range(VirtualClock::millis() - 10*SB_HISTORY_MINUTE_MS + 1, VirtualClock::millis(), result));
+  CHECK(result.count >= 60 && result.count <= 66);
+}
+
+static float power;
+
+static float getPower() {
+  return power;
+}
+
+static void testPowerColor() {
+  Simulation sim;
+  NEW_HOST(host, sim);
+  host.init();
+  CHECK(sim.runUntilReady());
+  const CRGB stops[2] = {COLOR_GREEN, COLOR_RED};
+  host.setPowerColorMap(stops, 2);
+  host.activePowerGetter = &getPower;
+  host.displayPowerColor();
+  // The threshold is exact, not rounded to a table entry
+  power = 1.99;
+  sim.run(ACTIVE_POWER_UPDATE+100);
+  CHECK(sim.board.leds[0] == COLOR_BLACK);
+  power = 2.0;
+  sim.run(ACTIVE_POWER_UPDATE+100);
+  CHECK(sim.board.leds[0] != COLOR_BLACK);
+  // Interpolated between the entries
+  power = 101;
+  sim.run(ACTIVE_POWER_UPDATE+100);
+  CHECK_NEAR(sim.board.leds[0].r, 255*101/200.0, 1.5);
+  CHECK_NEAR(sim.board.leds[0].g, 255*99/200.0, 1.5);
+  power = 1000;
+  sim.run(ACTIVE_POWER_UPDATE+100);
+  CHECK(sim.board.leds[0] == COLOR_RED);
+}
+
+static std::vector<size_t> hubEvents;
+
+static void onHubEvent(size_t index, NEW_SENSOR_VALUE value) {
+  (void)value;
+  hubEvents.push_back(index);
+}
+
+static void testHub() {
+  Simulation simA;
+  Simulation simB;
+  NEW_HOST(hostA, simA);
+  NEW_HOST(hostB, simB);
+  hostA.init();
+  hostB.init();
+  CHECK(simA.runUntilReady());
+  CHECK(simB.runUntilReady());
+  // Only the hub updates the hosts from here on
+  simA.host = NULL;
+  simB.host = NULL;
+  reset(&hostA);
+  hubEvents.clear();
+  SensorBoardHub hub;
+  hub.eventCB = &onHubEvent;
+  CHECK(hub.addBoard(&hostA) == 0);
+  CHECK(hub.addBoard(&hostB) == 1);
+  CHECK(hub.addBoard(&hostA) == -1);
+  // The board's own eventCB still runs
+  simA.board.press();
+  simA.run(5);
+  hub.update(0);
+  dispatch(hostA);
+  CHECK(events.size() == 1);
+  CHECK(hubEvents.size() == 1 && hubEvents[0] == 0);
+  // Timers changed behind the hub's back are seen
+  hostB.blink(COLOR_RED, 200L);
+  CHECK(hub.nextDeadline() == std::min(hostA.nextDeadline(), hostB.nextDeadline()));
+  for (int i = 0; i < 1000; i++) {
+    simA.board.update();
+    simB.board.update();
+    hub.update(0);
+    CHECK(hub.nextDeadline() == std::min(hostA.nextDeadline(), hostB.nextDeadline()));
+    VirtualClock::advance(1);
+  }
+  // Expired and restored by the host
+  CHECK(simB.board.pattern == 0);
+  // A negative timeout still polls boards without a descriptor
+  simA.board.press();
+  simA.run(5);
+  hub.update(-1);
+  dispatch(hostA);
+  CHECK(events.size() == 2);
+}
+
+#ifdef SB_EVENT_QUEUE
+static std::vector<float> queuedTemps;
+
+static void onQueuedTemp(float temp) {
+  queuedTemps.push_back(temp);
+}
+
+// Push n new temperatures through the link and parse them without running the callbacks
+static void queueTemps(Simulation &sim, SensorBoard &host, int first, int n) {
+  for (int i = first; i < first+n; i++) sim.board.setSensors(i, sim.board.hum, sim.board.light, sim.board.pir);
+  host.handle();
+}
+
+static void testEventQueue() {
+  Simulation sim;
+  NEW_HOST(host, sim);
+  host.init();
+  CHECK(sim.runUntilReady());
+  // Only this test runs the callbacks from here on
+  sim.host = NULL;
+  host.tempCB = &onQueuedTemp;
+  sim.board.autoSend = true;
+  queuedTemps.clear();
+  uint32_t dropped = host.droppedEvents();
+
+  queueTemps(sim, host, 1, 10);
+  CHECK(queuedTemps.empty());
+  host.dispatchEvents();
+  CHECK(queuedTemps.size() == 10);
+  bool ordered = true;
+  for (size_t i = 0; i < queuedTemps.size(); i++) ordered &= queuedTemps[i] == 1+i;
+  CHECK(ordered);
+
+  // The queue keeps the first events, the rest is counted
+  queuedTemps.clear();
+  queueTemps(sim, host, 100, SB_EVENT_QUEUE_SIZE+5);
+  CHECK(host.droppedEvents() - dropped == 5);
+  host.dispatchEvents();
+  CHECK(queuedTemps.size() == SB_EVENT_QUEUE_SIZE);
+  ordered = true;
+  for (size_t i = 0; i < queuedTemps.size(); i++) ordered &= queuedTemps[i] == 100+i;
+  CHECK(ordered);
+
+  // and works as before once drained
+  queuedTemps.clear();
+  queueTemps(sim, host, 200, 3);
+  host.dispatchEvents();
+  CHECK(queuedTemps.size() == 3 && queuedTemps[0] == 200 && queuedTemps[2] == 202);
+  CHECK(host.droppedEvents() - dropped == 5);
+}
+#endif
+
+// _____________________________________Runner___________________________________________________
+
+struct Test {
+  const char *name;
+  void (*run)();
+};
+
+static const Test tests[] = {
+  {"handshake", &testHandshake},
+  {"legacyEvents", &testLegacyEvents},
+  {"requests", &testRequests},
+  {"resync", &testResync},
+  {"leds", &testLEDs},
+  {"patternOnBoard", &testPatternOnBoard},
+  {"baudNegotiation", &testBaudNegotiation},
+  {"configSync", &testConfigSync},
+  {"clockSync", &testClockSync},
+  {"compactValues", &testCompactValues},
+  {"sensorFilter", &testSensorFilter},
+  {"gestures", &testGestures},
+  {"recordReplay", &testRecordReplay},
+  {"history", &testHistory},
+  {"powerColor", &testPowerColor},
+  {"hub", &testHub},
+  #ifdef SB_EVENT_QUEUE
+  {"eventQueue", &testEventQueue},
+  #endif
+};
+
+int main(int argc, char **argv) {
+  int failed = 0;
+  for (size_t i = 0; i < sizeof(tests)/sizeof(tests[0]); i++) {
+    bool selected = argc < 2;
+    for (int a = 1; a < argc; a++) selected |= strcmp(argv[a], tests[i].name) == 0;
+    if (!selected) continue;
+    int before = failures;
+    tests[i].run();
+    printf("%s %s\n", failures == before ? "PASS" : "FAIL", tests[i].name);
+    if (failures != before) failed++;
+  }
+  printf("%d test(s) failed\n", failed);
+  return failed ? 1 : 0;
+}